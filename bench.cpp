@@ -0,0 +1,358 @@
+// Headless load generator for the chat server.
+//
+// Opens --clients framed sessions, moves them into one room, and has the
+// first --senders of them send timestamped chat lines at a combined --rate
+// messages per second. Every copy the server fans out is timed on arrival,
+// giving end-to-end latency (send -> server -> every other member) in an HDR
+// histogram, plus delivered throughput.
+//
+// The schedule is open-loop and fixed: each sender's slots are spaced evenly
+// and staggered from the others, and latency is measured from the slot's
+// intended time rather than when send() actually ran, so a stalled server
+// shows up as latency instead of quietly lowering the offered load. Runs with
+// the same options issue the same traffic, which keeps results comparable
+// across server versions. Sender and receivers share one clock, so run it
+// on a single host.
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+#include "protocol.h"
+#include "client_net.h"
+#include "histogram.h"
+
+#ifdef _WIN32
+    #define poll WSAPoll
+    using nfds_t = ULONG;
+#else
+    #include <poll.h>
+    #include <fcntl.h>
+    #include <netinet/tcp.h>
+#endif
+
+const int BUFFER_SIZE = 64 * 1024;
+const char BENCH_TAG[] = "]: B "; // Follows the sender's name in every bench chat line
+
+struct BenchConfig {
+    std::string host;
+    int port = 0;
+    int clients = 100;
+    int senders = 10;
+    int rate = 1000;    // Messages per second across all senders
+    int duration = 10;  // Measured seconds
+    int warmup = 2;     // Seconds sent but not recorded
+    int size = 64;      // Chat payload bytes
+    int threads = 4;
+    std::string room = "bench";
+};
+
+using bench_clock = std::chrono::steady_clock;
+
+struct Connection {
+    socket_t fd = INVALID_SOCKET;
+    std::string preamble;
+    FrameDecoder frames;
+    std::string out; // Bytes the socket hasn't taken yet
+    int sender = -1; // Index among senders, or -1
+    uint64_t seq = 0;
+    bool open = true;
+};
+
+// Results from one worker thread, merged at the end
+struct WorkerStats {
+    LatencyHistogram latency; // Nanoseconds
+    uint64_t sent = 0;        // Measured messages sent
+    std::atomic<uint64_t> received{0}; // Measured copies received; main polls it
+    uint64_t disconnects = 0;
+};
+
+bench_clock::time_point bench_start;
+std::atomic<bool> stop_receiving(false);
+
+int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - bench_start).count();
+}
+
+// The send schedule, in nanoseconds since bench_start. Sender s owns slots
+// offset(s) + k * interval; those before warmup_end are not recorded.
+const int64_t NS_PER_SEC = 1000000000;
+int64_t slot_interval(const BenchConfig& config) { return NS_PER_SEC * config.senders / config.rate; }
+int64_t slot_offset(const BenchConfig& config, int sender) {
+    // Staggered across one interval so the senders don't fire together
+    return slot_interval(config) * sender / config.senders;
+}
+int64_t warmup_end_ns(const BenchConfig& config) { return (int64_t)config.warmup * NS_PER_SEC; }
+int64_t send_end_ns(const BenchConfig& config) {
+    return warmup_end_ns(config) + (int64_t)config.duration * NS_PER_SEC;
+}
+
+bool set_nonblocking(socket_t sock) {
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(sock, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    return flags != -1 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) != -1;
+#endif
+}
+
+bool would_block(int err) {
+#ifdef _WIN32
+    return err == WSAEWOULDBLOCK;
+#else
+    return err == EAGAIN || err == EWOULDBLOCK;
+#endif
+}
+
+// Writes as much of conn.out as the socket accepts
+bool flush_output(Connection& conn) {
+    size_t offset = 0;
+    while (offset < conn.out.size()) {
+        int sent = send(conn.fd, conn.out.data() + offset, (int)(conn.out.size() - offset), 0);
+        if (sent > 0) {
+            offset += sent;
+            continue;
+        }
+        if (sent < 0 && would_block(socket_error())) break;
+        return false;
+    }
+    conn.out.erase(0, offset);
+    return true;
+}
+
+// Payload: tag, intended send time, measured flag, then padding to --size
+std::string make_payload(int64_t stamp, bool measured, int size) {
+    std::string payload = "B " + std::to_string(stamp) + (measured ? " 1 " : " 0 ");
+    if ((int)payload.size() < size) payload.append(size - payload.size(), 'x');
+    return payload;
+}
+
+void on_frame(WorkerStats& stats, unsigned char type, const char* payload, size_t len) {
+    if (type == FRAME_ROOM_LINE && len >= 8) {
+        payload += 8; // Sequence number
+        len -= 8;
+    } else if (type != FRAME_TEXT) {
+        return;
+    }
+    std::string line(payload, len);
+    size_t tag = line.find(BENCH_TAG);
+    if (tag == std::string::npos) return; // Join notices, replies to commands
+    const char* p = line.c_str() + tag + sizeof(BENCH_TAG) - 1;
+    char* end = nullptr;
+    long long stamp = strtoll(p, &end, 10);
+    if (end == p || end[0] != ' ' || end[1] != '1') return; // Warm-up traffic
+    int64_t latency = now_ns() - stamp;
+    stats.latency.record(latency > 0 ? (uint64_t)latency : 0);
+    ++stats.received;
+}
+
+bool on_readable(Connection& conn, WorkerStats& stats) {
+    char buffer[BUFFER_SIZE];
+    while (true) {
+        int n = recv(conn.fd, buffer, BUFFER_SIZE, 0);
+        if (n == 0) return false;
+        if (n < 0) return would_block(socket_error());
+        const char* data = buffer;
+        size_t len = n;
+        if (conn.preamble.size() < PROTOCOL_PREAMBLE_SIZE) {
+            size_t take = std::min(len, PROTOCOL_PREAMBLE_SIZE - conn.preamble.size());
+            conn.preamble.append(data, take);
+            data += take;
+            len -= take;
+            size_t magic_seen = std::min(conn.preamble.size(), PROTOCOL_MAGIC_SIZE);
+            if (conn.preamble.compare(0, magic_seen, PROTOCOL_MAGIC, magic_seen) != 0) return false;
+        }
+        bool ok = conn.frames.feed(data, len, [&](unsigned char type, const char* payload, size_t plen) {
+            if (type == FRAME_PING) conn.out += encode_frame(FRAME_PONG, payload, plen); // Receivers never send otherwise
+            else on_frame(stats, type, payload, plen);
+        });
+        if (!ok || (!conn.out.empty() && !flush_output(conn))) return false;
+    }
+}
+
+// Drives a slice of the connections until told to stop
+void run_worker(const BenchConfig& config, std::vector<Connection>* conns, WorkerStats* stats) {
+    const int64_t interval = slot_interval(config);
+    const int64_t warmup_end = warmup_end_ns(config);
+    const int64_t send_end = send_end_ns(config);
+    std::vector<struct pollfd> fds(conns->size());
+
+    while (!stop_receiving.load()) {
+        int64_t now = now_ns();
+
+        // 1. Send every slot that is due
+        int64_t next_due = -1;
+        for (Connection& conn : *conns) {
+            if (conn.sender < 0 || !conn.open) continue;
+            int64_t offset = slot_offset(config, conn.sender);
+            while (true) {
+                int64_t slot = offset + (int64_t)conn.seq * interval;
+                if (slot >= send_end) break;
+                if (slot > now) {
+                    if (next_due < 0 || slot < next_due) next_due = slot;
+                    break;
+                }
+                bool measured = slot >= warmup_end;
+                conn.out += encode_frame(FRAME_CHAT, make_payload(slot, measured, config.size));
+                ++conn.seq;
+                if (measured) ++stats->sent;
+            }
+            if (!conn.out.empty() && !flush_output(conn)) conn.open = false;
+        }
+
+        // 2. Wait for input or the next slot
+        int timeout = 50;
+        if (next_due >= 0) timeout = (int)std::min<int64_t>(timeout, std::max<int64_t>(0, (next_due - now) / 1000000));
+        for (size_t i = 0; i < conns->size(); ++i) {
+            Connection& conn = (*conns)[i];
+            fds[i].fd = conn.open ? conn.fd : INVALID_SOCKET;
+            fds[i].events = POLLIN | (conn.out.empty() ? 0 : POLLOUT);
+            fds[i].revents = 0;
+        }
+        int ready = poll(fds.data(), (nfds_t)fds.size(), timeout);
+        if (ready <= 0) continue;
+
+        // 3. Read and time whatever arrived
+        for (size_t i = 0; i < conns->size(); ++i) {
+            Connection& conn = (*conns)[i];
+            if (!conn.open || fds[i].revents == 0) continue;
+            bool ok = true;
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) ok = on_readable(conn, *stats);
+            if (ok && (fds[i].revents & POLLOUT)) ok = flush_output(conn);
+            if (!ok) {
+                conn.open = false;
+                ++stats->disconnects;
+            }
+        }
+    }
+}
+
+void print_usage(const char* argv0) {
+    std::cerr << "Usage: " << argv0 << " <server_ip> <server_port> [--clients N] [--senders N] [--rate MSGS_PER_SEC]\n"
+              << "       [--duration SEC] [--warmup SEC] [--size BYTES] [--threads N] [--room NAME]" << std::endl;
+}
+
+bool parse_args(int argc, char* argv[], BenchConfig& config) {
+    if (argc < 3) return false;
+    config.host = argv[1];
+    try {
+        config.port = std::stoi(argv[2]);
+        for (int i = 3; i < argc; i += 2) {
+            std::string flag = argv[i];
+            if (i + 1 >= argc) return false;
+            std::string value = argv[i + 1];
+            if (flag == "--clients") config.clients = std::stoi(value);
+            else if (flag == "--senders") config.senders = std::stoi(value);
+            else if (flag == "--rate") config.rate = std::stoi(value);
+            else if (flag == "--duration") config.duration = std::stoi(value);
+            else if (flag == "--warmup") config.warmup = std::stoi(value);
+            else if (flag == "--size") config.size = std::stoi(value);
+            else if (flag == "--threads") config.threads = std::stoi(value);
+            else if (flag == "--room") config.room = value;
+            else return false;
+        }
+    } catch (...) {
+        return false;
+    }
+    return config.port > 0 && config.port <= 65535 && config.clients >= 2 && config.senders >= 1 &&
+           config.senders <= config.clients && config.rate >= 1 && config.duration >= 1 && config.warmup >= 0 &&
+           config.size >= 0 && config.threads >= 1;
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    if (!parse_args(argc, argv, config)) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    config.threads = std::min(config.threads, config.clients);
+
+    init_sockets();
+
+    // 1. Connect and log in every session
+    std::vector<std::vector<Connection>> slices(config.threads);
+    for (int i = 0; i < config.clients; ++i) {
+        socket_t sock = connect_to_server(config.host.c_str(), config.port);
+        if (sock == INVALID_SOCKET) {
+            std::cerr << "Connected " << i << " of " << config.clients << " sessions." << std::endl;
+            cleanup_sockets();
+            return EXIT_FAILURE;
+        }
+        std::string hello = protocol_preamble() + encode_frame(FRAME_LOGIN, "bench_" + std::to_string(i)) +
+                            encode_frame(FRAME_CHAT, "/join " + config.room);
+        if (!send_all(sock, hello) || !set_nonblocking(sock)) {
+            std::cerr << "Login failed for session " << i << "." << std::endl;
+            close_socket(sock);
+            cleanup_sockets();
+            return EXIT_FAILURE;
+        }
+#ifndef _WIN32
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#endif
+        Connection conn;
+        conn.fd = sock;
+        if (i < config.senders) conn.sender = i;
+        slices[i % config.threads].push_back(std::move(conn));
+    }
+
+    // 2. Let join traffic settle, then run the schedule
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    std::vector<WorkerStats> stats(config.threads);
+    std::vector<std::thread> workers;
+    bench_start = bench_clock::now();
+    for (int t = 0; t < config.threads; ++t) workers.emplace_back(run_worker, std::cref(config), &slices[t], &stats[t]);
+
+    // 3. Stop once every copy has arrived, or after a grace period
+    uint64_t expected_sends = 0;
+    for (int s = 0; s < config.senders; ++s) {
+        for (int64_t slot = slot_offset(config, s); slot < send_end_ns(config); slot += slot_interval(config)) {
+            if (slot >= warmup_end_ns(config)) ++expected_sends;
+        }
+    }
+    const uint64_t expected = expected_sends * (uint64_t)(config.clients - 1);
+    const int64_t deadline = send_end_ns(config) + 5 * NS_PER_SEC;
+    while (now_ns() < deadline) {
+        uint64_t received = 0;
+        for (const WorkerStats& s : stats) received += s.received.load(std::memory_order_relaxed);
+        if (received >= expected && now_ns() > send_end_ns(config)) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    stop_receiving = true;
+    for (std::thread& worker : workers) worker.join();
+    double elapsed = (double)now_ns() / 1e9 - config.warmup;
+
+    // 4. Report
+    WorkerStats total;
+    for (const WorkerStats& s : stats) {
+        total.latency.merge(s.latency);
+        total.sent += s.sent;
+        total.received += s.received.load();
+        total.disconnects += s.disconnects;
+    }
+    for (std::vector<Connection>& slice : slices) {
+        for (Connection& conn : slice) close_socket(conn.fd);
+    }
+    cleanup_sockets();
+
+    const LatencyHistogram& h = total.latency;
+    std::cout << std::fixed << std::setprecision(3)
+              << "clients " << config.clients << " senders " << config.senders << " rate " << config.rate
+              << " size " << config.size << " duration " << config.duration << "s\n"
+              << "sent " << total.sent << " delivered " << total.received.load() << " expected " << expected
+              << " lost " << (expected > total.received.load() ? expected - total.received.load() : 0)
+              << " disconnects " << total.disconnects << "\n"
+              << "throughput " << (double)total.received.load() / elapsed << " msg/s\n"
+              << "latency_us mean " << h.mean() / 1e3 << " p50 " << h.percentile(0.50) / 1e3
+              << " p90 " << h.percentile(0.90) / 1e3 << " p99 " << h.percentile(0.99) / 1e3
+              << " p999 " << h.percentile(0.999) / 1e3 << " max " << h.max() / 1e3 << std::endl;
+    return total.received.load() == expected ? 0 : 2;
+}
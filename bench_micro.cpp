@@ -0,0 +1,514 @@
+// Microbenchmarks for the server's hot paths.
+//
+// Each case times one step of handling a chat line twice. The baseline is
+// the code the server started out with, kept here as it was. The current
+// implementation is the server's own code, compiled in from server.cpp with
+// its main() left out.
+//
+// The cases are:
+//   username   claiming a unique display name with N users online
+//   fanout     broadcast_message to N members, each an in-memory sink
+//   receive    trimming a read's lines and building the outgoing chat line
+//   log        one "Message from" log line
+//
+// Inputs come from a fixed seed and every case runs a fixed number of ops,
+// so two runs do the same work. Each case is run once untimed to warm
+// caches and slabs. It is then run --reps times, and the median per-op time
+// is reported. Cycles are TSC ticks, measured on x86 only. Allocations are
+// every global operator new on the benchmark thread. They don't depend on
+// timing, so a current case with an allocation budget fails the run when it
+// goes over. Setup and draining the sinks between batches are not timed.
+
+#define CHAT_NO_MAIN
+#include "server.cpp"
+
+#include <fcntl.h>
+#include <functional>
+#include <iomanip>
+#include <new>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    #ifdef _MSC_VER
+        #include <intrin.h>
+    #else
+        #include <x86intrin.h>
+    #endif
+    #define CHAT_BENCH_CYCLES 1
+#endif
+
+#ifdef _WIN32
+    #include <io.h>
+    #define dup _dup
+    #define dup2 _dup2
+    const char NULL_DEVICE[] = "NUL";
+#else
+    const char NULL_DEVICE[] = "/dev/null";
+#endif
+
+// ---------------------------------------------------------------------------
+// Allocation counting: every global operator new on this thread
+
+// GCC sees through the replacement and takes the free() below for a
+// mismatch with the caller's new
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+    #pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+thread_local uint64_t thread_allocs = 0;
+thread_local uint64_t thread_alloc_bytes = 0;
+
+void* operator new(size_t bytes) {
+    ++thread_allocs;
+    thread_alloc_bytes += bytes;
+    void* p = std::malloc(bytes > 0 ? bytes : 1);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t bytes) {
+    return operator new(bytes);
+}
+
+void* operator new(size_t bytes, const std::nothrow_t&) noexcept {
+    ++thread_allocs;
+    thread_alloc_bytes += bytes;
+    return std::malloc(bytes > 0 ? bytes : 1);
+}
+
+void* operator new[](size_t bytes, const std::nothrow_t& tag) noexcept {
+    return operator new(bytes, tag);
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+
+// ---------------------------------------------------------------------------
+// Harness
+
+inline uint64_t cycle_count() {
+#if defined(CHAT_BENCH_CYCLES)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Adds up the timed stretches of one run; a case brackets the work it wants
+// measured with start() and stop()
+struct Meter {
+    uint64_t ns = 0;
+    uint64_t cycles = 0;
+    uint64_t allocs = 0;
+    uint64_t alloc_bytes = 0;
+
+    void start() {
+        allocs_at_ = thread_allocs;
+        bytes_at_ = thread_alloc_bytes;
+        started_ = std::chrono::steady_clock::now();
+        cycles_at_ = cycle_count();
+    }
+
+    void stop() {
+        uint64_t cycles_now = cycle_count();
+        auto now = std::chrono::steady_clock::now();
+        cycles += cycles_now - cycles_at_;
+        ns += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now - started_).count();
+        allocs += thread_allocs - allocs_at_;
+        alloc_bytes += thread_alloc_bytes - bytes_at_;
+    }
+
+private:
+    std::chrono::steady_clock::time_point started_;
+    uint64_t cycles_at_ = 0;
+    uint64_t allocs_at_ = 0;
+    uint64_t bytes_at_ = 0;
+};
+
+struct MicroCase {
+    std::string name;
+    size_t ops;         // Per run
+    long alloc_budget;  // Most allocations per op, -1 for no budget
+    std::function<void(Meter&, size_t)> run;
+};
+
+// Keeps results alive so the compiler can't drop the work
+volatile size_t bench_checksum = 0;
+
+// Ops between untimed drains, well inside any queue or ring they fill
+const size_t BENCH_BATCH = 256;
+
+// Points stdout at the null device while log cases run, so the writes they
+// do cost what they would on a real stream without flooding the report
+class MutedStdout {
+public:
+    MutedStdout() {
+        std::cout.flush();
+        saved_ = dup(1);
+        int null_fd = open(NULL_DEVICE, O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, 1);
+            close(null_fd);
+        }
+    }
+
+    ~MutedStdout() {
+        std::cout.flush();
+        Logger::instance().flush();
+        if (saved_ >= 0) {
+            dup2(saved_, 1);
+            close(saved_);
+        }
+    }
+
+private:
+    int saved_;
+};
+
+// ---------------------------------------------------------------------------
+// Baselines, as in the original thread-per-client server
+
+// The name claim loop from handle_client: every clash restarts the scan over
+// every connected client
+std::string baseline_claim(std::map<socket_t, std::string>& clients, std::mutex& mutex,
+                           const std::string& username, socket_t client_socket) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string final_username = username;
+    int count = 1;
+    bool exists = true;
+    while (exists) {
+        exists = false;
+        for (const auto& pair : clients) {
+            if (pair.second == final_username) {
+                exists = true;
+                final_username = username + "_" + std::to_string(count++);
+                break;
+            }
+        }
+    }
+    clients[client_socket] = final_username;
+    return final_username;
+}
+
+// broadcast_message, with each send() copying into the sink for that socket
+void baseline_broadcast(const std::map<socket_t, std::string>& clients, std::mutex& mutex,
+                        std::vector<std::string>& sinks, const std::string& message, socket_t sender_socket) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto& pair : clients) {
+        socket_t client_socket = pair.first;
+        if (client_socket != sender_socket && client_socket != INVALID_SOCKET) {
+            sinks[(size_t)client_socket].append(message.c_str(), message.length());
+        }
+    }
+}
+
+// One line through handle_client's message loop: copied out of the buffer,
+// trimmed and formatted for the broadcast
+size_t baseline_receive(const char* buffer, size_t len, const std::string& username) {
+    std::string message(buffer, len);
+    size_t last_char = message.find_last_not_of(" \n\r\t");
+    if (last_char != std::string::npos) {
+        message = message.substr(0, last_char + 1);
+    } else {
+        message = "";
+    }
+    if (message.empty()) return 0;
+    std::string broadcast_msg = "[" + username + "]: " + message;
+    return broadcast_msg.size();
+}
+
+// log_event, writing each line to std::cout as it is made
+void baseline_log_event(const std::string& message) {
+    auto now = std::chrono::system_clock::now();
+    std::time_t now_c = std::chrono::system_clock::to_time_t(now);
+    std::tm now_tm;
+    #ifdef _WIN32
+        localtime_s(&now_tm, &now_c);
+    #else
+        localtime_r(&now_c, &now_tm);
+    #endif
+
+    std::cout << "[" << std::put_time(&now_tm, "%Y-%m-%d %H:%M:%S") << "] " << message << std::endl;
+}
+
+// ---------------------------------------------------------------------------
+// Inputs
+
+// Chat lines of 8 to 120 characters, some with trailing whitespace, each
+// ending in a newline
+std::vector<std::string> bench_lines(size_t count) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz      ";
+    static const char* endings[] = {"\n", "\r\n", " \n", "\t\r\n"};
+    std::minstd_rand random(42);
+    std::vector<std::string> lines;
+    for (size_t i = 0; i < count; ++i) {
+        size_t len = 8 + random() % 113;
+        std::string line;
+        for (size_t j = 0; j < len; ++j) line += alphabet[random() % (sizeof(alphabet) - 1)];
+        line[0] = 'x'; // Never all blanks
+        line += endings[random() % 4];
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+// Sessions standing in for clients: nothing reads their sockets, and the
+// flush is marked as already requested so queue_output never wakes a reactor
+SessionList bench_sinks(size_t count) {
+    SessionList sinks;
+    for (size_t i = 0; i < count; ++i) {
+        SessionPtr session = std::make_shared<Session>((socket_t)(1000 + i), reactors[0].get(), 0);
+        session->state = SessionState::Chatting;
+        session->username = "user_" + std::to_string(i);
+        session->shared_name = std::make_shared<const std::string>(session->username);
+        session->flush_scheduled.store(true);
+        sinks.push_back(session);
+    }
+    return sinks;
+}
+
+void drain_sinks(const SessionList& sinks) {
+    MessageRef message;
+    for (const SessionPtr& session : sinks) {
+        while (session->outbox.pop(message)) {}
+        session->queued_bytes.store(0, std::memory_order_relaxed);
+    }
+    message = MessageRef();
+}
+
+// ---------------------------------------------------------------------------
+// Cases
+
+// Users already online: N distinct names, or a crowd that all asked for
+// "Guest" and got Guest, Guest_1, ...
+std::vector<std::string> online_names(size_t count, bool crowd) {
+    std::vector<std::string> names;
+    for (size_t i = 0; i < count; ++i) {
+        if (!crowd) names.push_back("user_" + std::to_string(i));
+        else names.push_back(i == 0 ? std::string("Guest") : "Guest_" + std::to_string(i));
+    }
+    return names;
+}
+
+void add_username_cases(std::vector<MicroCase>& cases, size_t users, bool crowd) {
+    std::string prefix = "username/" + std::string(crowd ? "crowd-" : "distinct-") + std::to_string(users);
+    std::string requested = crowd ? "Guest" : "newcomer";
+    // The baseline's crowd case rescans everyone for each of N clashes
+    size_t baseline_ops = crowd ? std::max<size_t>(20, 20000000 / (users * users)) : 200000 / users * 10;
+
+    cases.push_back({prefix + "/baseline", baseline_ops, -1, [users, crowd, requested](Meter& meter, size_t ops) {
+        std::map<socket_t, std::string> clients;
+        std::mutex mutex;
+        std::vector<std::string> names = online_names(users, crowd);
+        for (size_t i = 0; i < names.size(); ++i) clients[(socket_t)(i + 1)] = names[i];
+        socket_t newcomer = (socket_t)(users + 1);
+        meter.start();
+        for (size_t i = 0; i < ops; ++i) {
+            bench_checksum += baseline_claim(clients, mutex, requested, newcomer).size();
+            std::lock_guard<std::mutex> lock(mutex);
+            clients.erase(newcomer);
+        }
+        meter.stop();
+    }});
+
+    cases.push_back({prefix + "/current", 200000, -1, [users, crowd, requested](Meter& meter, size_t ops) {
+        UserDirectory directory;
+        for (size_t i = 0; i < users; ++i) directory.claim(crowd ? "Guest" : "user_" + std::to_string(i), SessionPtr());
+        meter.start();
+        for (size_t i = 0; i < ops; ++i) {
+            std::string name = directory.claim(requested, SessionPtr());
+            bench_checksum += name.size();
+            directory.release(name);
+        }
+        meter.stop();
+    }});
+}
+
+void add_fanout_cases(std::vector<MicroCase>& cases, size_t members) {
+    std::string prefix = "fanout/" + std::to_string(members);
+    size_t ops = std::max<size_t>(BENCH_BATCH, 2000000 / members / BENCH_BATCH * BENCH_BATCH);
+    std::string body = bench_lines(1)[0];
+    body.resize(scan_trim_right(body.data(), body.size()));
+
+    cases.push_back({prefix + "/baseline", ops, -1, [members, body](Meter& meter, size_t ops) {
+        std::map<socket_t, std::string> clients;
+        std::mutex mutex;
+        std::vector<std::string> sinks(members + 1);
+        for (size_t i = 1; i <= members; ++i) clients[(socket_t)i] = "user_" + std::to_string(i);
+        std::string message = "[user_1]: " + body;
+        for (size_t done = 0; done < ops; done += BENCH_BATCH) {
+            meter.start();
+            for (size_t i = 0; i < BENCH_BATCH; ++i) baseline_broadcast(clients, mutex, sinks, message, 1);
+            meter.stop();
+            bench_checksum += sinks[members].size();
+            for (std::string& sink : sinks) sink.clear();
+        }
+    }});
+
+    // Capped at the outbox depth so a full queue never turns this into a
+    // drop count
+    cases.push_back({prefix + "/current", ops, 0, [members, body](Meter& meter, size_t ops) {
+        SessionList sinks = bench_sinks(members);
+        Room room("bench", 1);
+        {
+            std::lock_guard<std::mutex> lock(rooms_mutex);
+            for (const SessionPtr& sink : sinks) room_update(room, sink, true);
+        }
+        MessageRef line = Message::chat(sinks[0]->shared_name, body.data(), body.size(), 0, 1);
+        size_t batch = std::min(BENCH_BATCH, (size_t)OUTBOUND_QUEUE_DEPTH);
+        for (size_t done = 0; done < ops; done += batch) {
+            meter.start();
+            for (size_t i = 0; i < batch; ++i) broadcast_message(room, line, sinks[0].get());
+            meter.stop();
+            bench_checksum += sinks.back()->queued_bytes.load();
+            drain_sinks(sinks);
+        }
+    }});
+}
+
+void add_receive_cases(std::vector<MicroCase>& cases) {
+    const size_t LINES = 64;
+    std::vector<std::string> lines = bench_lines(LINES);
+    std::string read_buffer;
+    for (const std::string& line : lines) read_buffer += line;
+
+    // One recv() per line, as old clients sent them
+    cases.push_back({"receive/baseline", LINES * 4000, -1, [lines](Meter& meter, size_t ops) {
+        std::string username = "alice";
+        meter.start();
+        for (size_t i = 0; i < ops; ++i) {
+            const std::string& line = lines[i % lines.size()];
+            bench_checksum += baseline_receive(line.data(), line.size(), username);
+        }
+        meter.stop();
+    }});
+
+    // The whole read split at once, each line trimmed and checked in place
+    // and copied once, into its Message, as session_message does
+    cases.push_back({"receive/current", LINES * 4000, 0, [read_buffer](Meter& meter, size_t ops) {
+        SharedName name = std::make_shared<const std::string>("alice");
+        LineDecoder decoder(true);
+        uint64_t seq = 0;
+        size_t total = 0;
+        auto on_line = [&](const char* data, size_t len) {
+            len = scan_trim_right(data, len);
+            if (len == 0 || !scan_utf8_valid(data, len)) return;
+            MessageRef line = Message::chat(name, data, len, 0, ++seq);
+            total += line->wire_size(WireFormat::Text);
+        };
+        meter.start();
+        for (size_t done = 0; done < ops; done += LINES) decoder.feed(read_buffer.data(), read_buffer.size(), on_line);
+        meter.stop();
+        bench_checksum += total;
+    }});
+}
+
+void add_log_cases(std::vector<MicroCase>& cases) {
+    std::vector<std::string> lines = bench_lines(64);
+    for (std::string& line : lines) line.resize(scan_trim_right(line.data(), line.size()));
+
+    cases.push_back({"log/baseline", 100000, -1, [lines](Meter& meter, size_t ops) {
+        MutedStdout muted;
+        std::string username = "alice";
+        meter.start();
+        for (size_t i = 0; i < ops; ++i) baseline_log_event("Message from " + username + ": " + lines[i % lines.size()]);
+        meter.stop();
+    }});
+
+    // What the calling reactor pays; the writer thread formats and writes
+    // behind it. Drained between batches so the ring never drops a line.
+    cases.push_back({"log/current", 100000, 0, [lines](Meter& meter, size_t ops) {
+        MutedStdout muted;
+        std::string username = "alice";
+        for (size_t done = 0; done < ops; done += BENCH_BATCH) {
+            meter.start();
+            for (size_t i = done; i < done + BENCH_BATCH; ++i) {
+                const std::string& line = lines[i % lines.size()];
+                log_event(LogLevel::Info, {"Message from ", username, ": ", LogPiece(line.data(), line.size())});
+            }
+            meter.stop();
+            Logger::instance().flush();
+        }
+    }});
+}
+
+// ---------------------------------------------------------------------------
+
+void print_usage(const char* argv0) {
+    std::cerr << "Usage: " << argv0 << " [--filter TEXT] [--reps N]" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::string filter;
+    int reps = 5;
+    try {
+        for (int i = 1; i < argc; i += 2) {
+            std::string flag = argv[i];
+            if (i + 1 >= argc) throw std::invalid_argument(flag);
+            if (flag == "--filter") filter = argv[i + 1];
+            else if (flag == "--reps") reps = std::stoi(argv[i + 1]);
+            else throw std::invalid_argument(flag);
+        }
+    } catch (...) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (reps < 1) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // One reactor, never started, owns the sinks; this thread stands in for
+    // its loop
+    reactors.emplace_back(new Reactor(0));
+    current_reactor = reactors[0].get();
+
+    std::vector<MicroCase> cases;
+    for (size_t users : {100, 1000}) {
+        add_username_cases(cases, users, false);
+        add_username_cases(cases, users, true);
+    }
+    for (size_t members : {10, 100, 1000}) add_fanout_cases(cases, members);
+    add_receive_cases(cases);
+    add_log_cases(cases);
+
+    std::cout << std::left << std::setw(32) << "case" << std::right << std::setw(10) << "ops" << std::setw(12)
+              << "ns/op" << std::setw(12) << "cycles/op" << std::setw(12) << "allocs/op" << std::setw(12)
+              << "bytes/op" << std::endl;
+    bool over_budget = false;
+    for (const MicroCase& c : cases) {
+        if (!filter.empty() && c.name.find(filter) == std::string::npos) continue;
+        Meter warmup;
+        c.run(warmup, c.ops);
+        std::vector<double> ns, cycles;
+        double allocs = 0, alloc_bytes = 0;
+        for (int r = 0; r < reps; ++r) {
+            Meter meter;
+            c.run(meter, c.ops);
+            ns.push_back((double)meter.ns / c.ops);
+            cycles.push_back((double)meter.cycles / c.ops);
+            allocs = std::max(allocs, (double)meter.allocs / c.ops);
+            alloc_bytes = std::max(alloc_bytes, (double)meter.alloc_bytes / c.ops);
+        }
+        std::sort(ns.begin(), ns.end());
+        std::sort(cycles.begin(), cycles.end());
+        std::cout << std::left << std::setw(32) << c.name << std::right << std::setw(10) << c.ops << std::fixed
+                  << std::setprecision(1) << std::setw(12) << ns[ns.size() / 2] << std::setw(12);
+#if defined(CHAT_BENCH_CYCLES)
+        std::cout << cycles[cycles.size() / 2];
+#else
+        std::cout << "-";
+#endif
+        std::cout << std::setprecision(2) << std::setw(12) << allocs << std::setprecision(1) << std::setw(12)
+                  << alloc_bytes << std::endl;
+        if (c.alloc_budget >= 0 && allocs > (double)c.alloc_budget) {
+            std::cerr << c.name << ": " << allocs << " allocations per op, budget " << c.alloc_budget << std::endl;
+            over_budget = true;
+        }
+    }
+    // The logger thread is still running; skip static destructors as the
+    // server does
+    std::cout.flush();
+    std::_Exit(over_budget ? EXIT_FAILURE : EXIT_SUCCESS);
+}
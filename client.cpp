@@ -5,107 +5,744 @@
 #include <cstring>    
 #include <cerrno>     
 #include <vector>     
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+#include <set>
+
+#include "protocol.h"
+#include "client_net.h"
+
+#ifndef _WIN32
+    #include <termios.h>
+#endif
 
-// Platform specific includes and definitions
-#ifdef _WIN32
-    #ifndef _WIN32_WINNT
-    #define _WIN32_WINNT 0x0600 
-    #endif
-
-    #define _WINSOCK_DEPRECATED_NO_WARNINGS 
-    #include <winsock2.h>
-    #include <ws2tcpip.h> 
-    #pragma comment(lib, "ws2_32.lib") 
-    using socket_t = SOCKET;
-    using socklen_t = int;
-    #define close_socket(s) closesocket(s)
-    #define socket_error() WSAGetLastError()
-    #define SHUT_WR SD_SEND 
-    inline void init_sockets() {
-        WSADATA wsaData;
-        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-            std::cerr << "WSAStartup failed. Error Code: " << socket_error() << std::endl;
-            exit(EXIT_FAILURE);
-        }
-    }
-    inline void cleanup_sockets() { WSACleanup(); }
-#else // Linux, macOS, etc. (POSIX)
-    #include <sys/socket.h>
-    #include <netinet/in.h>
-    #include <arpa/inet.h>  
-    #include <unistd.h>     
-    #include <netdb.h>      
-    #include <sys/ioctl.h>  
-    using socket_t = int;
-    #define INVALID_SOCKET -1
-    #define SOCKET_ERROR   -1
-    #define close_socket(s) close(s)
-    #define socket_error() errno
-    inline void init_sockets() {} 
-    inline void cleanup_sockets() {} 
+#if defined(CHAT_HAVE_ZLIB)
+    #include <zlib.h>
+#endif
+#if defined(CHAT_HAVE_OPENSSL) && !defined(_WIN32)
+    #include <openssl/ssl.h>
+    #include <openssl/err.h>
+    #include <fcntl.h>
+    #include <poll.h>
+    #define CHAT_TLS 1
 #endif
 
 const int BUFFER_SIZE = 4096;
 std::atomic<bool> should_exit(false); 
 
-void clear_current_line() {
-    std::cout << "\r" << std::string(80, ' ') << "\r";
+// A dropped connection is retried after a random delay between half and all
+// of the current backoff, which doubles per failed attempt up to the cap
+const int RECONNECT_MIN_MS = 500;
+const int RECONNECT_MAX_MS = 30000;
+
+std::string server_ip;
+int server_port = 0;
+bool use_tls = false; // --tls
+std::string tls_ca;   // --tls-ca: trust this PEM file instead of the system store
+
+// One server connection: the socket, and its TLS session with --tls
+struct Connection {
+    socket_t sock = INVALID_SOCKET;
+#if defined(CHAT_TLS)
+    SSL* tls = nullptr;
+#endif
+};
+
+// The current connection; the sender writes to it while the connection
+// thread may be swapping it for a new one
+std::mutex conn_mutex;
+Connection conn;
+
+// Wakes a reconnect wait early when the user quits
+std::mutex wait_mutex;
+std::condition_variable wait_cv;
+
+// What a reconnect needs to resume the session (connection thread only)
+std::string username;
+std::string resume_token; // From the server's SESSION frame
+uint64_t last_seq = 0;    // Sequence number of the last chat line received
+
+// The current room's members, kept from the ROSTER and PRESENCE frames of a
+// version 3 server so /who needs no round trip. The connection thread
+// writes it; the sender thread reads it for /who.
+std::mutex roster_mutex;
+std::string roster_room; // Empty until a roster arrives
+uint64_t roster_version = 0;
+std::set<std::string> roster;
+
+// ---------------------------------------------------------------------------
+// Terminal output. Other threads only hand lines to the Display, which never
+// waits on the terminal; the render thread writes everything that piled up
+// since its last frame in one write, at most once per RENDER_INTERVAL_MS,
+// then redraws the prompt and whatever has been typed so far.
+// ---------------------------------------------------------------------------
+const int RENDER_INTERVAL_MS = 16;
+const size_t MAX_PENDING_LINES = 10000; // Past this a stalled terminal costs lines, not memory
+const char PROMPT[] = "Enter message (/quit to exit): ";
+
+// One write per frame; stdout's own buffering would split it at newlines
+void write_stdout(const std::string& data) {
+#ifdef _WIN32
+    fwrite(data.data(), 1, data.size(), stdout);
+    fflush(stdout);
+#else
+    size_t offset = 0;
+    while (offset < data.size()) {
+        ssize_t n = write(STDOUT_FILENO, data.data() + offset, data.size() - offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        offset += (size_t)n;
+    }
+#endif
+}
+
+class Display {
+public:
+    Display() : pending_lines_(0), skipped_(0), drawn_(0), dirty_(false), stopping_(false) {}
+
+    // Any thread
+    void post(const char* text, size_t len) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (pending_lines_ >= MAX_PENDING_LINES) {
+            ++skipped_;
+            return;
+        }
+        pending_.append(text, len);
+        pending_.push_back('\n');
+        ++pending_lines_;
+        wake();
+    }
+    void post(const std::string& text) { post(text.data(), text.size()); }
+
+    // The line being typed, echoed after the prompt (raw terminal input)
+    void set_input(const std::string& typed) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        input_ = typed;
+        wake();
+    }
+
+    // Render thread
+    void run() {
+        std::string batch;
+        std::string frame;
+        auto last = std::chrono::steady_clock::now() - std::chrono::milliseconds(RENDER_INTERVAL_MS);
+        while (true) {
+            uint64_t skipped;
+            bool stopping;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return dirty_ || stopping_; });
+                // Whatever else arrives before the frame is due joins it
+                cv_.wait_until(lock, last + std::chrono::milliseconds(RENDER_INTERVAL_MS),
+                               [this] { return stopping_; });
+                batch.swap(pending_);
+                pending_.clear();
+                pending_lines_ = 0;
+                skipped = skipped_;
+                skipped_ = 0;
+                stopping = stopping_;
+                dirty_ = false;
+                frame.clear();
+                frame += '\r';
+                frame.append(std::max<size_t>(drawn_, 80), ' ');
+                frame += '\r';
+                if (skipped > 0) frame += "[" + std::to_string(skipped) + " lines skipped]\n";
+                frame += batch;
+                drawn_ = 0;
+                if (!stopping) {
+                    frame += PROMPT;
+                    frame += input_;
+                    drawn_ = sizeof(PROMPT) - 1 + input_.size();
+                }
+            }
+            write_stdout(frame);
+            batch.clear();
+            last = std::chrono::steady_clock::now();
+            if (stopping) return;
+        }
+    }
+
+    // Has run() write out what is left and return
+    void stop() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        cv_.notify_one();
+    }
+
+private:
+    // Caller holds mutex_
+    void wake() {
+        if (dirty_) return;
+        dirty_ = true;
+        cv_.notify_one();
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::string pending_; // Lines not rendered yet, newline-terminated
+    size_t pending_lines_;
+    uint64_t skipped_;    // Lines dropped since the last frame
+    std::string input_;
+    size_t drawn_;       // Columns of prompt and input on screen
+    bool dirty_;
+    bool stopping_;
+};
+
+Display display;
+
+// ---------------------------------------------------------------------------
+// Terminal input. On a POSIX terminal the client reads keys in raw mode and
+// echoes through the Display, so incoming lines never overwrite what is
+// being typed; elsewhere (Windows, piped input) it reads whole lines.
+// ---------------------------------------------------------------------------
+#ifndef _WIN32
+struct termios saved_termios;
+bool raw_input = false;
+
+void enable_raw_input() {
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved_termios) != 0) return;
+    struct termios raw = saved_termios;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG); // Ctrl+C arrives as a key and quits cleanly
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    raw_input = tcsetattr(STDIN_FILENO, TCSANOW, &raw) == 0;
+}
+
+void restore_input() {
+    if (raw_input) tcsetattr(STDIN_FILENO, TCSANOW, &saved_termios);
+    raw_input = false;
+}
+
+bool read_key(char& c) {
+    while (true) {
+        ssize_t n = read(STDIN_FILENO, &c, 1);
+        if (n == 1) return true;
+        if (n < 0 && errno == EINTR) continue;
+        return false;
+    }
+}
+
+// Line editing: backspace (a whole UTF-8 character), Ctrl+U, Enter. Ctrl+C,
+// and Ctrl+D on an empty line, end the input; escape sequences are dropped.
+bool read_raw_line(std::string& line) {
+    line.clear();
+    char c;
+    while (read_key(c)) {
+        unsigned char key = (unsigned char)c;
+        if (c == '\r' || c == '\n') return true;
+        if (key == 3 || (key == 4 && line.empty())) return false;
+        if (key == 127 || key == 8) {
+            while (!line.empty() && ((unsigned char)line.back() & 0xC0) == 0x80) line.pop_back();
+            if (!line.empty()) line.pop_back();
+        } else if (key == 21) {
+            line.clear();
+        } else if (key == 27) {
+            // CSI / SS3 sequences (arrow keys and the like) end at a byte in 0x40-0x7E
+            if (!read_key(c)) return false;
+            if (c == '[' || c == 'O') {
+                while (read_key(c) && !((unsigned char)c >= 0x40 && (unsigned char)c <= 0x7E)) {}
+            }
+            continue;
+        } else if (key >= 32) {
+            line.push_back(c);
+        } else {
+            continue;
+        }
+        display.set_input(line);
+    }
+    return false;
+}
+#else
+bool raw_input = false;
+void enable_raw_input() {}
+void restore_input() {}
+bool read_raw_line(std::string&) { return false; }
+#endif
+
+// The next line the user typed; false at end of input
+bool read_input_line(std::string& line) {
+    if (raw_input) {
+        if (!read_raw_line(line)) return false;
+        // The finished line stays on screen the way a terminal would echo it
+        display.set_input("");
+        display.post(PROMPT + line);
+        return true;
+    }
+    if (!std::getline(std::cin, line)) return false;
+    display.set_input(""); // Redraws the prompt under the echoed line
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Transport. With --tls the server's certificate is checked against the
+// system CA store (or --tls-ca) and the IP address we dialed. The newest
+// session ticket is kept, so a reconnect resumes the TLS session as well as
+// the chat one. The socket is non-blocking under TLS: reader and sender take
+// turns on the one SSL object and wait for the socket outside the lock.
+// ---------------------------------------------------------------------------
+#if defined(CHAT_TLS)
+SSL_CTX* tls_context = nullptr;
+SSL_SESSION* tls_ticket = nullptr; // Connection thread only (handshakes and reads)
+std::mutex tls_mutex;              // One OpenSSL call at a time on a connection
+
+int tls_keep_ticket(SSL*, SSL_SESSION* session) {
+    if (tls_ticket) SSL_SESSION_free(tls_ticket);
+    tls_ticket = session;
+    return 1; // We keep the reference
+}
+
+bool tls_setup() {
+    tls_context = SSL_CTX_new(TLS_client_method());
+    if (tls_context == nullptr) return false;
+    SSL_CTX_set_min_proto_version(tls_context, TLS1_2_VERSION);
+    SSL_CTX_set_options(tls_context, SSL_OP_IGNORE_UNEXPECTED_EOF); // A dropped server is a disconnect
+    SSL_CTX_set_verify(tls_context, SSL_VERIFY_PEER, nullptr);
+    bool trusted = tls_ca.empty() ? SSL_CTX_set_default_verify_paths(tls_context) == 1
+                                  : SSL_CTX_load_verify_locations(tls_context, tls_ca.c_str(), nullptr) == 1;
+    if (!trusted) {
+        std::cerr << "Could not load TLS trust anchors" << (tls_ca.empty() ? "." : " from " + tls_ca + ".") << std::endl;
+        return false;
+    }
+    SSL_CTX_set_session_cache_mode(tls_context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(tls_context, tls_keep_ticket);
+    return true;
+}
+
+// Waits for the socket to be readable, or writable, as an SSL call asked
+void tls_wait(socket_t sock, int err) {
+    struct pollfd p;
+    p.fd = sock;
+    p.events = err == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN;
+    p.revents = 0;
+    poll(&p, 1, -1);
+}
+
+bool tls_connect(Connection& c, bool report_errors) {
+    c.tls = SSL_new(tls_context);
+    if (c.tls == nullptr || SSL_set_fd(c.tls, c.sock) != 1 ||
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(c.tls), server_ip.c_str()) != 1) {
+        return false;
+    }
+    if (tls_ticket) SSL_set_session(c.tls, tls_ticket);
+    ERR_clear_error();
+    if (SSL_connect(c.tls) != 1) { // Still a blocking socket here
+        if (report_errors) {
+            long verify = SSL_get_verify_result(c.tls);
+            if (verify != X509_V_OK) {
+                std::cerr << "TLS handshake failed: " << X509_verify_cert_error_string(verify) << std::endl;
+            } else {
+                char text[256];
+                ERR_error_string_n(ERR_get_error(), text, sizeof(text));
+                std::cerr << "TLS handshake failed: " << text << std::endl;
+            }
+        }
+        return false;
+    }
+    int flags = fcntl(c.sock, F_GETFL, 0);
+    return flags >= 0 && fcntl(c.sock, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+#endif
+
+void close_connection(Connection& c) {
+#if defined(CHAT_TLS)
+    if (c.tls) {
+        // OpenSSL won't resume a session whose connection ended without
+        // close_notify unless told it shut down; a dropped connection is just
+        // when we want to resume
+        SSL_set_shutdown(c.tls, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+        SSL_free(c.tls);
+    }
+    c.tls = nullptr;
+#endif
+    if (c.sock != INVALID_SOCKET) close_socket(c.sock);
+    c.sock = INVALID_SOCKET;
+}
+
+// Dials the server, with the TLS handshake under --tls
+bool open_connection(Connection& c, bool report_errors) {
+    c.sock = connect_to_server(server_ip.c_str(), server_port, report_errors);
+    if (c.sock == INVALID_SOCKET) return false;
+#if defined(CHAT_TLS)
+    if (use_tls && !tls_connect(c, report_errors)) {
+        close_connection(c);
+        return false;
+    }
+#endif
+    return true;
+}
+
+bool conn_send(Connection& c, const std::string& data) {
+#if defined(CHAT_TLS)
+    if (c.tls) {
+        size_t offset = 0;
+        while (offset < data.size()) {
+            int n, err = SSL_ERROR_NONE;
+            {
+                std::lock_guard<std::mutex> lock(tls_mutex);
+                ERR_clear_error();
+                n = SSL_write(c.tls, data.data() + offset, (int)(data.size() - offset));
+                if (n <= 0) err = SSL_get_error(c.tls, n);
+            }
+            if (n > 0) {
+                offset += n;
+                continue;
+            }
+            if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) return false;
+            tls_wait(c.sock, err); // Retried with the same arguments, as OpenSSL requires
+        }
+        return true;
+    }
+#endif
+    return send_all(c.sock, data);
+}
+
+// Like recv(): bytes read, 0 once the server has closed, or -1 on an error
+int conn_recv(Connection& c, char* buffer, int len) {
+#if defined(CHAT_TLS)
+    if (c.tls) {
+        while (true) {
+            int n, err = SSL_ERROR_NONE;
+            {
+                std::lock_guard<std::mutex> lock(tls_mutex);
+                ERR_clear_error();
+                n = SSL_read(c.tls, buffer, len);
+                if (n <= 0) err = SSL_get_error(c.tls, n);
+            }
+            if (n > 0) return n;
+            if (err == SSL_ERROR_ZERO_RETURN) return 0;
+            if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) return -1;
+            tls_wait(c.sock, err);
+        }
+    }
+#endif
+    return recv(c.sock, buffer, len, 0);
+}
+
+// Tells the server we are done sending (close_notify first under TLS)
+void conn_finish(Connection& c) {
+#if defined(CHAT_TLS)
+    if (c.tls) {
+        std::lock_guard<std::mutex> lock(tls_mutex);
+        SSL_shutdown(c.tls);
+    }
+#endif
+    shutdown(c.sock, SHUT_WR);
+}
+
+// Preamble and login: RESUME once the server has given us a token, LOGIN
+// otherwise. RESUME carries the username too, for when the token has expired.
+std::string login_frames() {
+    std::string out = protocol_preamble();
+#if defined(CHAT_HAVE_ZLIB)
+    out += encode_frame(FRAME_COMPRESS, DEFLATE_CODEC);
+#endif
+    if (resume_token.empty()) return out + encode_frame(FRAME_LOGIN, username);
+    std::string payload(9, '\0');
+    put_u64_be(&payload[0], last_seq);
+    payload[8] = (char)resume_token.size();
+    payload += resume_token + username;
+    return out + encode_frame(FRAME_RESUME, payload);
+}
+
+#if defined(CHAT_HAVE_ZLIB)
+// Turns a DEFLATE frame's payload back into the frame it holds
+class Inflater {
+public:
+    Inflater() : out_(MAX_FRAME_HEADER_SIZE + MAX_FRAME_SIZE) {
+        memset(&stream_, 0, sizeof(stream_));
+        ready_ = inflateInit2(&stream_, -MAX_WBITS) == Z_OK;
+    }
+    ~Inflater() {
+        if (ready_) inflateEnd(&stream_);
+    }
+
+    // Sets frame and frame_len to the inflated bytes, valid until the next
+    // call; false if the payload is corrupt or too large
+    bool inflate_frame(const char* payload, size_t len, const char*& frame, size_t& frame_len) {
+        if (!ready_ || inflateReset(&stream_) != Z_OK ||
+            inflateSetDictionary(&stream_, reinterpret_cast<const Bytef*>(DEFLATE_DICTIONARY),
+                                 sizeof(DEFLATE_DICTIONARY) - 1) != Z_OK) {
+            return false;
+        }
+        stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(payload));
+        stream_.avail_in = (uInt)len;
+        stream_.next_out = reinterpret_cast<Bytef*>(out_.data());
+        stream_.avail_out = (uInt)out_.size();
+        if (inflate(&stream_, Z_FINISH) != Z_STREAM_END) return false;
+        frame = out_.data();
+        frame_len = out_.size() - stream_.avail_out;
+        return true;
+    }
+
+private:
+    z_stream stream_;
+    bool ready_;
+    std::vector<char> out_;
+};
+#endif
+
+enum class Ending { Lost, Fatal };
+
+// ---------------------------------------------------------------------------
+// Presence frames
+// ---------------------------------------------------------------------------
+
+// Calls on_name(op, name) for each entry from p[i] on: a 2-byte big-endian
+// length and the name, after an op byte if with_op
+template <typename OnName>
+void each_roster_name(const char* p, size_t i, size_t n, bool with_op, OnName&& on_name) {
+    size_t header = with_op ? 3 : 2;
+    while (n - i >= header) {
+        char op = with_op ? p[i++] : '+';
+        size_t len = ((size_t)(unsigned char)p[i] << 8) | (unsigned char)p[i + 1];
+        i += 2;
+        if (n - i < len) return;
+        on_name(op, std::string(p + i, len));
+        i += len;
+    }
+}
+
+// One frame of a roster snapshot: the first replaces what we have, the rest
+// add to it
+void apply_roster(const char* p, size_t n) {
+    if (n < 10 || n - 10 < (unsigned char)p[9]) return;
+    uint64_t version = get_u64_be(p);
+    std::string room(p + 10, (unsigned char)p[9]);
+    std::lock_guard<std::mutex> lock(roster_mutex);
+    if (p[8] != 0) {
+        roster_room = room;
+        roster_version = version;
+        roster.clear();
+    } else if (room != roster_room || version != roster_version) {
+        return;
+    }
+    each_roster_name(p, 10 + room.size(), n, false, [](char, const std::string& name) { roster.insert(name); });
+}
+
+// A batch of joins and leaves: applied if newer than our roster, and shown
+// either way
+void apply_presence(const char* p, size_t n) {
+    if (n < 9 || n - 9 < (unsigned char)p[8]) return;
+    uint64_t version = get_u64_be(p);
+    std::string room(p + 9, (unsigned char)p[8]);
+    std::vector<std::string> joined, left;
+    each_roster_name(p, 9 + room.size(), n, true, [&](char op, const std::string& name) {
+        (op == '+' ? joined : left).push_back(name);
+    });
+    {
+        std::lock_guard<std::mutex> lock(roster_mutex);
+        if (room == roster_room && version > roster_version) {
+            for (const std::string& name : joined) roster.insert(name);
+            for (const std::string& name : left) roster.erase(name);
+            roster_version = version;
+        }
+    }
+    display.post(presence_summary(room, joined.data(), joined.size(), left.data(), left.size()));
 }
 
-void display_prompt() {
-    std::cout << "Enter message (/quit to exit): " << std::flush;
+// /who from our copy of the roster; false if we have none and the server
+// should answer
+bool show_roster() {
+    std::string line;
+    {
+        std::lock_guard<std::mutex> lock(roster_mutex);
+        if (roster_room.empty()) return false;
+        line = "In #" + roster_room + " (" + std::to_string(roster.size()) + "):";
+        bool first = true;
+        for (const std::string& name : roster) {
+            line += (first ? " " : ", ") + name;
+            first = false;
+        }
+    }
+    display.post(line);
+    return true;
 }
 
-void receive_messages(socket_t sock) {
+// Reads one connection until it ends. Lost means try again; Fatal means
+// stop. reconnect_ms is set if the server said when to come back, and
+// got_frames once the server speaks to us (a working connection).
+Ending receive_messages(Connection& c, int& reconnect_ms, bool& got_frames) {
     char buffer[BUFFER_SIZE];
     int bytes_received;
+    std::string preamble;
+    FrameDecoder frames;
+#if defined(CHAT_HAVE_ZLIB)
+    Inflater inflater;
+#endif
+    {
+        // A new connection sends a new roster
+        std::lock_guard<std::mutex> lock(roster_mutex);
+        roster_room.clear();
+        roster.clear();
+    }
+
+    auto on_frame = [&](unsigned char type, const char* payload, size_t n) {
+        if (type == FRAME_TEXT) {
+            display.post(payload, n);
+        } else if (type == FRAME_ROOM_LINE && n >= 8) {
+            last_seq = get_u64_be(payload);
+            display.post(payload + 8, n - 8);
+        } else if (type == FRAME_SESSION) {
+            resume_token.assign(payload, n);
+        } else if (type == FRAME_RECONNECT) {
+            reconnect_ms = std::atoi(std::string(payload, n).c_str());
+        } else if (type == FRAME_ROSTER) {
+            apply_roster(payload, n);
+        } else if (type == FRAME_PRESENCE) {
+            apply_presence(payload, n);
+        } else if (type == FRAME_PING) {
+            // Shares the socket with the sender thread
+            std::lock_guard<std::mutex> lock(conn_mutex);
+            conn_send(c, encode_frame(FRAME_PONG, payload, n));
+        }
+    };
 
     while (!should_exit.load()) {
-        bytes_received = recv(sock, buffer, BUFFER_SIZE - 1, 0);
+        bytes_received = conn_recv(c, buffer, BUFFER_SIZE);
 
         if (bytes_received > 0) {
-            buffer[bytes_received] = '\0'; 
+            const char* data = buffer;
+            size_t len = bytes_received;
+
+            // The server answers our preamble with its own before any frame
+            if (preamble.size() < PROTOCOL_PREAMBLE_SIZE) {
+                size_t take = std::min(len, PROTOCOL_PREAMBLE_SIZE - preamble.size());
+                preamble.append(data, take);
+                data += take;
+                len -= take;
+                size_t magic_seen = std::min(preamble.size(), PROTOCOL_MAGIC_SIZE);
+                if (preamble.compare(0, magic_seen, PROTOCOL_MAGIC, magic_seen) != 0) {
+                    // A server turning us away says why in plain text
+                    std::string reason = preamble + std::string(data, len);
+                    while (!reason.empty() && (reason.back() == '\n' || reason.back() == '\r')) reason.pop_back();
+                    if ((unsigned char)preamble[0] != 0xff && !reason.empty()) {
+                        display.post(reason); // "Server full." and the like: worth retrying
+                        return Ending::Lost;
+                    }
+                    display.post("Server does not speak the chat protocol.");
+                    return Ending::Fatal;
+                }
+            }
 
-            clear_current_line(); 
-            std::cout << buffer << std::endl; 
-            display_prompt(); 
+            bool inflated = true;
+            bool ok = frames.feed(data, len, [&](unsigned char type, const char* payload, size_t n) {
+                got_frames = true;
+#if defined(CHAT_HAVE_ZLIB)
+                if (type == FRAME_DEFLATE) {
+                    // Exactly one whole frame inside, never another DEFLATE
+                    const char* frame;
+                    size_t frame_len;
+                    FrameDecoder inner;
+                    if (!inflater.inflate_frame(payload, n, frame, frame_len) ||
+                        !inner.feed(frame, frame_len, [&](unsigned char t, const char* p, size_t m) {
+                            if (t != FRAME_DEFLATE) on_frame(t, p, m);
+                        }) || inner.buffered() != 0) {
+                        inflated = false;
+                    }
+                    return;
+                }
+#endif
+                on_frame(type, payload, n);
+            }) && inflated;
+            if (!ok) {
+                display.post("Malformed frame from server.");
+                return Ending::Fatal;
+            }
 
         } else if (bytes_received == 0) {
-            clear_current_line();
-            std::cout << "Server disconnected." << std::endl;
-            should_exit = true; 
-            break; 
+            if (should_exit.load()) return Ending::Fatal;
+            display.post("Server disconnected.");
+            return Ending::Lost; 
         } else { 
             if (should_exit.load()) {
-                break; 
+                return Ending::Fatal; 
             }
-            clear_current_line();
-            std::cerr << "Receive failed." << std::endl;
-            should_exit = true; 
-            break; 
+            display.post("Receive failed.");
+            return Ending::Lost; 
+        }
+    }
+    return Ending::Fatal;
+}
+
+// Sleeps for ms unless the user quits first; true if they did
+bool wait_before_retry(int ms) {
+    std::unique_lock<std::mutex> lock(wait_mutex);
+    return wait_cv.wait_for(lock, std::chrono::milliseconds(ms), [] { return should_exit.load(); });
+}
+
+// Owns the connection: reads from it and, whenever it drops, reconnects
+// with jittered exponential backoff (or after the delay a shutting-down
+// server asked for) and resumes the session
+void run_connection(Connection c) {
+    std::mt19937 random(std::random_device{}());
+    int backoff_ms = RECONNECT_MIN_MS;
+    while (true) {
+        int reconnect_ms = -1;
+        bool got_frames = false;
+        Ending ending = receive_messages(c, reconnect_ms, got_frames);
+        {
+            std::lock_guard<std::mutex> lock(conn_mutex);
+            conn = Connection();
+        }
+        close_connection(c);
+        if (ending == Ending::Fatal || should_exit.load()) break;
+        if (got_frames) backoff_ms = RECONNECT_MIN_MS; // It worked for a while; start over
+
+        while (c.sock == INVALID_SOCKET) {
+            int delay = reconnect_ms;
+            if (delay < 0) {
+                delay = std::uniform_int_distribution<int>(backoff_ms / 2, backoff_ms)(random);
+                backoff_ms = std::min(backoff_ms * 2, RECONNECT_MAX_MS);
+            }
+            reconnect_ms = -1;
+            display.post("Reconnecting in " + std::to_string(delay) + " ms...");
+            if (wait_before_retry(delay)) break;
+            if (open_connection(c, false) && !conn_send(c, login_frames())) close_connection(c);
+        }
+        if (c.sock == INVALID_SOCKET) break;
+        {
+            std::lock_guard<std::mutex> lock(conn_mutex);
+            conn = c;
         }
     }
+    should_exit = true;
 }
 
-void send_messages(socket_t sock) {
+// Ends the session for good: /quit tells the server not to hold it for a
+// resume, then our side of the connection is closed
+void quit() {
+    {
+        // Set first, so the server closing on us isn't taken for a drop
+        std::lock_guard<std::mutex> lock(wait_mutex);
+        should_exit = true;
+    }
+    wait_cv.notify_all();
+    std::lock_guard<std::mutex> lock(conn_mutex);
+    if (conn.sock != INVALID_SOCKET) {
+        conn_send(conn, encode_frame(FRAME_CHAT, "/quit"));
+        conn_finish(conn);
+    }
+}
+
+void send_messages() {
     std::string message;
     while (!should_exit.load()) { 
-        display_prompt(); 
-
-        if (!std::getline(std::cin, message)) {
-             if (std::cin.eof()) {
-                 std::cout << "\nInput stream closed (EOF). Quitting..." << std::endl;
+        if (!read_input_line(message)) {
+             if (raw_input || std::cin.eof()) {
+                 display.post("Input stream closed (EOF). Quitting...");
              } else {
-                  std::cerr << "\nInput error. Quitting..." << std::endl;
+                  display.post("Input error. Quitting...");
              }
-             should_exit = true; 
              break;
         }
 
         if (should_exit.load()) break; 
 
         if (message == "/quit") {
-            should_exit = true; 
             break; 
         }
 
@@ -113,29 +750,43 @@ void send_messages(socket_t sock) {
             continue; 
         }
 
-        if (send(sock, message.c_str(), message.length(), 0) == SOCKET_ERROR) {
-             if (should_exit.load()) {
-                 break; 
-             }
-            std::cerr << "\nSend failed." << std::endl;
-            should_exit = true; 
-            break; 
+        if (message == "/who" && show_roster()) {
+            continue;
         }
-    }
 
-    if (sock != INVALID_SOCKET) {
-        shutdown(sock, SHUT_WR); 
+        bool sent;
+        {
+            std::lock_guard<std::mutex> lock(conn_mutex);
+            sent = conn.sock != INVALID_SOCKET && conn_send(conn, encode_frame(FRAME_CHAT, message));
+        }
+        if (!sent) {
+            // The connection thread notices the drop and reconnects
+            display.post("Not connected; message not sent.");
+        }
     }
+
+    quit();
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        std::cerr << "Usage: " << argv[0] << " <server_ip> <server_port>" << std::endl;
+    bool usage_ok = argc >= 3;
+    for (int i = 3; i < argc && usage_ok; ++i) {
+        std::string option = argv[i];
+        if (option == "--tls") {
+            use_tls = true;
+        } else if (option == "--tls-ca" && i + 1 < argc) {
+            use_tls = true;
+            tls_ca = argv[++i];
+        } else {
+            usage_ok = false;
+        }
+    }
+    if (!usage_ok) {
+        std::cerr << "Usage: " << argv[0] << " <server_ip> <server_port> [--tls] [--tls-ca <file>]" << std::endl;
         return EXIT_FAILURE;
     }
 
-    const char* server_ip_str = argv[1];
-    int server_port;
+    server_ip = argv[1];
     try {
         server_port = std::stoi(argv[2]);
     } catch (...) {
@@ -150,31 +801,17 @@ int main(int argc, char *argv[]) {
 
     init_sockets(); 
 
-    socket_t sock = INVALID_SOCKET;
-    struct sockaddr_in serv_addr;
-
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == INVALID_SOCKET) {
-        std::cerr << "Socket creation failed." << std::endl;
-        cleanup_sockets();
-        return EXIT_FAILURE;
-    }
-
-    memset(&serv_addr, 0, sizeof(serv_addr)); 
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(server_port); 
-
-    int pton_ret = inet_pton(AF_INET, server_ip_str, &serv_addr.sin_addr);
-    if (pton_ret <= 0) {
-        std::cerr << "Invalid IP address or inet_pton failed." << std::endl;
-        close_socket(sock);
-        cleanup_sockets();
+#if defined(CHAT_TLS)
+    if (use_tls && !tls_setup()) return EXIT_FAILURE;
+#else
+    if (use_tls) {
+        std::cerr << "This client was built without TLS support (needs OpenSSL, not on Windows)." << std::endl;
         return EXIT_FAILURE;
     }
+#endif
 
-    if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == SOCKET_ERROR) {
-        std::cerr << "Connection Failed." << std::endl;
-        close_socket(sock);
+    Connection first;
+    if (!open_connection(first, true)) {
         cleanup_sockets();
         return EXIT_FAILURE;
     }
@@ -183,34 +820,44 @@ int main(int argc, char *argv[]) {
 
     // --- Username Step ---
     std::cout << "Enter your username: ";
-    std::string username;
     std::getline(std::cin, username);
     if (username.empty()) username = "Guest";
-    send(sock, username.c_str(), username.length(), 0);
+    conn_send(first, login_frames());
+    conn = first;
     // ---------------------
 
+    // From here on only the render thread writes to the terminal
+    std::cout << std::flush;
+    enable_raw_input();
+    display.set_input("");
+
+    std::thread render_thread;
     std::thread receiver_thread;
     std::thread sender_thread;
 
     try {
-        receiver_thread = std::thread(receive_messages, sock);
-        sender_thread = std::thread(send_messages, sock);
+        render_thread = std::thread(&Display::run, &display);
+        receiver_thread = std::thread(run_connection, first);
+        sender_thread = std::thread(send_messages);
     } catch (...) {
          std::cerr << "Failed to create threads." << std::endl;
          should_exit = true; 
          if (sender_thread.joinable()) sender_thread.join();
          if (receiver_thread.joinable()) receiver_thread.join();
-         close_socket(sock);
+         else close_connection(first); // Otherwise the connection thread closed it
+         display.stop();
+         if (render_thread.joinable()) render_thread.join();
+         restore_input();
          cleanup_sockets();
          return EXIT_FAILURE;
     }
 
     if (sender_thread.joinable()) sender_thread.join();
     if (receiver_thread.joinable()) receiver_thread.join();
+    display.stop();
+    render_thread.join();
+    restore_input();
 
-    if (sock != INVALID_SOCKET) {
-        close_socket(sock);
-    }
     cleanup_sockets(); 
 
     return 0;
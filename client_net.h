@@ -0,0 +1,92 @@
+#ifndef CHAT_CLIENT_NET_H
+#define CHAT_CLIENT_NET_H
+
+// Socket plumbing shared by the interactive client (client.cpp) and the load
+// generator (bench.cpp).
+
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+
+// Platform specific includes and definitions
+#ifdef _WIN32
+    #ifndef _WIN32_WINNT
+    #define _WIN32_WINNT 0x0600 
+    #endif
+
+    #define _WINSOCK_DEPRECATED_NO_WARNINGS 
+    #include <winsock2.h>
+    #include <ws2tcpip.h> 
+    #pragma comment(lib, "ws2_32.lib") 
+    using socket_t = SOCKET;
+    using socklen_t = int;
+    #define close_socket(s) closesocket(s)
+    #define socket_error() WSAGetLastError()
+    #define SHUT_WR SD_SEND 
+    inline void init_sockets() {
+        WSADATA wsaData;
+        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+            std::cerr << "WSAStartup failed. Error Code: " << socket_error() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    inline void cleanup_sockets() { WSACleanup(); }
+#else // Linux, macOS, etc. (POSIX)
+    #include <sys/socket.h>
+    #include <netinet/in.h>
+    #include <arpa/inet.h>  
+    #include <unistd.h>     
+    #include <netdb.h>      
+    #include <sys/ioctl.h>  
+    using socket_t = int;
+    #define INVALID_SOCKET -1
+    #define SOCKET_ERROR   -1
+    #define close_socket(s) close(s)
+    #define socket_error() errno
+    inline void init_sockets() {} 
+    inline void cleanup_sockets() {} 
+#endif
+
+// Blocking sockets may still accept a write in pieces
+inline bool send_all(socket_t sock, const std::string& data) {
+    size_t offset = 0;
+    while (offset < data.size()) {
+        int sent = send(sock, data.data() + offset, (int)(data.size() - offset), 0);
+        if (sent == SOCKET_ERROR || sent == 0) return false;
+        offset += sent;
+    }
+    return true;
+}
+
+// Opens a blocking TCP connection; returns INVALID_SOCKET, after reporting
+// why on stderr if report_errors is set, if it can't
+inline socket_t connect_to_server(const char* server_ip_str, int server_port, bool report_errors = true) {
+    socket_t sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) {
+        if (report_errors) std::cerr << "Socket creation failed." << std::endl;
+        return INVALID_SOCKET;
+    }
+
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr)); 
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(server_port); 
+
+    int pton_ret = inet_pton(AF_INET, server_ip_str, &serv_addr.sin_addr);
+    if (pton_ret <= 0) {
+        if (report_errors) std::cerr << "Invalid IP address or inet_pton failed." << std::endl;
+        close_socket(sock);
+        return INVALID_SOCKET;
+    }
+
+    if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == SOCKET_ERROR) {
+        if (report_errors) std::cerr << "Connection Failed." << std::endl;
+        close_socket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+#endif // CHAT_CLIENT_NET_H
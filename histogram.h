@@ -0,0 +1,87 @@
+#ifndef CHAT_HISTOGRAM_H
+#define CHAT_HISTOGRAM_H
+
+// HDR-style latency histogram: constant relative precision (about 0.1%, three
+// significant digits) over the whole range, fixed memory, O(1) record.
+//
+// Values below 2048 get one bucket each. Above that, every power of two is
+// split into 1024 equal buckets, so the bucket for v is (exponent, top 11
+// bits of v). Percentiles report the highest value a bucket can hold, which
+// matches what HdrHistogram prints.
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class LatencyHistogram {
+public:
+    static const int SUB_BUCKET_BITS = 11;
+    static const uint64_t SUB_BUCKET_COUNT = 1ull << SUB_BUCKET_BITS;
+    static const uint64_t SUB_BUCKET_HALF = SUB_BUCKET_COUNT / 2;
+    static const int MAX_EXPONENT = 64 - SUB_BUCKET_BITS;
+
+    LatencyHistogram() : counts_((MAX_EXPONENT + 2) * SUB_BUCKET_HALF, 0), total_(0), sum_(0), max_(0) {}
+
+    void record(uint64_t value) {
+        ++counts_[index_of(value)];
+        ++total_;
+        sum_ += value;
+        if (value > max_) max_ = value;
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts_.size(); ++i) counts_[i] += other.counts_[i];
+        total_ += other.total_;
+        sum_ += other.sum_;
+        if (other.max_ > max_) max_ = other.max_;
+    }
+
+    uint64_t count() const { return total_; }
+    uint64_t max() const { return max_; }
+    double mean() const { return total_ ? (double)sum_ / (double)total_ : 0.0; }
+
+    // Smallest recorded value v (to bucket precision) with at least
+    // quantile * count() samples <= v
+    uint64_t percentile(double quantile) const {
+        if (total_ == 0) return 0;
+        uint64_t rank = (uint64_t)(quantile * (double)total_ + 0.5);
+        if (rank < 1) rank = 1;
+        if (rank > total_) rank = total_;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                uint64_t high = highest_in(i);
+                return high < max_ ? high : max_;
+            }
+        }
+        return max_;
+    }
+
+private:
+    static int log2_floor(uint64_t v) {
+        int n = 0;
+        while (v >>= 1) ++n;
+        return n;
+    }
+
+    static size_t index_of(uint64_t value) {
+        if (value < SUB_BUCKET_COUNT) return (size_t)value;
+        int exponent = log2_floor(value) - (SUB_BUCKET_BITS - 1);
+        return (size_t)(exponent * SUB_BUCKET_HALF + (value >> exponent));
+    }
+
+    static uint64_t highest_in(size_t index) {
+        if (index < SUB_BUCKET_COUNT) return index;
+        uint64_t exponent = (index - SUB_BUCKET_HALF) / SUB_BUCKET_HALF;
+        uint64_t sub = index - exponent * SUB_BUCKET_HALF;
+        return ((sub + 1) << exponent) - 1;
+    }
+
+    std::vector<uint64_t> counts_;
+    uint64_t total_;
+    uint64_t sum_;
+    uint64_t max_;
+};
+
+#endif // CHAT_HISTOGRAM_H
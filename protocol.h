@@ -0,0 +1,289 @@
+#ifndef CHAT_PROTOCOL_H
+#define CHAT_PROTOCOL_H
+
+// Wire protocol shared by client.cpp and server.cpp.
+//
+// A framed connection starts with the 6-byte preamble below in each
+// direction, then carries frames of
+//
+//     varint(length) | type (1 byte) | payload (length - 1 bytes)
+//
+// where the varint is LEB128 (7 bits per byte, low bits first). The preamble
+// starts with 0xFF, which never appears in UTF-8 text, so the server can tell
+// framed clients from old ones that speak the newline-delimited text protocol
+// (first line is the username, every following line is a chat message).
+//
+// The server answers with the lower of its version and the client's, and
+// both then speak that version. Version 2 adds resumable sessions: chat
+// lines arrive as ROOM_LINE frames carrying a sequence number, each login is
+// answered with a SESSION token, and a client that lost its connection logs
+// back in with RESUME to get only the lines it missed.
+//
+// A version 2 client may also ask for compression with a COMPRESS frame
+// before logging in. If the server agrees, it may send any later line as a
+// DEFLATE frame instead: a complete TEXT or ROOM_LINE frame, header included,
+// deflated on its own (raw deflate, RFC 1951) with DEFLATE_DICTIONARY preset.
+// Every frame decodes alone, so the server compresses a broadcast once for
+// all of its recipients.
+//
+// Version 3 adds heartbeats: the server sends PING to a client it hasn't
+// heard from in a while, and the client answers with PONG at once. A client
+// that stays silent is taken for a dead connection and dropped. It also adds
+// presence: on entering a room the client gets the room's roster in ROSTER
+// frames, then PRESENCE frames with each batch of joins and leaves, instead
+// of a notice per join.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "scan.h"
+
+const char PROTOCOL_MAGIC[] = "\xff" "CHAT";
+const size_t PROTOCOL_MAGIC_SIZE = sizeof(PROTOCOL_MAGIC) - 1;
+const unsigned char PROTOCOL_VERSION = 3;
+const unsigned char PEER_PROTOCOL_VERSION = 1; // Cluster links (PEER_HELLO), versioned separately
+const size_t PROTOCOL_PREAMBLE_SIZE = PROTOCOL_MAGIC_SIZE + 1;
+
+const size_t MAX_FRAME_SIZE = 64 * 1024; // type byte + payload
+const size_t MAX_FRAME_HEADER_SIZE = 4;  // 3 varint bytes cover MAX_FRAME_SIZE, plus type
+
+enum FrameType : unsigned char {
+    FRAME_LOGIN = 1, // client -> server: requested username
+    FRAME_CHAT  = 2, // client -> server: one chat line
+    FRAME_TEXT  = 3, // server -> client: one line to display
+    FRAME_RECONNECT = 4, // server -> client: shutting down; decimal milliseconds to wait before reconnecting
+
+    // Version 2 and later
+    FRAME_SESSION   = 5, // server -> client: resume token, after every login or resume
+    FRAME_RESUME    = 6, // client -> server, instead of LOGIN: 8-byte big-endian sequence number of the
+                         // newest line seen, 1-byte token length, token, then the username to log in
+                         // with if the token is no longer valid
+    FRAME_ROOM_LINE = 7, // server -> client: 8-byte big-endian sequence number, then a chat line to display
+    FRAME_COMPRESS  = 8, // client -> server, before LOGIN or RESUME: codec wanted (DEFLATE_CODEC);
+                         // server -> client: the codec it will use, empty for none
+    FRAME_DEFLATE   = 9, // server -> client, once COMPRESS was agreed: one compressed TEXT or ROOM_LINE frame
+
+    // Version 3 and later
+    FRAME_PING = 10, // server -> client: payload (often empty) to echo back
+    FRAME_PONG = 11, // client -> server: the payload of the PING it answers
+    FRAME_ROSTER = 12,   // server -> client: 8-byte big-endian roster version, 1 byte (1 = first frame of a
+                         // snapshot, 0 = continues it), 1-byte room name length, room name, then names,
+                         // each a 2-byte big-endian length and the name
+    FRAME_PRESENCE = 13, // server -> client: 8-byte big-endian roster version after the change, 1-byte room
+                         // name length, room name, then entries of '+' (joined) or '-' (left), 2-byte
+                         // big-endian length, name. Apply only if newer than the roster held.
+
+    // server <-> server cluster links only (CLUSTER_PORT), never on a client
+    // connection
+    FRAME_PEER_HELLO = 16, // version byte + node id; first frame each way
+    FRAME_INTEREST   = 17, // 1 (room has members here) or 0 (no longer) + room name
+    FRAME_RELAY      = 18, // 2-byte big-endian room name length, room name, line to display
+    FRAME_RELAY_CHAT = 19  // As FRAME_RELAY, for a chat line the room's history keeps
+};
+
+// Names the codec and its dictionary; a new dictionary needs a new name
+const char DEFLATE_CODEC[] = "deflate-1";
+
+// Preset dictionary for DEFLATE frames: server notices and common chat words.
+// Deflate finds matches closer to the data more cheaply, so the most frequent
+// strings come last.
+const char DEFLATE_DICTIONARY[] =
+    "the be to of and in that have it for not on with he as you do at this but his by from they we say "
+    "her she or an will my one all would there their what so up out if about who get which go me when "
+    "make can like time no just him know take people into year your good some could them see other than "
+    "then now look only come its over think also back after use two how our work first well way even new "
+    "want because any these give day most us is are was were been has had did does said going really "
+    "hello hi hey thanks thank you lol ok okay yes yeah sure sorry please anyone here everyone morning "
+    "night bye see you later :) "
+    "Server is shutting down. Please reconnect in  ms. Unknown command: . Try /join <room>, /leave, "
+    "/rooms or /quit. Goodbye. Rooms: You are already in the lobby. Now chatting in #lobby ( online). "
+    " has left #. has joined #. has left the chat. has joined the chat. Welcome back, ! Welcome, ]: [";
+
+// Presence notice the way both sides word it: "alice and bob have joined
+// #lobby. carol has left #lobby." Long lists are cut short with a count.
+inline std::string presence_summary(const std::string& room, const std::string* joined, size_t joined_count,
+                                    const std::string* left, size_t left_count) {
+    const size_t MAX_LISTED = 8;
+    auto sentence = [&room, MAX_LISTED](const std::string* names, size_t count, const char* verb) {
+        std::string out;
+        size_t listed = count > MAX_LISTED ? MAX_LISTED : count;
+        for (size_t i = 0; i < listed; ++i) {
+            if (i > 0) out += (i + 1 == listed && listed == count) ? " and " : ", ";
+            out += names[i];
+        }
+        if (listed < count) out += " and " + std::to_string(count - listed) + " others";
+        out += count == 1 ? " has " : " have ";
+        return out + verb + " #" + room + ".";
+    };
+    std::string out;
+    if (joined_count > 0) out = sentence(joined, joined_count, "joined");
+    if (left_count > 0) out += (out.empty() ? "" : " ") + sentence(left, left_count, "left");
+    return out;
+}
+
+inline std::string protocol_preamble(unsigned char version = PROTOCOL_VERSION) {
+    std::string out(PROTOCOL_MAGIC, PROTOCOL_MAGIC_SIZE);
+    out.push_back((char)version);
+    return out;
+}
+
+// Sequence numbers in RESUME and ROOM_LINE payloads
+inline void put_u64_be(char* out, uint64_t value) {
+    for (int i = 7; i >= 0; --i) {
+        out[i] = (char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+inline uint64_t get_u64_be(const char* p) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) value = (value << 8) | (unsigned char)p[i];
+    return value;
+}
+
+// Writes the varint length and type byte for a frame carrying payload_len
+// bytes; returns the number of header bytes written (at most
+// MAX_FRAME_HEADER_SIZE).
+inline size_t encode_frame_header(unsigned char type, size_t payload_len, char* out) {
+    size_t length = payload_len + 1;
+    size_t n = 0;
+    while (length >= 0x80) {
+        out[n++] = (char)((length & 0x7f) | 0x80);
+        length >>= 7;
+    }
+    out[n++] = (char)length;
+    out[n++] = (char)type;
+    return n;
+}
+
+inline std::string encode_frame(unsigned char type, const char* payload, size_t len) {
+    char header[MAX_FRAME_HEADER_SIZE];
+    size_t n = encode_frame_header(type, len, header);
+    std::string out;
+    out.reserve(n + len);
+    out.append(header, n);
+    out.append(payload, len);
+    return out;
+}
+
+inline std::string encode_frame(unsigned char type, const std::string& payload) {
+    return encode_frame(type, payload.data(), payload.size());
+}
+
+// Incremental frame decoder. Complete frames are handed to the callback as
+// pointers into the caller's read buffer; only a frame split across reads is
+// copied into the decoder's own buffer. feed() returns false on a malformed
+// or oversized frame, after which the connection should be dropped.
+class FrameDecoder {
+public:
+    template <typename OnFrame>
+    bool feed(const char* data, size_t len, OnFrame&& on_frame) {
+        if (!partial_.empty()) {
+            // Finish the pending frame first, one byte at a time for the
+            // header and then in bulk for the body
+            while (len > 0 && !have_header_) {
+                partial_.push_back(*data++);
+                --len;
+                if (!parse_header(partial_.data(), partial_.size())) return false;
+            }
+            if (!have_header_) return true;
+            size_t total = varint_len_ + frame_len_;
+            size_t take = std::min(len, total - partial_.size());
+            partial_.append(data, take);
+            data += take;
+            len -= take;
+            if (partial_.size() < total) return true;
+            on_frame((unsigned char)partial_[varint_len_], partial_.data() + varint_len_ + 1, frame_len_ - 1);
+            partial_.clear();
+            have_header_ = false;
+        }
+
+        while (len > 0) {
+            have_header_ = false;
+            if (!parse_header(data, len)) return false;
+            if (!have_header_ || len < varint_len_ + frame_len_) {
+                partial_.assign(data, len);
+                return true;
+            }
+            on_frame((unsigned char)data[varint_len_], data + varint_len_ + 1, frame_len_ - 1);
+            data += varint_len_ + frame_len_;
+            len -= varint_len_ + frame_len_;
+            have_header_ = false;
+        }
+        return true;
+    }
+
+    size_t buffered() const { return partial_.size(); }
+
+private:
+    // Sets have_header_ once varint and type byte are present
+    bool parse_header(const char* p, size_t len) {
+        size_t value = 0;
+        size_t i = 0;
+        for (; i < len && i < MAX_FRAME_HEADER_SIZE - 1; ++i) {
+            unsigned char byte = (unsigned char)p[i];
+            value |= (size_t)(byte & 0x7f) << (7 * i);
+            if ((byte & 0x80) == 0) {
+                if (value == 0 || value > MAX_FRAME_SIZE) return false;
+                if (i + 1 >= len) return true; // Type byte not here yet
+                frame_len_ = value;
+                varint_len_ = i + 1;
+                have_header_ = true;
+                return true;
+            }
+        }
+        return i < MAX_FRAME_HEADER_SIZE - 1; // Varint too long otherwise
+    }
+
+    std::string partial_;
+    size_t frame_len_ = 0;  // type byte + payload
+    size_t varint_len_ = 0;
+    bool have_header_ = false;
+};
+
+// Incremental decoder for the newline-delimited text protocol. Old clients
+// never sent a newline and relied on one recv() per message, so until the
+// first '\n' is seen a read's trailing partial line is delivered as a line.
+// Lines longer than MAX_FRAME_SIZE are delivered in pieces. A read is split
+// in a single vectorized pass over it (scan_each).
+class LineDecoder {
+public:
+    // saw_newline carries on a stream another decoder started
+    explicit LineDecoder(bool saw_newline = false) : saw_newline_(saw_newline) {}
+
+    template <typename OnLine>
+    void feed(const char* data, size_t len, OnLine&& on_line) {
+        size_t start = 0;
+        scan_each(data, len, '\n', [&](size_t nl) {
+            saw_newline_ = true;
+            if (partial_.empty()) {
+                on_line(data + start, nl - start);
+            } else {
+                partial_.append(data + start, nl - start);
+                on_line(partial_.data(), partial_.size());
+                partial_.clear();
+            }
+            start = nl + 1;
+        });
+        data += start;
+        len -= start;
+        if (len == 0) return;
+        partial_.append(data, len);
+        if (!saw_newline_ || partial_.size() >= MAX_FRAME_SIZE) {
+            on_line(partial_.data(), partial_.size());
+            partial_.clear();
+        }
+    }
+
+    size_t buffered() const { return partial_.size(); }
+    bool saw_newline() const { return saw_newline_; }
+
+private:
+    std::string partial_;
+    bool saw_newline_;
+};
+
+#endif // CHAT_PROTOCOL_H
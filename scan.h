@@ -0,0 +1,203 @@
+#ifndef CHAT_SCAN_H
+#define CHAT_SCAN_H
+
+// Vectorized byte scanning for the inbound parser: delimiter search, trailing
+// whitespace trim and UTF-8 validation. The instruction set is picked at
+// compile time (AVX2 when built with -mavx2, SSE2 on any x86-64, NEON on
+// ARM64) with a scalar fallback everywhere else.
+//
+// Each backend turns one block of input into a bitmask with a bit per byte
+// (NEON: one bit per 4-bit nibble, see SCAN_SHIFT), so a whole read is split
+// by walking set bits instead of restarting a search after every match.
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+    #define CHAT_SCAN_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define CHAT_SCAN_SSE2 1
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+    #include <arm_neon.h>
+    #define CHAT_SCAN_NEON 1
+#endif
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#endif
+
+inline int scan_ctz(uint64_t mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctzll(mask);
+#endif
+}
+
+inline int scan_highest_bit(uint64_t mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, mask);
+    return (int)index;
+#else
+    return 63 - __builtin_clzll(mask);
+#endif
+}
+
+inline bool scan_is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+#if defined(CHAT_SCAN_AVX2)
+
+const size_t SCAN_BLOCK = 32;
+const int SCAN_SHIFT = 0; // log2(mask bits per byte)
+
+inline __m256i scan_load(const char* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+inline uint64_t scan_eq(const char* p, char c) {
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(scan_load(p), _mm256_set1_epi8(c)));
+}
+inline uint64_t scan_non_ascii(const char* p) { return (uint32_t)_mm256_movemask_epi8(scan_load(p)); }
+inline uint64_t scan_space(const char* p) {
+    __m256i v = scan_load(p);
+    __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                                 _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))),
+                                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')),
+                                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))));
+    return (uint32_t)_mm256_movemask_epi8(m);
+}
+const uint64_t SCAN_FULL = 0xffffffffull;
+
+#elif defined(CHAT_SCAN_SSE2)
+
+const size_t SCAN_BLOCK = 16;
+const int SCAN_SHIFT = 0;
+
+inline __m128i scan_load(const char* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+inline uint64_t scan_eq(const char* p, char c) {
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(scan_load(p), _mm_set1_epi8(c)));
+}
+inline uint64_t scan_non_ascii(const char* p) { return (uint32_t)_mm_movemask_epi8(scan_load(p)); }
+inline uint64_t scan_space(const char* p) {
+    __m128i v = scan_load(p);
+    __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+                             _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))));
+    return (uint32_t)_mm_movemask_epi8(m);
+}
+const uint64_t SCAN_FULL = 0xffffull;
+
+#elif defined(CHAT_SCAN_NEON)
+
+const size_t SCAN_BLOCK = 16;
+const int SCAN_SHIFT = 2; // NEON has no movemask; narrowing leaves 4 bits per byte
+
+// Keeps the top bit of each byte's nibble so every byte maps to one set bit
+inline uint64_t scan_movemask(uint8x16_t m) {
+    uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0) & 0x8888888888888888ull;
+}
+inline uint8x16_t scan_load(const char* p) { return vld1q_u8(reinterpret_cast<const uint8_t*>(p)); }
+inline uint64_t scan_eq(const char* p, char c) { return scan_movemask(vceqq_u8(scan_load(p), vdupq_n_u8((uint8_t)c))); }
+inline uint64_t scan_non_ascii(const char* p) { return scan_movemask(vcgeq_u8(scan_load(p), vdupq_n_u8(0x80))); }
+inline uint64_t scan_space(const char* p) {
+    uint8x16_t v = scan_load(p);
+    uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')), vceqq_u8(v, vdupq_n_u8('\n'))),
+                            vorrq_u8(vceqq_u8(v, vdupq_n_u8('\r')), vceqq_u8(v, vdupq_n_u8('\t'))));
+    return scan_movemask(m);
+}
+const uint64_t SCAN_FULL = 0x8888888888888888ull;
+
+#endif
+
+// Calls on_match(offset) for every occurrence of c in p[0, len), in order
+template <typename OnMatch>
+void scan_each(const char* p, size_t len, char c, OnMatch&& on_match) {
+    size_t i = 0;
+#if defined(CHAT_SCAN_AVX2) || defined(CHAT_SCAN_SSE2) || defined(CHAT_SCAN_NEON)
+    for (; i + SCAN_BLOCK <= len; i += SCAN_BLOCK) {
+        uint64_t mask = scan_eq(p + i, c);
+        while (mask != 0) {
+            on_match(i + (size_t)(scan_ctz(mask) >> SCAN_SHIFT));
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i < len; ++i) {
+        if (p[i] == c) on_match(i);
+    }
+}
+
+// Length of p[0, len) without its trailing spaces, tabs, CRs and LFs
+inline size_t scan_trim_right(const char* p, size_t len) {
+#if defined(CHAT_SCAN_AVX2) || defined(CHAT_SCAN_SSE2) || defined(CHAT_SCAN_NEON)
+    while (len >= SCAN_BLOCK) {
+        uint64_t kept = ~scan_space(p + len - SCAN_BLOCK) & SCAN_FULL;
+        if (kept != 0) return len - SCAN_BLOCK + (size_t)(scan_highest_bit(kept) >> SCAN_SHIFT) + 1;
+        len -= SCAN_BLOCK;
+    }
+#endif
+    while (len > 0 && scan_is_space(p[len - 1])) --len;
+    return len;
+}
+
+// Validates one multi-byte sequence starting at p[i] (a lead byte >= 0x80);
+// returns its length, or 0 if it is malformed, overlong, a surrogate or past
+// U+10FFFF
+inline size_t scan_utf8_sequence(const unsigned char* p, size_t i, size_t len) {
+    unsigned char lead = p[i];
+    size_t need;
+    unsigned char lo = 0x80, hi = 0xBF; // Allowed range for the second byte
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        need = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        need = 3;
+        if (lead == 0xE0) lo = 0xA0;      // Overlong
+        else if (lead == 0xED) hi = 0x9F; // Surrogates
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        need = 4;
+        if (lead == 0xF0) lo = 0x90;      // Overlong
+        else if (lead == 0xF4) hi = 0x8F; // Above U+10FFFF
+    } else {
+        return 0;
+    }
+    if (len - i < need) return 0;
+    if (p[i + 1] < lo || p[i + 1] > hi) return 0;
+    for (size_t k = 2; k < need; ++k) {
+        if ((p[i + k] & 0xC0) != 0x80) return 0;
+    }
+    return need;
+}
+
+// True if p[0, len) is well-formed UTF-8. ASCII, the common case for chat,
+// is skipped a block at a time; only the bytes of multi-byte characters are
+// checked one by one.
+inline bool scan_utf8_valid(const char* data, size_t len) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    size_t i = 0;
+    while (i < len) {
+#if defined(CHAT_SCAN_AVX2) || defined(CHAT_SCAN_SSE2) || defined(CHAT_SCAN_NEON)
+        if (i + SCAN_BLOCK <= len) {
+            uint64_t high = scan_non_ascii(data + i);
+            if (high == 0) {
+                i += SCAN_BLOCK;
+                continue;
+            }
+            i += (size_t)(scan_ctz(high) >> SCAN_SHIFT);
+        }
+#endif
+        if (p[i] < 0x80) {
+            ++i;
+            continue;
+        }
+        size_t n = scan_utf8_sequence(p, i, len);
+        if (n == 0) return false;
+        i += n;
+    }
+    return true;
+}
+
+#endif // CHAT_SCAN_H
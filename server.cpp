@@ -3,14 +3,37 @@
 #include <string>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <new>
 #include <algorithm>
 #include <cstring>
 #include <cerrno>
 #include <map>
+#include <deque>
+#include <queue>
+#include <set>
+#include <unordered_map>
+#include <initializer_list>
 #include <chrono>
+#include <condition_variable>
+#include <random>
 #include <ctime>
-#include <iomanip>
 #include <cstdlib>
+#include <cstdio>
+#include <fstream>
+
+#include "protocol.h"
+#include "timer_wheel.h"
+
+#if defined(CHAT_HAVE_ZLIB)
+    #include <zlib.h> // DEFLATE frames; the Makefile sets CHAT_HAVE_ZLIB unless ZLIB=0
+#endif
+#if defined(CHAT_HAVE_OPENSSL) && !defined(_WIN32)
+    #include <openssl/ssl.h> // TLS; the Makefile sets CHAT_HAVE_OPENSSL unless TLS=0
+    #include <openssl/err.h>
+    #define CHAT_TLS 1
+#endif
 
 // Platform specific includes and definitions
 #ifdef _WIN32
@@ -22,6 +45,7 @@
     #define _WINSOCK_DEPRECATED_NO_WARNINGS // Suppress warnings for older Winsock functions
     #include <winsock2.h>
     #include <ws2tcpip.h> // Include for inet_ntop and other TCP/IP functions
+    #include <mstcpip.h>  // SIO_KEEPALIVE_VALS
     #pragma comment(lib, "ws2_32.lib") // Link with Winsock library
     using socket_t = SOCKET;
     using socklen_t = int;
@@ -35,232 +59,6885 @@
         }
     }
     inline void cleanup_sockets() { WSACleanup(); }
+    inline bool set_nonblocking(socket_t s) {
+        u_long mode = 1;
+        return ioctlsocket(s, FIONBIO, &mode) == 0;
+    }
+    inline bool would_block(int err) { return err == WSAEWOULDBLOCK; }
+    inline bool connect_pending(int err) { return err == WSAEWOULDBLOCK; }
+    inline int poll_sockets(struct pollfd* fds, unsigned count, int timeout_ms) {
+        return WSAPoll(fds, (ULONG)count, timeout_ms);
+    }
+    using io_slice = WSABUF;
+    inline void set_slice(io_slice& slice, const char* data, size_t len) {
+        slice.buf = const_cast<char*>(data);
+        slice.len = (ULONG)len;
+    }
+    inline long send_slices(socket_t s, io_slice* slices, int count) {
+        DWORD sent = 0;
+        if (WSASend(s, slices, (DWORD)count, &sent, 0, nullptr, nullptr) == SOCKET_ERROR) return SOCKET_ERROR;
+        return (long)sent;
+    }
+    inline bool set_tcp_nodelay(socket_t s, bool on) {
+        BOOL v = on ? TRUE : FALSE;
+        return setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&v, sizeof(v)) == 0;
+    }
+    inline bool set_tcp_cork(socket_t, bool) { return false; } // No equivalent in Winsock
+    // Windows sends 10 probes before giving up; only their timing is settable
+    inline void set_tcp_keepalive(socket_t s, int idle_s, int interval_s, int) {
+        struct tcp_keepalive values;
+        values.onoff = 1;
+        values.keepalivetime = (ULONG)idle_s * 1000;
+        values.keepaliveinterval = (ULONG)interval_s * 1000;
+        DWORD returned = 0;
+        WSAIoctl(s, SIO_KEEPALIVE_VALS, &values, sizeof(values), nullptr, 0, &returned, nullptr, nullptr);
+    }
+    inline bool set_reuse_port(socket_t) { return false; } // Winsock can't balance accepts across sockets
+    inline bool pin_current_thread(int cpu) {
+        return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (cpu % (8 * sizeof(DWORD_PTR)))) != 0;
+    }
+    // Console Ctrl+C, Ctrl+Break and close start the same drain as SIGTERM
+    // and SIGINT do on POSIX
+    inline HANDLE shutdown_event() {
+        static HANDLE event = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        return event;
+    }
+    inline BOOL WINAPI on_console_event(DWORD) {
+        SetEvent(shutdown_event());
+        return TRUE;
+    }
+    inline void install_shutdown_handler() {
+        shutdown_event();
+        SetConsoleCtrlHandler(on_console_event, TRUE);
+    }
+    // No SIGHUP here; reloads come through POST /reload only
+    template <typename OnReload>
+    inline void wait_for_shutdown(OnReload&&) { WaitForSingleObject(shutdown_event(), INFINITE); }
+    inline void stop_listening(socket_t s) { closesocket(s); } // Also fails an accept() blocked on s
+    #define CHAT_POLLER_IOCP 1
 #else // Linux, macOS, etc. (POSIX)
     #include <sys/socket.h>
     #include <netinet/in.h>
     #include <arpa/inet.h>
     #include <unistd.h>
     #include <netdb.h>
+    #include <fcntl.h>
+    #include <signal.h>
+    #include <pthread.h>
+    #include <sys/uio.h>
+    #include <sys/un.h>
+    #include <poll.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <dirent.h>
+    #include <netinet/tcp.h>
     using socket_t = int;
     #define INVALID_SOCKET -1
     #define SOCKET_ERROR   -1
     #define close_socket(s) close(s)
     #define socket_error() errno
-    inline void init_sockets() {} // No-op on POSIX
+    inline void init_sockets() { signal(SIGPIPE, SIG_IGN); } // Peers may vanish mid-send
     inline void cleanup_sockets() {} // No-op on POSIX
+    inline bool set_nonblocking(socket_t s) {
+        int flags = fcntl(s, F_GETFL, 0);
+        return flags >= 0 && fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+    }
+    inline bool would_block(int err) { return err == EAGAIN || err == EWOULDBLOCK; }
+    inline bool connect_pending(int err) { return err == EINPROGRESS; }
+    inline int poll_sockets(struct pollfd* fds, unsigned count, int timeout_ms) {
+        return poll(fds, (nfds_t)count, timeout_ms);
+    }
+    using io_slice = struct iovec;
+    inline void set_slice(io_slice& slice, const char* data, size_t len) {
+        slice.iov_base = const_cast<char*>(data);
+        slice.iov_len = len;
+    }
+    inline long send_slices(socket_t s, io_slice* slices, int count) {
+        return (long)writev(s, slices, count);
+    }
+    inline bool set_tcp_nodelay(socket_t s, bool on) {
+        int v = on ? 1 : 0;
+        return setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &v, sizeof(v)) == 0;
+    }
+    // Holds back partial segments until uncorked (TCP_CORK / BSD TCP_NOPUSH)
+    inline bool set_tcp_cork(socket_t s, bool on) {
+        int v = on ? 1 : 0;
+        #if defined(TCP_CORK)
+            return setsockopt(s, IPPROTO_TCP, TCP_CORK, &v, sizeof(v)) == 0;
+        #elif defined(TCP_NOPUSH)
+            return setsockopt(s, IPPROTO_TCP, TCP_NOPUSH, &v, sizeof(v)) == 0;
+        #else
+            (void)s; (void)v;
+            return false;
+        #endif
+    }
+    // Has the kernel probe a connection quiet for idle_s seconds every
+    // interval_s, and reset it after count probes go unanswered
+    inline void set_tcp_keepalive(socket_t s, int idle_s, int interval_s, int count) {
+        int on = 1;
+        setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        #if defined(TCP_KEEPIDLE)
+            setsockopt(s, IPPROTO_TCP, TCP_KEEPIDLE, &idle_s, sizeof(idle_s));
+        #elif defined(TCP_KEEPALIVE) // macOS
+            setsockopt(s, IPPROTO_TCP, TCP_KEEPALIVE, &idle_s, sizeof(idle_s));
+        #endif
+        #if defined(TCP_KEEPINTVL)
+            setsockopt(s, IPPROTO_TCP, TCP_KEEPINTVL, &interval_s, sizeof(interval_s));
+        #endif
+        #if defined(TCP_KEEPCNT)
+            setsockopt(s, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+        #endif
+        (void)interval_s;
+        (void)count;
+    }
+    // Lets several sockets bind the same port, with the kernel spreading new
+    // connections across them (SO_REUSEPORT_LB on FreeBSD)
+    inline bool set_reuse_port(socket_t s) {
+        int v = 1;
+        #if defined(SO_REUSEPORT_LB)
+            return setsockopt(s, SOL_SOCKET, SO_REUSEPORT_LB, &v, sizeof(v)) == 0;
+        #elif defined(SO_REUSEPORT)
+            return setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &v, sizeof(v)) == 0;
+        #else
+            (void)s; (void)v;
+            return false;
+        #endif
+    }
+    // SIGTERM, SIGINT and SIGHUP are blocked in every thread and collected
+    // by wait_for_shutdown(). Threads inherit the mask, so install this
+    // before starting any.
+    inline sigset_t shutdown_signals() {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGTERM);
+        sigaddset(&set, SIGINT);
+        sigaddset(&set, SIGHUP);
+        return set;
+    }
+    inline void install_shutdown_handler() {
+        sigset_t set = shutdown_signals();
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    }
+    // Returns on SIGTERM or SIGINT; each SIGHUP in between calls on_reload()
+    template <typename OnReload>
+    inline void wait_for_shutdown(OnReload&& on_reload) {
+        sigset_t set = shutdown_signals();
+        int sig;
+        while (true) {
+            if (sigwait(&set, &sig) != 0) continue;
+            if (sig != SIGHUP) return;
+            on_reload();
+        }
+    }
+    // Refuses new connections; on Linux it also fails an accept() blocked on s
+    inline void stop_listening(socket_t s) { shutdown(s, SHUT_RDWR); }
+
+    #if defined(__linux__)
+        #include <sys/epoll.h>
+        #include <sys/eventfd.h>
+        #include <sched.h>
+        #define CHAT_POLLER_EPOLL 1
+        // The io_uring engine needs the 6.1 UAPI header (multishot recv,
+        // DEFER_TASKRUN); it talks to the kernel directly, without liburing
+        #if defined(__has_include)
+            #if __has_include(<linux/io_uring.h>)
+                #include <linux/io_uring.h>
+                #include <sys/syscall.h>
+                #include <poll.h>
+            #endif
+        #endif
+        #if defined(IORING_RECV_MULTISHOT) && defined(IORING_SETUP_DEFER_TASKRUN)
+            #define CHAT_URING 1
+        #endif
+        inline bool pin_current_thread(int cpu) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+        }
+    #elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+        #include <sys/event.h>
+        #include <sys/time.h>
+        #define CHAT_POLLER_KQUEUE 1
+        inline bool pin_current_thread(int) { return false; } // No portable affinity call here
+    #else
+        #error "No event loop backend for this platform (need epoll, kqueue or IOCP)"
+    #endif
 #endif
 
 int PORT = 8080; // Changed to non-const to allow modification from env
 const int BUFFER_SIZE = 4096;
-const int MAX_CLIENTS = 10;
 
-// Map to store client sockets and their usernames
-std::map<socket_t, std::string> clients;
-std::mutex clients_mutex;
+// Admission control, settable from env. Connections over a limit are closed
+// straight after accept(), before a session or reactor slot exists. The
+// limits themselves can change at runtime, so they live in Tuning (see the
+// Runtime tuning section): MAX_CLIENTS, MAX_CLIENTS_PER_IP, ACCEPT_RATE,
+// ACCEPT_BURST and HANDSHAKE_TIMEOUT_MS.
+int LISTEN_BACKLOG = 128;        // Kernel queue of not-yet-accepted connections
+int METRICS_PORT = 0;            // Prometheus text endpoint, 0 = off
 
-// Helper function for timestamped logging
-void log_event(const std::string& message) {
-    auto now = std::chrono::system_clock::now();
-    std::time_t now_c = std::chrono::system_clock::to_time_t(now);
-    std::tm now_tm;
-    #ifdef _WIN32
-        localtime_s(&now_tm, &now_c);
-    #else
-        localtime_r(&now_c, &now_tm);
-    #endif
-    
-    std::cout << "[" << std::put_time(&now_tm, "%Y-%m-%d %H:%M:%S") << "] " << message << std::endl;
+// Flow control, also from env. Inbound chat lines and commands pass a
+// per-client token bucket (MSG_RATE and MSG_BURST in Tuning); outbound queues
+// are bounded by count and bytes (OUTBOUND_QUEUE_BYTES in Tuning), and
+// OVERFLOW_POLICY says what happens to a client that can't keep up.
+int OUTBOUND_QUEUE_DEPTH = 1024;          // Pending messages per client, fixed when its queue is made
+enum class OverflowPolicy { DropNewest, DropOldest, Disconnect };
+int REACTOR_THREADS = 0; // 0 = one per core, set from env
+
+// How connections reach the reactors (ACCEPT_MODE env). shared: the main
+// thread accepts on one socket and deals sessions out round-robin.
+// reuseport: every reactor listens on its own SO_REUSEPORT socket and the
+// kernel spreads connections across them, so the accept path never crosses
+// threads. PIN_THREADS pins reactor i to CPU i; by default only in reuseport
+// mode, where each shard's sockets, sessions and caches then stay on one core.
+enum class AcceptMode { Shared, ReusePort };
+AcceptMode ACCEPT_MODE = AcceptMode::Shared;
+int PIN_THREADS = -1; // -1 = on in reuseport mode only
+const int MAX_ACCEPTS_PER_WAKEUP = 64;
+
+// How reactors do their socket I/O (IO_ENGINE env). poll: readiness from
+// the Poller, then non-blocking calls. uring (Linux): an io_uring per
+// reactor with multishot accept and recv, and every send of a loop
+// iteration submitted together (see the io_uring engine section).
+enum class IoEngine { Poll, Uring };
+IoEngine IO_ENGINE = IoEngine::Poll;
+
+// Recent chat lines kept per room and replayed to whoever joins it. The
+// default depth fits one replay into a single scatter-gather send.
+int HISTORY_DEPTH = 50;          // Lines per room, 0 = no history
+int HISTORY_BYTES = 64 * 1024;   // Per-room cap on the stored lines' size
+
+// Version 2 clients that drop without /quit keep their name and room for
+// this long; reconnecting with their token resumes the session and replays
+// only the history lines they missed
+int RESUME_GRACE_MS = 30000; // 0 = no resume tokens
+
+// Version 2 clients that ask for it get lines of at least COMPRESS_MIN_BYTES
+// (in Tuning) as DEFLATE frames. Each line is compressed once, whatever its
+// fan-out.
+#if defined(CHAT_HAVE_ZLIB)
+bool COMPRESSION = true; // COMPRESSION=off refuses every request
+#else
+bool COMPRESSION = false;
+#endif
+
+// TLS on PORT (see the TLS section), off unless TLS_CERT is set
+std::string TLS_CERT; // PEM certificate chain
+std::string TLS_KEY;  // PEM private key, TLS_CERT's file if unset
+std::string TLS_TICKET_KEY; // File of 80 random bytes; nodes sharing it accept each other's tickets
+int TLS_KTLS = 1;     // Let the kernel encrypt records where it can (Linux kTLS)
+
+// Durable journal of those lines (see the Journal section), off unless
+// JOURNAL_DIR is set
+std::string JOURNAL_DIR;
+int JOURNAL_SEGMENT_MB = 64;  // Size of each preallocated segment file
+int JOURNAL_FSYNC_MS = 1000;  // Group commit interval; 0 = every batch, -1 = leave it to the OS
+int JOURNAL_SEGMENTS = 16;    // Segment files kept, oldest deleted first; 0 = keep all
+
+// Cluster relay (see the Cluster section), off unless CLUSTER_PORT or
+// CLUSTER_PEERS is set
+int CLUSTER_PORT = 0;                       // Accept peer links here, 0 = don't listen
+std::string CLUSTER_PEERS;                  // "host:port,..." to dial and keep connected
+std::string NODE_ID;                        // Unique per instance, random by default
+int CLUSTER_RETRY_MS = 2000;                // Redial delay after a failed or lost link
+const int PEER_HELLO_TIMEOUT_MS = 10000;    // For a new link's PEER_HELLO
+const int PEER_CONNECT_TIMEOUT_MS = 5000;   // For a dialed link's TCP handshake
+int CLUSTER_QUEUE_BYTES = 8 * 1024 * 1024;  // Unsent bytes per link before relays are dropped
+
+// Graceful shutdown on SIGTERM or SIGINT: stop accepting, tell each client to
+// reconnect after a random delay of up to DRAIN_SPREAD_MS (so a rolling
+// deploy doesn't bring everyone back at once), give outbound queues up to
+// DRAIN_TIMEOUT_MS to empty, then exit
+int DRAIN_TIMEOUT_MS = 10000;
+int DRAIN_SPREAD_MS = 5000;
+std::atomic<bool> draining(false); // Set once, when the drain starts
+
+// Hot upgrade (see the Upgrade handoff section), off unless UPGRADE_SOCKET
+// names a Unix socket path: a new server started with the same path takes
+// over this one's listeners, clients and room state instead of binding
+std::string UPGRADE_SOCKET;
+const int UPGRADE_POLL_MS = 100; // How soon the shared accept thread notices a drain when upgradable
+const int UPGRADE_HELLO_TIMEOUT_MS = 5000; // For a successor's HELLO and READY, before we commit to anything
+
+// Write batching, liveness and presence batching are tuned at runtime too;
+// see their fields in Tuning.
+
+// How each client socket's Nagle/cork options are set (TCP_POLICY env):
+// auto picks nodelay when write batching is on (we already coalesce, Nagle
+// would only add latency) and leaves the kernel default otherwise.
+enum class TcpPolicy { Auto, Nagle, NoDelay, Cork };
+TcpPolicy TCP_POLICY = TcpPolicy::Auto;
+const size_t CACHE_LINE_SIZE = 64;
+const int MAX_POLL_EVENTS = 256;
+const int MAX_READS_PER_WAKEUP = 16; // Bounds how long one busy socket can hold a reactor
+const size_t OUTBOUND_BATCH = 64;         // Messages pulled from the outbox per drain
+const int MAX_IOVECS = 256;               // Segments handed to one scatter-gather send
+
+// ---------------------------------------------------------------------------
+// Logging: asynchronous and batched. Each thread appends records to its own
+// single-producer ring; a background writer drains every ring, formats the
+// timestamp (cached per second) and hands the batch to stdout in one write.
+// A full ring drops the record instead of blocking the hot path.
+// ---------------------------------------------------------------------------
+enum class LogLevel { Error = 0, Warn = 1, Info = 2, Debug = 3 };
+
+// Chat message bodies are logged at Debug; LOG_LEVEL=info turns them off
+std::atomic<int> log_level((int)LogLevel::Debug);
+
+const size_t LOG_RING_BYTES = 256 * 1024;
+const size_t LOG_LINE_MAX = 4096; // Longer lines are truncated
+const int LOG_IDLE_SLEEP_MS = 20;
+
+inline bool log_enabled(LogLevel level) {
+    return (int)level <= log_level.load(std::memory_order_relaxed);
 }
 
-// Function to broadcast a message to all clients except the sender
-void broadcast_message(const std::string& message, socket_t sender_socket = INVALID_SOCKET) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    for (const auto& pair : clients) {
-        socket_t client_socket = pair.first;
-        if (client_socket != sender_socket && client_socket != INVALID_SOCKET) {
-            if (send(client_socket, message.c_str(), message.length(), 0) == SOCKET_ERROR) {
-                // Log error but don't spam stderr too much
-            }
+// A borrowed slice of text making up part of a log line
+struct LogPiece {
+    const char* data;
+    size_t len;
+    LogPiece(const std::string& s) : data(s.data()), len(s.size()) {}
+    LogPiece(const char* s) : data(s), len(strlen(s)) {}
+    LogPiece(const char* s, size_t n) : data(s), len(n) {}
+};
+
+class LogRing {
+public:
+    LogRing() : buf_(new char[LOG_RING_BYTES]), head_(0), tail_(0), dropped_(0) {}
+
+    // Producer (owning thread only)
+    void push(std::time_t seconds, std::initializer_list<LogPiece> pieces) {
+        size_t len = 0;
+        for (const LogPiece& p : pieces) len += p.len;
+        len = std::min(len, LOG_LINE_MAX);
+        Header header = { (uint32_t)len, (int64_t)seconds };
+        size_t need = sizeof(header) + len;
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (LOG_RING_BYTES - (head - tail_.load(std::memory_order_acquire)) < need) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
         }
+        copy_in(head, (const char*)&header, sizeof(header));
+        size_t pos = head + sizeof(header);
+        size_t left = len;
+        for (const LogPiece& p : pieces) {
+            size_t n = std::min(p.len, left);
+            copy_in(pos, p.data, n);
+            pos += n;
+            left -= n;
+        }
+        head_.store(head + need, std::memory_order_release);
     }
-}
 
-// Function to handle communication with a single client
-void handle_client(socket_t client_socket) {
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
-    std::string username;
+    // Consumer (writer thread only). on_record(seconds, text, len) is given
+    // a contiguous copy in scratch.
+    template <typename OnRecord>
+    bool drain(std::string& scratch, OnRecord&& on_record) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t head = head_.load(std::memory_order_acquire);
+        if (tail == head) return false;
+        while (tail != head) {
+            Header header;
+            copy_out(tail, (char*)&header, sizeof(header));
+            scratch.resize(header.len);
+            copy_out(tail + sizeof(header), &scratch[0], header.len);
+            on_record((std::time_t)header.seconds, scratch.data(), scratch.size());
+            tail += sizeof(header) + header.len;
+        }
+        tail_.store(tail, std::memory_order_release);
+        return true;
+    }
 
-    // 1. Receive Username
-    bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-    if (bytes_received > 0) {
-        buffer[bytes_received] = '\0';
-        username = std::string(buffer);
-        // Trim whitespace
-        size_t last_char = username.find_last_not_of(" \n\r\t");
-        if (last_char != std::string::npos) {
-            username = username.substr(0, last_char + 1);
-        } else {
-            username = "Anonymous";
+    uint64_t take_dropped() { return dropped_.exchange(0, std::memory_order_relaxed); }
+
+private:
+    struct Header {
+        uint32_t len;
+        int64_t seconds;
+    };
+
+    void copy_in(size_t pos, const char* src, size_t n) {
+        size_t off = pos % LOG_RING_BYTES;
+        size_t first = std::min(n, LOG_RING_BYTES - off);
+        memcpy(buf_.get() + off, src, first);
+        memcpy(buf_.get(), src + first, n - first);
+    }
+    void copy_out(size_t pos, char* dst, size_t n) const {
+        size_t off = pos % LOG_RING_BYTES;
+        size_t first = std::min(n, LOG_RING_BYTES - off);
+        memcpy(dst, buf_.get() + off, first);
+        memcpy(dst + first, buf_.get(), n - first);
+    }
+
+    std::unique_ptr<char[]> buf_;
+    // Padded rather than alignas: C++11 operator new ignores over-alignment
+    char pad0_[CACHE_LINE_SIZE];
+    std::atomic<size_t> head_;
+    char pad1_[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail_;
+    char pad2_[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    std::atomic<uint64_t> dropped_;
+};
+
+class Logger {
+public:
+    static Logger& instance() {
+        // Never destroyed: the writer thread outlives static destructors
+        static Logger* logger = new Logger();
+        return *logger;
+    }
+
+    LogRing& ring_for_this_thread() {
+        thread_local LogRing* ring = nullptr;
+        if (ring == nullptr) {
+            ring = new LogRing();
+            std::lock_guard<std::mutex> lock(rings_mutex_);
+            rings_.push_back(ring);
         }
-        if (username.empty()) username = "Anonymous";
-    } else {
-        close_socket(client_socket);
-        return;
+        return *ring;
     }
 
-    // 2. Register Client
-    {
-        std::lock_guard<std::mutex> lock(clients_mutex);
-        
-        // Handle duplicate names
-        std::string final_username = username;
-        int count = 1;
-        bool exists = true;
-        while (exists) {
-            exists = false;
-            for (const auto& pair : clients) {
-                if (pair.second == final_username) {
-                    exists = true;
-                    final_username = username + "_" + std::to_string(count++);
-                    break;
-                }
+    // Synchronously writes out everything logged so far (used on shutdown)
+    void flush() {
+        std::lock_guard<std::mutex> lock(drain_mutex_);
+        drain_all();
+    }
+
+private:
+    Logger() : cached_second_(-1) {
+        std::thread(&Logger::run, this).detach();
+    }
+
+    void run() {
+        while (true) {
+            bool busy;
+            {
+                std::lock_guard<std::mutex> lock(drain_mutex_);
+                busy = drain_all();
             }
+            if (!busy) std::this_thread::sleep_for(std::chrono::milliseconds(LOG_IDLE_SLEEP_MS));
         }
-        username = final_username;
-        clients[client_socket] = username;
     }
 
-    log_event("User connected: " + username + " (Socket: " + std::to_string(client_socket) + ")");
-    std::string welcome_msg = "Welcome, " + username + "!\n";
-    send(client_socket, welcome_msg.c_str(), welcome_msg.length(), 0);
-    broadcast_message(username + " has joined the chat.", client_socket);
+    bool drain_all() {
+        {
+            // Copy-assigned so the snapshot keeps its capacity between drains
+            std::lock_guard<std::mutex> lock(rings_mutex_);
+            rings_snapshot_ = rings_;
+        }
+        bool any = false;
+        uint64_t dropped = 0;
+        for (LogRing* ring : rings_snapshot_) {
+            any |= ring->drain(scratch_, [this](std::time_t seconds, const char* text, size_t len) {
+                append_line(seconds, text, len);
+            });
+            dropped += ring->take_dropped();
+        }
+        if (dropped > 0) {
+            std::string note = "Logger dropped " + std::to_string(dropped) + " line(s)";
+            append_line(std::time(nullptr), note.data(), note.size());
+        }
+        if (!batch_.empty()) {
+            write_stdout(batch_.data(), batch_.size());
+            batch_.clear();
+        }
+        return any;
+    }
 
-    // 3. Message Loop
-    while ((bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0)) > 0) {
-        buffer[bytes_received] = '\0';
-        std::string message(buffer);
-        
-        // Trim
-       size_t last_char = message.find_last_not_of(" \n\r\t");
-        if (last_char != std::string::npos) {
-            message = message.substr(0, last_char + 1);
-        } else {
-            message = "";
+    void append_line(std::time_t seconds, const char* text, size_t len) {
+        if (seconds != cached_second_) {
+            std::tm now_tm;
+            #ifdef _WIN32
+                localtime_s(&now_tm, &seconds);
+            #else
+                localtime_r(&seconds, &now_tm);
+            #endif
+            char formatted[64];
+            size_t n = strftime(formatted, sizeof(formatted), "[%Y-%m-%d %H:%M:%S] ", &now_tm);
+            cached_stamp_.assign(formatted, n);
+            cached_second_ = seconds;
         }
+        batch_ += cached_stamp_;
+        batch_.append(text, len);
+        batch_ += '\n';
+    }
+
+    static void write_stdout(const char* data, size_t len) {
+        #ifdef _WIN32
+            fwrite(data, 1, len, stdout);
+            fflush(stdout);
+        #else
+            while (len > 0) {
+                ssize_t n = write(STDOUT_FILENO, data, len);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    return;
+                }
+                data += n;
+                len -= (size_t)n;
+            }
+        #endif
+    }
+
+    std::mutex rings_mutex_;
+    std::vector<LogRing*> rings_;
+    std::mutex drain_mutex_; // Writer thread vs. flush()
+    std::vector<LogRing*> rings_snapshot_;
+    std::string batch_;
+    std::string scratch_;
+    std::time_t cached_second_;
+    std::string cached_stamp_;
+};
+
+// Helper function for timestamped logging
+void log_event(LogLevel level, std::initializer_list<LogPiece> pieces) {
+    if (!log_enabled(level)) return;
+    Logger::instance().ring_for_this_thread().push(std::time(nullptr), pieces);
+}
+
+void log_event(const std::string& message) {
+    log_event(LogLevel::Info, {message});
+}
+
+// ---------------------------------------------------------------------------
+// Runtime tuning: the settings that can change without a restart, kept in an
+// immutable, versioned snapshot. Defaults and the environment make the base;
+// CONFIG_FILE, a file of NAME=value lines using the environment's names,
+// overrides it. SIGHUP or POST /reload on the metrics port re-reads the file
+// and publishes a whole new snapshot with one atomic store, so a hot path
+// pays one pointer load per read and never sees half a reload. A file with
+// any bad line is refused and the running snapshot stays.
+//
+// Published snapshots are never freed: reloads are rare, and a thread that
+// loaded the old pointer can keep using it without counting references.
+// ---------------------------------------------------------------------------
+struct Tuning {
+    uint64_t version = 0; // Bumped by every reload
+
+    // Admission
+    int max_clients = 10;             // Open connections, handshaking ones included
+    int max_clients_per_ip = 0;       // 0 = no per-address cap
+    int accept_rate = 0;              // New connections per second, 0 = unlimited
+    int accept_burst = 0;             // Token bucket depth, 0 = same as accept_rate
+    int handshake_timeout_ms = 10000; // Time allowed to send a username, 0 = forever
+
+    // Flow control
+    int msg_rate = 0;                       // Messages per second per client, 0 = unlimited
+    int msg_burst = 0;                      // Token bucket depth, 0 = same as msg_rate
+    int outbound_queue_bytes = 1024 * 1024; // Pending wire bytes per client
+    OverflowPolicy overflow_policy = OverflowPolicy::DropNewest;
+
+    // Write batching. Output for a client is held for up to flush_window_us
+    // (rounded up to the poller's millisecond resolution) or until
+    // flush_bytes are queued, so a burst of messages leaves in one writev.
+    // 0 disables it.
+    int flush_window_us = 0;
+    int flush_bytes = 16 * 1024;
+
+    // Liveness, checked on each reactor's timer wheel. A logged-in version
+    // 3 client is sent a PING after heartbeat_interval_ms without a byte
+    // from it, and dropped if nothing arrives within heartbeat_timeout_ms of
+    // that. Older clients can't answer, so their sockets get TCP keepalive
+    // probes on the same schedule instead (set when they connect). A client
+    // whose socket takes none of its pending output for
+    // write_stall_timeout_ms is dropped too.
+    int heartbeat_interval_ms = 30000; // 0 = no heartbeats or keepalive
+    int heartbeat_timeout_ms = 10000;
+    int write_stall_timeout_ms = 60000; // 0 = wait forever
+
+    // Joins and leaves in a room are collected for presence_window_ms and
+    // sent as one roster update, so a reconnect storm costs each member a
+    // few messages rather than one per returning user
+    int presence_window_ms = 250;
+
+    int compress_min_bytes = 32;
+    LogLevel log_level = LogLevel::Debug; // Copied to the log_level the loggers read
+};
 
-        if (message.empty()) continue;
+// The integer settings, by their environment and CONFIG_FILE names
+struct TuningSetting {
+    const char* name;
+    int Tuning::*field;
+    int min_value;
+    int max_value;
+};
 
-        log_event("Message from " + username + ": " + message);
-        
-        std::string broadcast_msg = "[" + username + "]: " + message;
-        broadcast_message(broadcast_msg, client_socket);
+const TuningSetting TUNING_SETTINGS[] = {
+    {"MAX_CLIENTS", &Tuning::max_clients, 1, 1000000},
+    {"MAX_CLIENTS_PER_IP", &Tuning::max_clients_per_ip, 0, 1000000},
+    {"ACCEPT_RATE", &Tuning::accept_rate, 0, 1000000},
+    {"ACCEPT_BURST", &Tuning::accept_burst, 0, 1000000},
+    {"HANDSHAKE_TIMEOUT_MS", &Tuning::handshake_timeout_ms, 0, 3600 * 1000},
+    {"MSG_RATE", &Tuning::msg_rate, 0, 1000000},
+    {"MSG_BURST", &Tuning::msg_burst, 0, 1000000},
+    {"OUTBOUND_QUEUE_BYTES", &Tuning::outbound_queue_bytes, 1024, 1 << 30},
+    {"FLUSH_WINDOW_US", &Tuning::flush_window_us, 0, 1000000},
+    {"FLUSH_BYTES", &Tuning::flush_bytes, 1, 64 * 1024 * 1024},
+    {"HEARTBEAT_INTERVAL_MS", &Tuning::heartbeat_interval_ms, 0, 3600 * 1000},
+    {"HEARTBEAT_TIMEOUT_MS", &Tuning::heartbeat_timeout_ms, 1, 3600 * 1000},
+    {"WRITE_STALL_TIMEOUT_MS", &Tuning::write_stall_timeout_ms, 0, 3600 * 1000},
+    {"PRESENCE_WINDOW_MS", &Tuning::presence_window_ms, 0, 60 * 1000},
+    {"COMPRESS_MIN_BYTES", &Tuning::compress_min_bytes, 0, (int)MAX_FRAME_SIZE},
+};
+
+const char* const OVERFLOW_POLICY_NAMES[] = {"drop-newest", "drop-oldest", "disconnect"};
+const char* const LOG_LEVEL_NAMES[] = {"error", "warn", "info", "debug"};
+
+// Index of value in names, or -1
+template <size_t N>
+int name_index(const char* const (&names)[N], const std::string& value) {
+    for (size_t i = 0; i < N; ++i) {
+        if (value == names[i]) return (int)i;
     }
+    return -1;
+}
 
-    // 4. Disconnect
-    log_event("User disconnected: " + username);
-    broadcast_message(username + " has left the chat.", client_socket);
+Tuning tuning_defaults;
+std::atomic<const Tuning*> tuning_current(&tuning_defaults);
+std::string CONFIG_FILE;
+Tuning tuning_base;  // Defaults and environment, under CONFIG_FILE; set before the first reload
+std::mutex tuning_mutex; // Serializes reloads
+std::vector<std::unique_ptr<const Tuning>> tuning_published;
 
-    // Clean up
-    {
-        std::lock_guard<std::mutex> lock(clients_mutex);
-        clients.erase(client_socket);
+// The snapshot in force. A function making one decision takes it once, so
+// every setting it uses comes from the same version; nothing holds it
+// across waits, so a reload takes effect at the next decision.
+inline const Tuning& tuning() {
+    return *tuning_current.load(std::memory_order_acquire);
+}
+
+// Sets one named setting from its text; false, with the reason, if the name
+// or value isn't valid
+bool tuning_set(Tuning& out, const std::string& name, const std::string& value, std::string& error) {
+    if (name == "OVERFLOW_POLICY") {
+        int index = name_index(OVERFLOW_POLICY_NAMES, value);
+        if (index < 0) {
+            error = "expected drop-newest, drop-oldest or disconnect";
+            return false;
+        }
+        out.overflow_policy = (OverflowPolicy)index;
+        return true;
     }
-    
-    close_socket(client_socket);
+    if (name == "LOG_LEVEL") {
+        int index = name_index(LOG_LEVEL_NAMES, value);
+        if (index < 0) {
+            error = "expected error, warn, info or debug";
+            return false;
+        }
+        out.log_level = (LogLevel)index;
+        return true;
+    }
+    for (const TuningSetting& setting : TUNING_SETTINGS) {
+        if (name != setting.name) continue;
+        char* end = nullptr;
+        errno = 0;
+        long v = std::strtol(value.c_str(), &end, 10);
+        if (value.empty() || *end != '\0' || errno != 0 || v < setting.min_value || v > setting.max_value) {
+            error = "expected an integer from " + std::to_string(setting.min_value) + " to " +
+                    std::to_string(setting.max_value);
+            return false;
+        }
+        out.*setting.field = (int)v;
+        return true;
+    }
+    error = "not a setting that can be changed at runtime";
+    return false;
 }
 
-int main() {
-    init_sockets();
+std::string trim_spaces(const std::string& text) {
+    size_t begin = text.find_first_not_of(" \t\r");
+    if (begin == std::string::npos) return std::string();
+    return text.substr(begin, text.find_last_not_of(" \t\r") + 1 - begin);
+}
 
-    // 1. Configuration from Env
-    const char* env_port = std::getenv("PORT");
-    if (env_port) {
-        try {
-            int p = std::stoi(env_port);
-            if (p > 0 && p <= 65535) PORT = p;
-            else std::cerr << "Invalid PORT environment variable. Using default 8080." << std::endl;
-        } catch (...) {
-            std::cerr << "Invalid PORT format. Using default 8080." << std::endl;
+// Applies CONFIG_FILE's lines to out. Blank lines and '#' comments are
+// skipped; on the first bad line, returns false with its location.
+bool tuning_read_file(const std::string& path, Tuning& out, std::string& error) {
+    std::ifstream in(path);
+    if (!in) {
+        error = "can't read " + path;
+        return false;
+    }
+    std::string line;
+    for (int number = 1; std::getline(in, line); ++number) {
+        line = trim_spaces(line.substr(0, line.find('#')));
+        if (line.empty()) continue;
+        size_t eq = line.find('=');
+        std::string why = "expected NAME=value";
+        if (eq != std::string::npos &&
+            tuning_set(out, trim_spaces(line.substr(0, eq)), trim_spaces(line.substr(eq + 1)), why)) {
+            continue;
         }
+        error = path + ":" + std::to_string(number) + ": " + why;
+        return false;
     }
+    return true;
+}
 
-    socket_t server_fd = INVALID_SOCKET;
-    struct sockaddr_in server_address;
+// "MSG_RATE 0 -> 20, LOG_LEVEL debug -> info", or empty
+std::string tuning_changes(const Tuning& from, const Tuning& to) {
+    std::string out;
+    auto note = [&out](const char* name, const std::string& before, const std::string& after) {
+        if (before == after) return;
+        if (!out.empty()) out += ", ";
+        out += std::string(name) + " " + before + " -> " + after;
+    };
+    for (const TuningSetting& setting : TUNING_SETTINGS) {
+        note(setting.name, std::to_string(from.*setting.field), std::to_string(to.*setting.field));
+    }
+    note("OVERFLOW_POLICY", OVERFLOW_POLICY_NAMES[(int)from.overflow_policy], OVERFLOW_POLICY_NAMES[(int)to.overflow_policy]);
+    note("LOG_LEVEL", LOG_LEVEL_NAMES[(int)from.log_level], LOG_LEVEL_NAMES[(int)to.log_level]);
+    return out;
+}
 
-    // 2. Create Socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == INVALID_SOCKET) {
-        std::cerr << "Socket creation failed." << std::endl;
-        cleanup_sockets();
-        return EXIT_FAILURE;
+// Builds a snapshot from tuning_base and CONFIG_FILE and publishes it. On
+// failure nothing changes; either way message says what happened.
+bool tuning_reload(std::string& message) {
+    std::lock_guard<std::mutex> lock(tuning_mutex);
+    std::unique_ptr<Tuning> next(new Tuning(tuning_base));
+    if (!CONFIG_FILE.empty() && !tuning_read_file(CONFIG_FILE, *next, message)) {
+        message = "Configuration not reloaded: " + message;
+        return false;
     }
+    // A room's history replay must always fit in the joiner's queue
+    if ((int64_t)next->outbound_queue_bytes < 2 * (int64_t)HISTORY_BYTES) {
+        message = "Configuration not reloaded: OUTBOUND_QUEUE_BYTES must be at least twice HISTORY_BYTES (" +
+                  std::to_string(2 * (int64_t)HISTORY_BYTES) + ")";
+        return false;
+    }
+    const Tuning& previous = tuning();
+    next->version = previous.version + 1;
+    std::string changes = tuning_changes(previous, *next);
+    message = "Configuration version " + std::to_string(next->version) + " in force" +
+              (changes.empty() ? " (no changes)" : ": " + changes);
+    log_level.store((int)next->log_level, std::memory_order_relaxed);
+    tuning_current.store(next.get(), std::memory_order_release);
+    tuning_published.push_back(std::move(next));
+    return true;
+}
 
-    int opt = 1;
-    #ifdef _WIN32
-        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt)) == SOCKET_ERROR) {
-             // warning
+// ---------------------------------------------------------------------------
+// Metrics: counters and latency histograms kept per thread. Each thread owns
+// a padded block that only it writes, so recording is a relaxed load and
+// store on a cache line no other core touches; a scrape sums every block.
+// ---------------------------------------------------------------------------
+enum class Counter {
+    MessagesIn,        // Chat lines and commands from clients
+    MessagesOut,       // Messages fully written to a client socket
+    BytesIn,
+    BytesOut,
+    RateLimited,       // Inbound messages over MSG_RATE
+    DroppedNewest,     // Outbound messages refused on a full queue
+    DroppedOldest,     // Queued messages evicted for newer ones
+    SlowConsumers,     // Clients disconnected for overflowing
+    HandshakeTimeouts,
+    RelayOut,          // Room broadcasts queued for a peer node
+    RelayIn,           // Room broadcasts received from peer nodes
+    RelayDropped,      // Broadcasts not relayed: peer link backlog full
+    TlsHandshakes,     // Completed TLS handshakes
+    TlsResumed,        // Of those, resumed from a session ticket
+    TlsKernel,         // Of those, with record encryption handed to the kernel
+    JournalRecords,    // Lines written to the journal
+    JournalDropped,    // Lines not journaled: writer behind or failed
+    DeflateIn,         // Frame bytes compressed for DEFLATE frames
+    DeflateOut,        // The DEFLATE frames they became
+    PrivateMessages,   // /msg lines queued to a recipient, one per recipient
+    HeartbeatTimeouts, // Clients dropped for not answering a PING
+    WriteStalls,       // Clients dropped for taking no output for WRITE_STALL_TIMEOUT_MS
+    PresenceChanges,   // Joins and leaves recorded in room rosters
+    PresenceUpdates,   // Roster updates sent, each batching a window's changes
+    RingSubmits,       // io_uring_enter calls that submitted requests
+    RingRequests,      // Requests they submitted
+    Count
+};
+
+enum class Histogram {
+    Broadcast,     // Time spent in broadcast_message for a chat line
+    Delivery,      // Receive until the last recipient's copy is sent
+    ClientsLock,   // Client table shard lock hold time
+    Count
+};
+
+const int METRIC_BUCKETS = 24; // Upper bounds 1us, 2us, ... 2^23us (~8.4s), then +Inf
+
+inline int64_t monotonic_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct ThreadMetrics {
+    struct Histo {
+        std::atomic<uint64_t> buckets[METRIC_BUCKETS + 1];
+        std::atomic<uint64_t> sum_ns;
+        std::atomic<uint64_t> count;
+    };
+
+    ThreadMetrics() {
+        for (auto& c : counters) c.store(0, std::memory_order_relaxed);
+        for (auto& h : histograms) {
+            for (auto& b : h.buckets) b.store(0, std::memory_order_relaxed);
+            h.sum_ns.store(0, std::memory_order_relaxed);
+            h.count.store(0, std::memory_order_relaxed);
         }
-    #else
-        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-            // warning
+    }
+
+    // Owning thread only: no read-modify-write needed with a single writer
+    void add(Counter c, uint64_t n = 1) { bump(counters[(int)c], n); }
+
+    void observe(Histogram which, int64_t ns) {
+        if (ns < 0) ns = 0;
+        Histo& h = histograms[(int)which];
+        int bucket = 0;
+        uint64_t bound = 1000;
+        while (bucket < METRIC_BUCKETS && (uint64_t)ns > bound) {
+            bound <<= 1;
+            ++bucket;
         }
-    #endif
+        bump(h.buckets[bucket], 1);
+        bump(h.sum_ns, (uint64_t)ns);
+        bump(h.count, 1);
+    }
+
+    static void bump(std::atomic<uint64_t>& a, uint64_t n) {
+        a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
 
-    // 3. Bind
-    memset(&server_address, 0, sizeof(server_address));
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = INADDR_ANY;
-    server_address.sin_port = htons(PORT);
+    // Padded rather than alignas: C++11 operator new ignores over-alignment
+    char pad0_[CACHE_LINE_SIZE];
+    std::atomic<uint64_t> counters[(int)Counter::Count];
+    Histo histograms[(int)Histogram::Count];
+    char pad1_[CACHE_LINE_SIZE];
+};
 
-    if (bind(server_fd, (struct sockaddr*)&server_address, sizeof(server_address)) == SOCKET_ERROR) {
-        std::cerr << "Bind failed." << std::endl;
-        close_socket(server_fd);
-        cleanup_sockets();
-        return EXIT_FAILURE;
+class Metrics {
+public:
+    static Metrics& instance() {
+        // Never destroyed, like the logger: blocks outlive their threads
+        static Metrics* metrics = new Metrics();
+        return *metrics;
     }
 
-    // 4. Listen
-    if (listen(server_fd, MAX_CLIENTS) == SOCKET_ERROR) {
-        std::cerr << "Listen failed." << std::endl;
-        close_socket(server_fd);
-        cleanup_sockets();
-        return EXIT_FAILURE;
+    ThreadMetrics& for_this_thread() {
+        thread_local ThreadMetrics* block = nullptr;
+        if (block == nullptr) {
+            block = new ThreadMetrics();
+            std::lock_guard<std::mutex> lock(mutex_);
+            blocks_.push_back(block);
+        }
+        return *block;
     }
 
-    log_event("Server started on port " + std::to_string(PORT));
+    uint64_t counter(Counter c) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t total = 0;
+        for (const ThreadMetrics* b : blocks_) total += b->counters[(int)c].load(std::memory_order_relaxed);
+        return total;
+    }
 
-    // 5. Accept Loop
-    while (true) {
-        struct sockaddr_in client_address;
-        socklen_t client_addr_len = sizeof(client_address);
-        socket_t client_socket = accept(server_fd, (struct sockaddr*)&client_address, &client_addr_len);
+    // Sums every thread's histogram into buckets (METRIC_BUCKETS + 1 entries)
+    void histogram(Histogram which, uint64_t* buckets, uint64_t& sum_ns, uint64_t& count) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (int i = 0; i <= METRIC_BUCKETS; ++i) buckets[i] = 0;
+        sum_ns = count = 0;
+        for (const ThreadMetrics* b : blocks_) {
+            const ThreadMetrics::Histo& h = b->histograms[(int)which];
+            for (int i = 0; i <= METRIC_BUCKETS; ++i) buckets[i] += h.buckets[i].load(std::memory_order_relaxed);
+            sum_ns += h.sum_ns.load(std::memory_order_relaxed);
+            count += h.count.load(std::memory_order_relaxed);
+        }
+    }
 
-        if (client_socket == INVALID_SOCKET) {
-            continue; 
+private:
+    Metrics() {}
+
+    mutable std::mutex mutex_;
+    std::vector<ThreadMetrics*> blocks_;
+};
+
+inline ThreadMetrics& metrics() {
+    return Metrics::instance().for_this_thread();
+}
+
+// ---------------------------------------------------------------------------
+// Poller: readiness notification over epoll (Linux), kqueue (BSD/macOS) or an
+// I/O completion port (Windows). Sockets are registered with an opaque token
+// that is handed back in PollEvent; a null token means wakeup() was called.
+// ---------------------------------------------------------------------------
+struct PollEvent {
+    void* token;
+    bool readable;
+    bool writable;
+};
+
+class Poller {
+public:
+    Poller();
+    ~Poller();
+    Poller(const Poller&) = delete;
+    Poller& operator=(const Poller&) = delete;
+
+    bool add(socket_t fd, void* token);
+    void set_write_interest(socket_t fd, void* token, bool enabled);
+    void remove(socket_t fd);
+    int wait(PollEvent* events, int max_events, int timeout_ms);
+    void wakeup(); // Safe to call from any thread
+#if defined(CHAT_POLLER_EPOLL)
+    // Readable whenever wait() has events; the io_uring engine polls it
+    int fd() const { return epoll_fd_; }
+#endif
+
+private:
+#if defined(CHAT_POLLER_EPOLL)
+    int epoll_fd_;
+    int wake_fd_;
+    std::vector<epoll_event> raw_;
+#elif defined(CHAT_POLLER_KQUEUE)
+    int kq_;
+    std::vector<struct kevent> raw_;
+#elif defined(CHAT_POLLER_IOCP)
+    // IOCP reports completions rather than readiness. Read readiness is
+    // emulated with a zero-byte overlapped WSARecv per socket, which completes
+    // as soon as data (or EOF) is pending; write readiness is reported on the
+    // next short wait after a send hit WSAEWOULDBLOCK.
+    struct Registration {
+        OVERLAPPED read_ov;
+        socket_t fd;
+        void* token;
+        bool read_pending;
+        bool closed;
+    };
+    void post_read(Registration* reg);
+    HANDLE iocp_;
+    std::map<socket_t, Registration*> regs_;
+    std::set<Registration*> write_waiters_;
+    std::vector<OVERLAPPED_ENTRY> raw_;
+#endif
+};
+
+#if defined(CHAT_POLLER_EPOLL)
+
+Poller::Poller() : raw_(MAX_POLL_EVENTS) {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+}
+
+Poller::~Poller() {
+    close(wake_fd_);
+    close(epoll_fd_);
+}
+
+bool Poller::add(socket_t fd, void* token) {
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = token;
+    return epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+void Poller::set_write_interest(socket_t fd, void* token, bool enabled) {
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | (enabled ? EPOLLOUT : 0);
+    ev.data.ptr = token;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void Poller::remove(socket_t fd) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+int Poller::wait(PollEvent* events, int max_events, int timeout_ms) {
+    int n = epoll_wait(epoll_fd_, raw_.data(), std::min(max_events, (int)raw_.size()), timeout_ms);
+    if (n < 0) return 0; // EINTR
+    for (int i = 0; i < n; ++i) {
+        uint32_t e = raw_[i].events;
+        events[i].token = raw_[i].data.ptr;
+        if (events[i].token == nullptr) {
+            uint64_t drained;
+            ssize_t r = read(wake_fd_, &drained, sizeof(drained));
+            (void)r;
         }
-        
-        // Check capacity
-        bool accepted = false;
-        {
-            std::lock_guard<std::mutex> lock(clients_mutex);
-            if (clients.size() < MAX_CLIENTS) {
-                accepted = true;
-                // Temporarily add with placeholder until thread updates it
-                clients[client_socket] = "Connecting..."; 
+        events[i].readable = (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0;
+        events[i].writable = (e & (EPOLLOUT | EPOLLERR)) != 0;
+    }
+    return n;
+}
+
+void Poller::wakeup() {
+    uint64_t one = 1;
+    ssize_t r = write(wake_fd_, &one, sizeof(one));
+    (void)r;
+}
+
+#elif defined(CHAT_POLLER_KQUEUE)
+
+Poller::Poller() : raw_(MAX_POLL_EVENTS) {
+    kq_ = kqueue();
+    struct kevent ev;
+    EV_SET(&ev, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+    kevent(kq_, &ev, 1, nullptr, 0, nullptr);
+}
+
+Poller::~Poller() {
+    close(kq_);
+}
+
+bool Poller::add(socket_t fd, void* token) {
+    struct kevent ev[2];
+    EV_SET(&ev[0], fd, EVFILT_READ, EV_ADD, 0, 0, token);
+    EV_SET(&ev[1], fd, EVFILT_WRITE, EV_ADD | EV_DISABLE, 0, 0, token);
+    return kevent(kq_, ev, 2, nullptr, 0, nullptr) == 0;
+}
+
+void Poller::set_write_interest(socket_t fd, void* token, bool enabled) {
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_WRITE, enabled ? EV_ENABLE : EV_DISABLE, 0, 0, token);
+    kevent(kq_, &ev, 1, nullptr, 0, nullptr);
+}
+
+void Poller::remove(socket_t fd) {
+    struct kevent ev[2];
+    EV_SET(&ev[0], fd, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+    EV_SET(&ev[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, nullptr);
+    kevent(kq_, ev, 2, nullptr, 0, nullptr);
+}
+
+int Poller::wait(PollEvent* events, int max_events, int timeout_ms) {
+    struct timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    int n = kevent(kq_, nullptr, 0, raw_.data(), std::min(max_events, (int)raw_.size()),
+                   timeout_ms >= 0 ? &ts : nullptr);
+    if (n < 0) return 0; // EINTR
+    for (int i = 0; i < n; ++i) {
+        const struct kevent& e = raw_[i];
+        if (e.filter == EVFILT_USER) {
+            events[i].token = nullptr;
+            events[i].readable = false;
+            events[i].writable = false;
+            continue;
+        }
+        events[i].token = (void*)e.udata;
+        events[i].readable = e.filter == EVFILT_READ;
+        events[i].writable = e.filter == EVFILT_WRITE;
+    }
+    return n;
+}
+
+void Poller::wakeup() {
+    struct kevent ev;
+    EV_SET(&ev, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, nullptr);
+    kevent(kq_, &ev, 1, nullptr, 0, nullptr);
+}
+
+#elif defined(CHAT_POLLER_IOCP)
+
+Poller::Poller() : raw_(MAX_POLL_EVENTS) {
+    iocp_ = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+}
+
+Poller::~Poller() {
+    for (auto& pair : regs_) delete pair.second;
+    CloseHandle(iocp_);
+}
+
+void Poller::post_read(Registration* reg) {
+    memset(&reg->read_ov, 0, sizeof(reg->read_ov));
+    WSABUF buf;
+    buf.len = 0;
+    buf.buf = nullptr;
+    DWORD flags = 0;
+    reg->read_pending = true;
+    if (WSARecv(reg->fd, &buf, 1, nullptr, &flags, &reg->read_ov, nullptr) == SOCKET_ERROR &&
+        WSAGetLastError() != WSA_IO_PENDING) {
+        // Surface the failure as readiness so the owner's recv() observes it
+        PostQueuedCompletionStatus(iocp_, 0, (ULONG_PTR)reg, &reg->read_ov);
+    }
+}
+
+bool Poller::add(socket_t fd, void* token) {
+    Registration* reg = new Registration();
+    reg->fd = fd;
+    reg->token = token;
+    reg->read_pending = false;
+    reg->closed = false;
+    if (CreateIoCompletionPort((HANDLE)fd, iocp_, (ULONG_PTR)reg, 0) == NULL) {
+        delete reg;
+        return false;
+    }
+    regs_[fd] = reg;
+    post_read(reg);
+    return true;
+}
+
+void Poller::set_write_interest(socket_t fd, void*, bool enabled) {
+    auto it = regs_.find(fd);
+    if (it == regs_.end()) return;
+    if (enabled) write_waiters_.insert(it->second);
+    else write_waiters_.erase(it->second);
+}
+
+void Poller::remove(socket_t fd) {
+    auto it = regs_.find(fd);
+    if (it == regs_.end()) return;
+    Registration* reg = it->second;
+    regs_.erase(it);
+    write_waiters_.erase(reg);
+    if (reg->read_pending) {
+        // The aborted completion still references read_ov; free it there
+        reg->closed = true;
+        CancelIoEx((HANDLE)fd, &reg->read_ov);
+    } else {
+        delete reg;
+    }
+}
+
+int Poller::wait(PollEvent* events, int max_events, int timeout_ms) {
+    if (!write_waiters_.empty() && (timeout_ms < 0 || timeout_ms > 5)) timeout_ms = 5;
+    ULONG n = 0;
+    int limit = std::min(max_events, (int)raw_.size());
+    int count = 0;
+    if (GetQueuedCompletionStatusEx(iocp_, raw_.data(), (ULONG)limit, &n,
+                                    timeout_ms < 0 ? INFINITE : (DWORD)timeout_ms, FALSE)) {
+        for (ULONG i = 0; i < n; ++i) {
+            if (raw_[i].lpCompletionKey == 0) {
+                events[count].token = nullptr;
+                events[count].readable = false;
+                events[count].writable = false;
+                ++count;
+                continue;
+            }
+            Registration* reg = (Registration*)raw_[i].lpCompletionKey;
+            reg->read_pending = false;
+            if (reg->closed) {
+                delete reg;
+                continue;
             }
+            events[count].token = reg->token;
+            events[count].readable = true;
+            events[count].writable = false;
+            ++count;
+            post_read(reg);
         }
+    }
+    for (Registration* reg : write_waiters_) {
+        if (count >= max_events) break;
+        events[count].token = reg->token;
+        events[count].readable = false;
+        events[count].writable = true;
+        ++count;
+    }
+    return count;
+}
 
-        if (accepted) {
-            std::thread(handle_client, client_socket).detach();
-        } else {
-             const char* msg = "Server full.\n";
-             send(client_socket, msg, strlen(msg), 0);
-             close_socket(client_socket);
+void Poller::wakeup() {
+    PostQueuedCompletionStatus(iocp_, 0, 0, nullptr);
+}
+
+#endif
+
+// ---------------------------------------------------------------------------
+// io_uring engine (IO_ENGINE=uring, Linux 6.1+). Each reactor owns one ring,
+// set up on its own thread (SINGLE_ISSUER, DEFER_TASKRUN: completions are
+// only processed when the reactor asks for them). A reuseport listener gets
+// one multishot accept, and each plaintext session one multishot recv that
+// fills buffers from a provided-buffer ring. Sends are queued as SENDMSG
+// requests while the reactor works through an iteration and all go to the
+// kernel in the one io_uring_enter that also waits for the next completions,
+// so a broadcast to thousands of members costs one system call rather than
+// one writev each. The Poller's epoll set is polled as one more file, which
+// carries wakeups and the sessions that still use readiness (TLS).
+//
+// The syscalls are used directly; liburing is not needed.
+// ---------------------------------------------------------------------------
+#if defined(CHAT_URING)
+
+const unsigned URING_ENTRIES = 4096;  // Submission queue slots; the completion queue has 8x
+const unsigned URING_BUFFERS = 256;   // Receive buffers of BUFFER_SIZE, shared by a reactor's sessions
+const size_t URING_IOVECS = 16384;    // Scatter-gather entries queued sends may use before a submit
+
+class Ring {
+public:
+    Ring() {}
+    ~Ring();
+    Ring(const Ring&) = delete;
+    Ring& operator=(const Ring&) = delete;
+
+    // Sets the ring up for the calling thread, the only one that may use it
+    bool start(std::string& error);
+
+    // Request builders; user_data comes back in the request's completions
+    bool accept(socket_t fd, uint64_t user_data); // Multishot, new sockets non-blocking
+    bool recv(socket_t fd, uint64_t user_data);   // Multishot, into provided buffers
+    bool poll(int fd, uint64_t user_data);        // One-shot POLLIN
+    // The bytes slices point at must stay valid until the completion; the
+    // slices themselves are copied at submit
+    bool send(socket_t fd, const io_slice* slices, int count, uint64_t user_data);
+
+    // Hands every queued request to the kernel, then waits up to timeout_ms
+    // (-1 = no limit) for at least one completion
+    void submit_and_wait(int timeout_ms);
+    void submit();
+
+    // Calls on_completion(cqe) for each completion, including ones posted
+    // by submits it makes
+    template <typename OnCompletion>
+    void reap(OnCompletion&& on_completion) {
+        unsigned head = *cq_head_;
+        while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe cqe = cqes_[head & cq_mask_];
+            __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+            on_completion(cqe);
         }
     }
 
-    if (server_fd != INVALID_SOCKET) close_socket(server_fd);
+    // The provided buffer a recv completion filled, and its return to the
+    // kernel once the data has been handled
+    const char* buffer(const io_uring_cqe& cqe) const {
+        return buffers_.data() + (size_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT) * BUFFER_SIZE;
+    }
+    void recycle(const io_uring_cqe& cqe);
+
+private:
+    io_uring_sqe* next_sqe(size_t iovecs);
+    void enter(unsigned min_complete, int timeout_ms);
+
+    int fd_ = -1;
+    void* rings_ = MAP_FAILED;
+    size_t rings_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned sq_pending_ = 0; // Our tail, published to the kernel at enter
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+
+    io_uring_buf_ring* buf_ring_ = nullptr;
+    unsigned short buf_tail_ = 0;
+    std::vector<char> buffers_;
+
+    // SENDMSG arguments for requests not yet submitted
+    std::vector<struct msghdr> msgs_;
+    std::vector<io_slice> iovecs_;
+    size_t msgs_used_ = 0;
+    size_t iovecs_used_ = 0;
+};
+
+Ring::~Ring() {
+    if (buf_ring_) munmap(buf_ring_, URING_BUFFERS * sizeof(io_uring_buf));
+    if (sqes_) munmap(sqes_, sqes_size_);
+    if (rings_ != MAP_FAILED) munmap(rings_, rings_size_);
+    if (fd_ >= 0) close(fd_);
+}
+
+bool Ring::start(std::string& error) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER |
+                   IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = URING_ENTRIES * 8;
+    fd_ = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd_ < 0) {
+        error = std::string("io_uring_setup: ") + strerror(errno);
+        return false;
+    }
+    const unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_SUBMIT_STABLE |
+                            IORING_FEAT_EXT_ARG;
+    if ((params.features & needed) != needed) {
+        error = "kernel lacks required io_uring features";
+        return false;
+    }
+
+    rings_size_ = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                           params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    rings_ = mmap(nullptr, rings_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (rings_ == MAP_FAILED || sqes == MAP_FAILED) {
+        if (sqes != MAP_FAILED) munmap(sqes, sqes_size_);
+        error = std::string("mmap: ") + strerror(errno);
+        return false;
+    }
+    sqes_ = (io_uring_sqe*)sqes;
+    char* base = (char*)rings_;
+    sq_head_ = (unsigned*)(base + params.sq_off.head);
+    sq_tail_ = (unsigned*)(base + params.sq_off.tail);
+    sq_mask_ = *(unsigned*)(base + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    sq_pending_ = *sq_tail_;
+    unsigned* sq_array = (unsigned*)(base + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries_; ++i) sq_array[i] = i; // Slot i is always SQE i
+    cq_head_ = (unsigned*)(base + params.cq_off.head);
+    cq_tail_ = (unsigned*)(base + params.cq_off.tail);
+    cq_mask_ = *(unsigned*)(base + params.cq_off.ring_mask);
+    cqes_ = (io_uring_cqe*)(base + params.cq_off.cqes);
+
+    void* buf_ring = mmap(nullptr, URING_BUFFERS * sizeof(io_uring_buf), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf_ring == MAP_FAILED) {
+        error = std::string("mmap: ") + strerror(errno);
+        return false;
+    }
+    buf_ring_ = (io_uring_buf_ring*)buf_ring;
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring_;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        error = std::string("IORING_REGISTER_PBUF_RING: ") + strerror(errno);
+        return false;
+    }
+    buffers_.resize((size_t)URING_BUFFERS * BUFFER_SIZE);
+    for (unsigned id = 0; id < URING_BUFFERS; ++id) {
+        io_uring_cqe cqe;
+        cqe.flags = id << IORING_CQE_BUFFER_SHIFT;
+        recycle(cqe);
+    }
+
+    msgs_.resize(sq_entries_);
+    iovecs_.resize(URING_IOVECS);
+    return true;
+}
+
+void Ring::recycle(const io_uring_cqe& cqe) {
+    unsigned id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    // Not buf_ring_->bufs: in C++ the header's flex-array wrapper has a
+    // one-byte empty struct in front, which moves it to offset 8
+    io_uring_buf& buf = reinterpret_cast<io_uring_buf*>(buf_ring_)[buf_tail_ & (URING_BUFFERS - 1)];
+    buf.addr = (uint64_t)(uintptr_t)(buffers_.data() + (size_t)id * BUFFER_SIZE);
+    buf.len = BUFFER_SIZE;
+    buf.bid = (unsigned short)id;
+    __atomic_store_n(&buf_ring_->tail, ++buf_tail_, __ATOMIC_RELEASE);
+}
+
+// A cleared SQE with room for iovecs more send slices, submitting what is
+// queued first if either runs out; null if the kernel took none of it
+io_uring_sqe* Ring::next_sqe(size_t iovecs) {
+    bool full = sq_pending_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_ ||
+                (iovecs > 0 && (msgs_used_ == msgs_.size() || iovecs_used_ + iovecs > iovecs_.size()));
+    if (full) {
+        submit();
+        if (sq_pending_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_ ||
+            (iovecs > 0 && msgs_used_ > 0)) {
+            return nullptr;
+        }
+    }
+    io_uring_sqe* sqe = &sqes_[sq_pending_ & sq_mask_];
+    ++sq_pending_;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+bool Ring::accept(socket_t fd, uint64_t user_data) {
+    io_uring_sqe* sqe = next_sqe(0);
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool Ring::recv(socket_t fd, uint64_t user_data) {
+    io_uring_sqe* sqe = next_sqe(0);
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool Ring::poll(int fd, uint64_t user_data) {
+    io_uring_sqe* sqe = next_sqe(0);
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool Ring::send(socket_t fd, const io_slice* slices, int count, uint64_t user_data) {
+    io_uring_sqe* sqe = next_sqe((size_t)count);
+    if (!sqe) return false;
+    io_slice* iov = &iovecs_[iovecs_used_];
+    std::copy(slices, slices + count, iov);
+    iovecs_used_ += (size_t)count;
+    struct msghdr& msg = msgs_[msgs_used_++];
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t)count;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)&msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+    return true;
+}
+
+void Ring::enter(unsigned min_complete, int timeout_ms) {
+    unsigned to_submit = sq_pending_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    __atomic_store_n(sq_tail_, sq_pending_, __ATOMIC_RELEASE);
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    struct __kernel_timespec ts;
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    unsigned flags = IORING_ENTER_EXT_ARG | (min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+    long submitted = syscall(__NR_io_uring_enter, fd_, to_submit, min_complete, flags, &arg, sizeof(arg));
+    if (submitted > 0) {
+        ThreadMetrics& m = metrics();
+        m.add(Counter::RingSubmits);
+        m.add(Counter::RingRequests, (uint64_t)submitted);
+    }
+    // SUBMIT_STABLE: the kernel has copied what it consumed, so SENDMSG
+    // arguments can be reused once nothing is left queued. Errors (EINTR,
+    // ETIME on timeout, EBUSY while completions back up) leave the rest for
+    // the next call.
+    if (__atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_pending_) {
+        msgs_used_ = 0;
+        iovecs_used_ = 0;
+    }
+}
+
+void Ring::submit_and_wait(int timeout_ms) {
+    enter(1, timeout_ms);
+}
+
+void Ring::submit() {
+    if (sq_pending_ != __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE)) enter(0, -1);
+}
+
+// Completion tags: a Session pointer with the request kind in its low bits,
+// or one of the reactor's own requests
+const uint64_t RING_RECV = 1;
+const uint64_t RING_SEND = 2;
+const uint64_t RING_KIND_MASK = 3;
+const uint64_t RING_POLLER = 1; // With a null pointer: the epoll set is readable
+const uint64_t RING_ACCEPT = 2; // With a null pointer: the multishot accept
+const int RING_REARM_RETRY_MS = 10; // Longest wait while the epoll set has no POLL_ADD queued
+
+#endif
+
+// ---------------------------------------------------------------------------
+// Lock-free building blocks for cross-thread fan-out
+// ---------------------------------------------------------------------------
+
+// Bounded multi-producer queue (Vyukov). Any thread may push; used with a
+// single consumer per instance, but pop() is safe from several threads too.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        cells_.reset(new Cell[size]);
+        mask_ = size - 1;
+        for (size_t i = 0; i < size; ++i) cells_[i].seq.store(i, std::memory_order_relaxed);
+        head_.store(0, std::memory_order_relaxed);
+        tail_.store(0, std::memory_order_relaxed);
+    }
+
+    bool push(T value) {
+        Cell* cell;
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false; // Full
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(value);
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& out) {
+        Cell* cell;
+        size_t pos = head_.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false; // Empty
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+        out = std::move(cell->value);
+        cell->value = T();
+        cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t capacity() const { return mask_ + 1; }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T value;
+    };
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_;
+    // Padded rather than alignas: C++11 operator new ignores over-alignment
+    char pad0_[CACHE_LINE_SIZE];
+    std::atomic<size_t> head_;
+    char pad1_[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail_;
+    char pad2_[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+};
+
+// Intrusive unbounded multi-producer/single-consumer list (Vyukov). Nodes
+// are embedded in the objects being queued, so pushing never allocates.
+struct MpscNode {
+    std::atomic<MpscNode*> mpsc_next;
+    MpscNode() : mpsc_next(nullptr) {}
+};
+
+class MpscList {
+public:
+    MpscList() : tail_(&stub_), head_(&stub_) {}
+
+    void push(MpscNode* node) {
+        node->mpsc_next.store(nullptr, std::memory_order_relaxed);
+        MpscNode* prev = tail_.exchange(node, std::memory_order_acq_rel);
+        prev->mpsc_next.store(node, std::memory_order_release);
+    }
+
+    // Appends first..last, already linked through mpsc_next, with one
+    // exchange; the consumer sees them in order
+    void push_chain(MpscNode* first, MpscNode* last) {
+        last->mpsc_next.store(nullptr, std::memory_order_relaxed);
+        MpscNode* prev = tail_.exchange(last, std::memory_order_acq_rel);
+        prev->mpsc_next.store(first, std::memory_order_release);
+    }
+
+    // Returns nullptr when empty or when a producer is halfway through push();
+    // that producer's wakeup comes after its push, so nothing is lost.
+    MpscNode* pop() {
+        MpscNode* head = head_;
+        MpscNode* next = head->mpsc_next.load(std::memory_order_acquire);
+        if (head == &stub_) {
+            if (next == nullptr) return nullptr;
+            head_ = next;
+            head = next;
+            next = next->mpsc_next.load(std::memory_order_acquire);
+        }
+        if (next != nullptr) {
+            head_ = next;
+            return head;
+        }
+        if (head != tail_.load(std::memory_order_acquire)) return nullptr;
+        push(&stub_);
+        next = head->mpsc_next.load(std::memory_order_acquire);
+        if (next != nullptr) {
+            head_ = next;
+            return head;
+        }
+        return nullptr;
+    }
+
+private:
+    std::atomic<MpscNode*> tail_;
+    MpscNode* head_;
+    MpscNode stub_;
+};
+
+// Fixed-capacity FIFO that never allocates after construction
+template <typename T, size_t N>
+class FixedRing {
+public:
+    FixedRing() : head_(0), count_(0) {}
+
+    size_t size() const { return count_; }
+    bool empty() const { return count_ == 0; }
+    T& front() { return items_[head_]; }
+    const T& operator[](size_t i) const { return items_[(head_ + i) % N]; }
+
+    void push_back(T value) {
+        items_[(head_ + count_) % N] = std::move(value);
+        ++count_;
+    }
+    void pop_front() {
+        items_[head_] = T();
+        head_ = (head_ + 1) % N;
+        --count_;
+    }
+    void clear() {
+        while (count_ > 0) pop_front();
+    }
+
+private:
+    T items_[N];
+    size_t head_;
+    size_t count_;
+};
+
+// ---------------------------------------------------------------------------
+// Slab caches: per-thread free lists of fixed-size blocks for the objects each
+// chat line creates (its Message and fan-out jobs). Every block remembers the
+// cache it came from. Freeing on the owning thread is a plain list push;
+// freeing elsewhere (a recipient's reactor dropping the last reference) hands
+// the block back through the owner's lock-free return list. Blocks therefore
+// cycle back to the thread that allocates them, and steady-state chatting
+// never reaches malloc. Each cache is capped and sends the overflow back to
+// the heap.
+// ---------------------------------------------------------------------------
+const size_t SLAB_CLASSES[] = {128, 512, 2048, 8192, MAX_FRAME_SIZE + 256};
+const int SLAB_CLASS_COUNT = sizeof(SLAB_CLASSES) / sizeof(SLAB_CLASSES[0]);
+const size_t SLAB_CACHE_BYTES = 1024 * 1024; // Per size class per thread
+
+class SlabCache {
+public:
+    SlabCache() {
+        for (int i = 0; i < SLAB_CLASS_COUNT; ++i) {
+            free_[i] = nullptr;
+            count_[i] = 0;
+            returned_[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+    SlabCache(const SlabCache&) = delete;
+    SlabCache& operator=(const SlabCache&) = delete;
+
+    static SlabCache& for_this_thread() {
+        // Never destroyed: blocks from this cache may be freed after the
+        // thread is gone
+        thread_local SlabCache* cache = new SlabCache();
+        return *cache;
+    }
+
+    void* alloc(size_t bytes) {
+        int c = class_for(bytes);
+        Header* header;
+        if (c < 0) {
+            header = static_cast<Header*>(::operator new(sizeof(Header) + bytes));
+        } else {
+            if (free_[c] == nullptr) reclaim(c);
+            if (FreeBlock* block = free_[c]) {
+                free_[c] = block->next;
+                --count_[c];
+                header = reinterpret_cast<Header*>(block);
+            } else {
+                header = static_cast<Header*>(::operator new(sizeof(Header) + SLAB_CLASSES[c]));
+            }
+        }
+        header->owner = this;
+        header->size_class = c;
+        return header + 1;
+    }
+
+    // Any thread
+    static void free(void* p) {
+        Header* header = static_cast<Header*>(p) - 1;
+        int c = header->size_class;
+        if (c < 0) {
+            ::operator delete(header);
+            return;
+        }
+        SlabCache* owner = header->owner;
+        FreeBlock* block = reinterpret_cast<FreeBlock*>(header);
+        if (owner == &for_this_thread()) {
+            owner->release_local(c, block);
+            return;
+        }
+        // Treiber push; only the owner ever takes from the list, and it takes
+        // everything at once, so there is no ABA to worry about
+        FreeBlock* head = owner->returned_[c].load(std::memory_order_relaxed);
+        do {
+            block->next = head;
+        } while (!owner->returned_[c].compare_exchange_weak(head, block, std::memory_order_release,
+                                                            std::memory_order_relaxed));
+    }
+
+private:
+    struct Header {
+        SlabCache* owner;
+        int size_class; // -1 for blocks too big for any class
+        int pad_;       // Keeps the payload 16-byte aligned
+    };
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    static int class_for(size_t bytes) {
+        for (int i = 0; i < SLAB_CLASS_COUNT; ++i) {
+            if (bytes <= SLAB_CLASSES[i]) return i;
+        }
+        return -1;
+    }
+
+    void release_local(int c, FreeBlock* block) {
+        if (count_[c] * SLAB_CLASSES[c] >= SLAB_CACHE_BYTES) {
+            ::operator delete(block);
+            return;
+        }
+        block->next = free_[c];
+        free_[c] = block;
+        ++count_[c];
+    }
+
+    // Moves blocks other threads handed back onto the local list
+    void reclaim(int c) {
+        FreeBlock* block = returned_[c].exchange(nullptr, std::memory_order_acquire);
+        while (block != nullptr) {
+            FreeBlock* next = block->next;
+            release_local(c, block);
+            block = next;
+        }
+    }
+
+    FreeBlock* free_[SLAB_CLASS_COUNT];
+    size_t count_[SLAB_CLASS_COUNT];
+    // Padded rather than alignas: C++11 operator new ignores over-alignment
+    char pad_[CACHE_LINE_SIZE];
+    std::atomic<FreeBlock*> returned_[SLAB_CLASS_COUNT];
+};
+
+inline void* slab_alloc(size_t bytes) { return SlabCache::for_this_thread().alloc(bytes); }
+inline void slab_free(void* p) { SlabCache::free(p); }
+
+// ---------------------------------------------------------------------------
+// Messages: immutable, reference-counted outbound buffers. A broadcast builds
+// one Message and every recipient's queue holds a pointer to it. The payload
+// is kept as a few segments ("[", name, "]: ", body) that are written with
+// scatter-gather sends, so the pieces are never glued together; the frame
+// header (framed clients) or trailing newline (text clients) is added as one
+// more segment at send time. The body lives in the same slab block as the
+// Message, so a chat line costs one allocation from the thread's cache.
+// ---------------------------------------------------------------------------
+using SharedName = std::shared_ptr<const std::string>;
+
+const size_t MAX_ROOM_NAME = 32;
+const size_t MAX_USERNAME = 64; // Bytes; longer names are cut at LOGIN
+// Longest line a Message carries, so that every frame it goes out in
+// decodes. ROOM_LINE adds a type byte and an 8-byte sequence number.
+// RELAY adds more: a type byte, the 2-byte room name length and the name.
+const size_t MAX_LINE_SIZE = MAX_FRAME_SIZE - 1 - (2 + MAX_ROOM_NAME);
+
+// Framed is protocol version 1; Sequenced is version 2, where chat lines
+// carry their sequence number (ROOM_LINE frames). Deflated is version 2 with
+// compression agreed: lines that shrink go out as DEFLATE frames.
+enum class WireFormat { Text, Framed, Sequenced, Deflated };
+
+inline bool is_sequenced(WireFormat fmt) { return fmt == WireFormat::Sequenced || fmt == WireFormat::Deflated; }
+
+class MessageRef;
+
+class Message {
+public:
+    static const int MAX_SEGMENTS = 4;
+    static const int MAX_WIRE_SEGMENTS = MAX_SEGMENTS + 1;
+    struct Segment {
+        const char* data;
+        size_t len;
+    };
+
+    // A server notice ("bob has joined the chat.") or any preformatted text
+    static MessageRef text(const std::string& text);
+    static MessageRef text(const char* data, size_t len, uint64_t seq = 0);
+    // A standalone copy of a chat line or notice, without its delivery
+    // clock (room history and the journal keep these, not the original)
+    static MessageRef copy_of(const Message& message);
+    // "[name]: body" without copying name into the message. received_ns
+    // (monotonic_ns) starts the delivery latency clock; seq is the line's
+    // next_line_seq() number.
+    static MessageRef chat(const SharedName& name, const char* body, size_t len, int64_t received_ns = 0,
+                           uint64_t seq = 0);
+    // Bytes sent exactly as given in either format (the protocol preamble)
+    static MessageRef raw(const std::string& bytes);
+
+    // Fills out (MAX_WIRE_SEGMENTS entries) with the bytes a client speaking
+    // fmt receives; returns the segment count
+    int wire_segments(WireFormat fmt, Segment* out) const;
+    size_t wire_size(WireFormat fmt) const;
+    // The displayed line alone, without framing or newline (cluster relay)
+    size_t text_size() const { return size_; }
+    bool is_chat() const { return name_ != nullptr; }
+    // Sequence number version 2 clients resume from; 0 for notices and
+    // lines read back from the journal
+    uint64_t seq() const { return seq_; }
+    // Sender (chat lines only) and the text after "[name]: ", or the whole
+    // line for anything else
+    const SharedName& name() const { return name_; }
+    const char* body() const { return body_; }
+    size_t body_size() const { return count_ > 0 ? segments_[count_ - 1].len : 0; }
+    void append_text(std::string& out) const {
+        for (int i = 0; i < count_; ++i) out.append(segments_[i].data, segments_[i].len);
+    }
+
+    void retain() const { refs_.fetch_add(1, std::memory_order_relaxed); }
+    void release() const {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) destroy(const_cast<Message*>(this));
+    }
+
+    // Called for each recipient queue it enters
+    void mark_queued() const {
+        if (!queued_.load(std::memory_order_relaxed)) queued_.store(true, std::memory_order_relaxed);
+    }
+
+private:
+    Message() : refs_(1), queued_(false), body_(nullptr), count_(0), size_(0), header_len_(0),
+                seq_header_len_(0), raw_(false), received_ns_(0), seq_(0), deflated_(nullptr) {}
+    // Allocates a Message with room for body_len bytes of body right after it
+    static Message* allocate(size_t body_len) {
+        Message* m = new (slab_alloc(sizeof(Message) + body_len)) Message();
+        m->body_ = reinterpret_cast<char*>(m + 1);
+        return m;
+    }
+    static Message* create(const char* body, size_t body_len) {
+        Message* m = allocate(body_len);
+        memcpy(const_cast<char*>(m->body_), body, body_len);
+        return m;
+    }
+    static void destroy(Message* m) {
+        m->~Message();
+        slab_free(m);
+    }
+    ~Message() {
+        // The last reference goes with the last recipient's send (or drop)
+        if (received_ns_ != 0 && queued_.load(std::memory_order_relaxed)) {
+            metrics().observe(Histogram::Delivery, monotonic_ns() - received_ns_);
+        }
+        std::string* frame = deflated_.load(std::memory_order_relaxed);
+        if (frame != not_deflated()) delete frame;
+    }
+    Message(const Message&) = delete;
+    Message& operator=(const Message&) = delete;
+
+    void add_segment(const char* data, size_t len) {
+        segments_[count_].data = data;
+        segments_[count_].len = len;
+        ++count_;
+        size_ += len;
+    }
+    void seal() {
+        // Callers keep lines within MAX_LINE_SIZE. One that slips through is
+        // cut short, not sent as a frame no client can decode.
+        if (size_ > MAX_LINE_SIZE) {
+            log_event(LogLevel::Warn, {"Line of ", std::to_string(size_), " bytes cut to ", std::to_string(MAX_LINE_SIZE)});
+            size_t excess = size_ - MAX_LINE_SIZE;
+            for (int i = count_ - 1; i >= 0 && excess > 0; --i) {
+                size_t cut = std::min(excess, segments_[i].len);
+                segments_[i].len -= cut;
+                excess -= cut;
+            }
+            size_ = MAX_LINE_SIZE;
+        }
+        header_len_ = encode_frame_header(FRAME_TEXT, size_, header_);
+        if (seq_ == 0) return;
+        seq_header_len_ = encode_frame_header(FRAME_ROOM_LINE, size_ + 8, seq_header_);
+        put_u64_be(seq_header_ + seq_header_len_, seq_);
+        seq_header_len_ += 8;
+    }
+
+    // The DEFLATE frame for this message, built by whichever recipient needs
+    // it first and shared by the rest; empty when compressing doesn't pay
+    const std::string& deflated() const;
+    std::string* deflate_frame() const;
+    static std::string* not_deflated() {
+        static std::string none;
+        return &none;
+    }
+
+    mutable std::atomic<int> refs_;
+    mutable std::atomic<bool> queued_;
+    SharedName name_;
+    const char* body_;
+    Segment segments_[MAX_SEGMENTS];
+    int count_;
+    size_t size_;
+    char header_[MAX_FRAME_HEADER_SIZE];
+    size_t header_len_;
+    char seq_header_[MAX_FRAME_HEADER_SIZE + 8]; // ROOM_LINE header and sequence number
+    size_t seq_header_len_;
+    bool raw_;
+    int64_t received_ns_;
+    uint64_t seq_;
+    mutable std::atomic<std::string*> deflated_; // nullptr until a Deflated recipient asks
+};
+
+// Intrusive smart pointer for Message; one atomic increment per recipient
+class MessageRef {
+public:
+    MessageRef() : ptr_(nullptr) {}
+    explicit MessageRef(const Message* adopt) : ptr_(adopt) {}
+    MessageRef(const MessageRef& other) : ptr_(other.ptr_) { if (ptr_) ptr_->retain(); }
+    MessageRef(MessageRef&& other) : ptr_(other.ptr_) { other.ptr_ = nullptr; }
+    ~MessageRef() { if (ptr_) ptr_->release(); }
+    MessageRef& operator=(MessageRef other) {
+        std::swap(ptr_, other.ptr_);
+        return *this;
+    }
+
+    const Message* get() const { return ptr_; }
+    const Message* operator->() const { return ptr_; }
+    const Message& operator*() const { return *ptr_; }
+    explicit operator bool() const { return ptr_ != nullptr; }
+
+private:
+    const Message* ptr_;
+};
+
+MessageRef Message::text(const std::string& text) {
+    return Message::text(text.data(), text.size());
+}
+
+MessageRef Message::text(const char* data, size_t len, uint64_t seq) {
+    Message* m = create(data, len);
+    m->seq_ = seq;
+    m->add_segment(m->body_, len);
+    m->seal();
+    return MessageRef(m);
+}
+
+MessageRef Message::copy_of(const Message& message) {
+    if (message.is_chat()) return Message::chat(message.name_, message.body(), message.body_size(), 0, message.seq_);
+    return Message::text(message.body(), message.body_size(), message.seq_);
+}
+
+MessageRef Message::raw(const std::string& bytes) {
+    Message* m = create(bytes.data(), bytes.size());
+    m->add_segment(m->body_, bytes.size());
+    m->raw_ = true;
+    return MessageRef(m);
+}
+
+MessageRef Message::chat(const SharedName& name, const char* body, size_t len, int64_t received_ns,
+                         uint64_t seq) {
+    static const char open[] = "[";
+    static const char close[] = "]: ";
+    Message* m = create(body, len);
+    m->received_ns_ = received_ns;
+    m->seq_ = seq;
+    m->name_ = name;
+    m->add_segment(open, sizeof(open) - 1);
+    m->add_segment(m->name_->data(), m->name_->size());
+    m->add_segment(close, sizeof(close) - 1);
+    m->add_segment(m->body_, len);
+    m->seal();
+    return MessageRef(m);
+}
+
+int Message::wire_segments(WireFormat fmt, Segment* out) const {
+    static const char newline[] = "\n";
+    int n = 0;
+    if (!raw_ && fmt == WireFormat::Deflated) {
+        const std::string& frame = deflated();
+        if (!frame.empty()) {
+            out[0].data = frame.data();
+            out[0].len = frame.size();
+            return 1;
+        }
+    }
+    if (!raw_ && fmt != WireFormat::Text) {
+        bool sequenced = is_sequenced(fmt) && seq_ != 0;
+        out[n].data = sequenced ? seq_header_ : header_;
+        out[n++].len = sequenced ? seq_header_len_ : header_len_;
+    }
+    for (int i = 0; i < count_; ++i) out[n++] = segments_[i];
+    if (!raw_ && fmt == WireFormat::Text) {
+        out[n].data = newline;
+        out[n++].len = 1;
+    }
+    return n;
+}
+
+size_t Message::wire_size(WireFormat fmt) const {
+    if (raw_) return size_;
+    if (fmt == WireFormat::Text) return size_ + 1;
+    if (fmt == WireFormat::Deflated) {
+        const std::string& frame = deflated();
+        if (!frame.empty()) return frame.size();
+    }
+    return size_ + (is_sequenced(fmt) && seq_ != 0 ? seq_header_len_ : header_len_);
+}
+
+const std::string& Message::deflated() const {
+    std::string* frame = deflated_.load(std::memory_order_acquire);
+    if (frame != nullptr) return *frame;
+    std::string* built = deflate_frame();
+    if (deflated_.compare_exchange_strong(frame, built, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        return *built;
+    }
+    if (built != not_deflated()) delete built; // Another recipient's thread got there first
+    return *frame;
+}
+
+#if defined(CHAT_HAVE_ZLIB)
+// One raw deflate stream per thread, reset for every message
+struct Deflater {
+    z_stream stream;
+    bool ready;
+    std::vector<char> out;
+
+    Deflater() {
+        memset(&stream, 0, sizeof(stream));
+        ready = deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+    ~Deflater() {
+        if (ready) deflateEnd(&stream);
+    }
+};
+#endif
+
+// The version 2 frame, compressed on its own with the preset dictionary so
+// any client can inflate it without having seen earlier frames
+std::string* Message::deflate_frame() const {
+#if defined(CHAT_HAVE_ZLIB)
+    size_t plain = wire_size(WireFormat::Sequenced);
+    if (plain < (size_t)tuning().compress_min_bytes) return not_deflated();
+    static thread_local Deflater deflater;
+    z_stream& z = deflater.stream;
+    if (!deflater.ready || deflateReset(&z) != Z_OK ||
+        deflateSetDictionary(&z, reinterpret_cast<const Bytef*>(DEFLATE_DICTIONARY),
+                             sizeof(DEFLATE_DICTIONARY) - 1) != Z_OK) {
+        return not_deflated();
+    }
+    deflater.out.resize(deflateBound(&z, (uLong)plain));
+    z.next_out = reinterpret_cast<Bytef*>(deflater.out.data());
+    z.avail_out = (uInt)deflater.out.size();
+
+    Segment segs[MAX_WIRE_SEGMENTS];
+    int n = wire_segments(WireFormat::Sequenced, segs);
+    for (int i = 0; i < n; ++i) {
+        if (segs[i].len == 0) continue;
+        z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(segs[i].data));
+        z.avail_in = (uInt)segs[i].len;
+        if (deflate(&z, Z_NO_FLUSH) != Z_OK) return not_deflated();
+    }
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END) return not_deflated();
+
+    std::string* frame = new std::string(encode_frame(FRAME_DEFLATE, deflater.out.data(), (size_t)z.total_out));
+    if (frame->size() >= plain) {
+        delete frame;
+        return not_deflated(); // Too short or too random to shrink
+    }
+    metrics().add(Counter::DeflateIn, plain);
+    metrics().add(Counter::DeflateOut, frame->size());
+    return frame;
+#else
+    return not_deflated();
+#endif
+}
+
+// ---------------------------------------------------------------------------
+// Sessions: one per connection, driven through a small state machine by the
+// reactor that owns the socket. Other threads only ever touch a session by
+// pushing onto its outbound queue and poking the owner through its mailbox.
+// ---------------------------------------------------------------------------
+class Reactor;
+struct Session;
+struct Room;
+
+enum class SessionState {
+    TlsHandshake,     // Before 0 when TLS_CERT is set
+    AwaitingHello,    // 0. Sniffing for the framed-protocol preamble
+    AwaitingUsername, // 1. Waiting for the handshake line or LOGIN frame
+    Chatting,         // 3. Registered, in the message loop
+    Closed            // 4. Disconnected, waiting for the last reference to drop
+};
+
+using SessionPtr = std::shared_ptr<Session>;
+
+// A session's entry on its owner's timer wheel
+struct SessionTimer : Timer {
+    Session* session = nullptr;
+};
+
+struct Session : MpscNode {
+    socket_t fd;
+    Reactor* owner;
+    SessionState state; // Owner only
+    std::string username;
+    SharedName shared_name; // Same bytes, referenced by every chat line we send
+    WireFormat format;      // Fixed once the preamble sniff is done
+    std::shared_ptr<Room> room; // Current room once Chatting (owner only)
+    uint32_t peer_addr;          // IPv4 address, network order, for admission
+
+    // Timeouts on the owner's wheel (owner only). idle_timer is the
+    // handshake timeout until login, heartbeats after; stall_timer runs
+    // while output is waiting on the socket. Reads and writes only note the
+    // time, and a timer that fires early sets itself for the rest.
+    SessionTimer idle_timer;
+    SessionTimer stall_timer;
+    uint64_t last_heard = 0;   // Wheel tick of the last read
+    uint64_t last_written = 0; // Wheel tick the socket last took output
+    uint64_t ping_sent = 0;    // Wheel tick of the unanswered PING, 0 = none
+    unsigned char version = 0; // Protocol version agreed, 0 for text clients
+
+    // Inbound stream decoding (owner only)
+    std::string preamble;
+    FrameDecoder frames;
+    LineDecoder lines;
+
+    // Producer side of the outbound stream (any thread)
+    BoundedQueue<MessageRef> outbox;
+    std::atomic<bool> flush_scheduled; // Queued in the owner's mailbox or local list
+    std::atomic<size_t> queued_bytes;  // Wire bytes sitting in outbox
+    std::atomic<uint64_t> dropped; // Messages discarded because outbox was full
+    std::atomic<bool> overflowed;  // Disconnect policy tripped; owner closes us
+    SessionPtr mailbox_ref;        // Keeps us alive while queued in a mailbox
+    std::string resume_token;      // Version 2 logins; empty once the client has sent /quit
+    // Entered room's roster is owed to us by its next update, the first at
+    // roster_from or later (owner only)
+    bool roster_wanted = false;
+    uint64_t roster_from = 0;
+    size_t member_slot = 0;        // Our slot in the room's shard (under rooms_mutex)
+    uint64_t joined_seq = 0;       // line_seq as we last entered a room (under rooms_mutex)
+    bool hangup;                   // Close once the current read is handled (owner only)
+
+    // Owner side: messages taken from outbox that the kernel hasn't accepted yet
+    FixedRing<MessageRef, OUTBOUND_BATCH> sending;
+    size_t sent_offset;
+    bool attached;
+    bool write_interest;
+    TcpPolicy tcp_policy;
+    bool flush_deferred; // Waiting in the owner's batching queue until flush_deadline
+    std::chrono::steady_clock::time_point flush_deadline;
+
+    // Inbound rate limit (owner only)
+    double msg_tokens;
+    std::chrono::steady_clock::time_point msg_refill;
+    uint64_t rate_limited; // Messages ignored for exceeding MSG_RATE
+    bool rate_warned;      // Told the client once per limited stretch
+
+#if defined(CHAT_TLS)
+    SSL* tls = nullptr;         // Null for plaintext connections (owner only)
+    bool tls_kernel_tx = false; // kTLS: the kernel encrypts what we write to fd
+    ~Session() {
+        if (tls) SSL_free(tls);
+    }
+#endif
+#if defined(CHAT_URING)
+    bool ring_io = false;      // Reads and writes go through the owner's io_uring (owner only)
+    bool ring_sending = false; // A SENDMSG is in flight; its completion flushes again
+    int ring_ops = 0;          // Requests in flight that name this session
+#endif
+
+    Session(socket_t s, Reactor* r, uint32_t addr)
+        : fd(s), owner(r), state(SessionState::AwaitingHello), format(WireFormat::Text), peer_addr(addr),
+          outbox(OUTBOUND_QUEUE_DEPTH), flush_scheduled(false), queued_bytes(0), dropped(0),
+          overflowed(false), hangup(false), sent_offset(0), attached(false), write_interest(false),
+          tcp_policy(TcpPolicy::Nagle), flush_deferred(false), msg_tokens(-1), rate_limited(0),
+          rate_warned(false) {
+        idle_timer.session = this;
+        stall_timer.session = this;
+    }
+};
+
+using SessionList = std::vector<SessionPtr>;
+
+// Client sockets and their sessions, split into one table per reactor (by
+// Session::owner) so accepts and disconnects on different reactors never
+// share a lock. Writers hold the shard's mutex; it is never held while doing
+// I/O.
+struct ClientShard {
+    std::mutex mutex;
+    std::unordered_map<socket_t, SessionPtr> sessions;
+    char pad_[CACHE_LINE_SIZE];
+};
+std::vector<std::unique_ptr<ClientShard>> clients; // Indexed by Reactor::index()
+
+// Directory of registered display names. Claiming a unique name is O(1)
+// amortized: taken names are found by hash, and each base name remembers the
+// next "_N" suffix to try and a min-heap of the ones given back, so a crowd
+// of "Guest"s neither rescans everyone nor climbs forever as people come
+// and go.
+class UserDirectory {
+public:
+    // Returns requested, or requested + "_N" for the first free N
+    std::string claim(const std::string& requested, const SessionPtr& session) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        BaseInfo& base = bases_[requested];
+        std::string name = requested;
+        int suffix = 0;
+        // A freed suffix may have been claimed as a name of its own since;
+        // release() gives it back to us when that holder leaves
+        while (by_name_.count(name) && !base.freed.empty()) {
+            suffix = base.freed.top();
+            base.freed.pop();
+            name = requested + "_" + std::to_string(suffix);
+        }
+        while (by_name_.count(name)) {
+            suffix = base.next_suffix++;
+            name = requested + "_" + std::to_string(suffix);
+        }
+        Entry& entry = by_name_[name];
+        entry.session = session;
+        entry.base = requested;
+        entry.suffix = suffix;
+        ++base.holders;
+        return name;
+    }
+
+    void release(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = by_name_.find(name);
+        if (it == by_name_.end()) return;
+        auto base = bases_.find(it->second.base);
+        // Once nobody holds a name from this base, suffixes start over at _1
+        if (base != bases_.end() && --base->second.holders == 0) bases_.erase(base);
+        else if (base != bases_.end() && it->second.suffix > 0) base->second.freed.push(it->second.suffix);
+        if (it->second.suffix == 0) free_blocked_suffix(name);
+        by_name_.erase(it);
+    }
+
+    // Points a held name at the session that resumed it
+    void rebind(const std::string& name, const SessionPtr& session) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = by_name_.find(name);
+        if (it != by_name_.end()) it->second.session = session;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return by_name_.size();
+    }
+
+    // The session behind name, if it is connected. held is set when the
+    // name is claimed but nobody is behind it: held for resume.
+    SessionPtr find(const std::string& name, bool* held = nullptr) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = by_name_.find(name);
+        SessionPtr session = it == by_name_.end() ? SessionPtr() : it->second.session.lock();
+        if (held) *held = it != by_name_.end() && !session;
+        return session;
+    }
+
+private:
+    // name was claimed as it stands; if it reads "<base>_<N>" for a base in
+    // use whose suffixes have passed N, N was skipped there and is free now
+    void free_blocked_suffix(const std::string& name) {
+        size_t cut = name.rfind('_');
+        if (cut == std::string::npos || cut + 1 >= name.size() || name.size() - cut > 10) return;
+        std::string digits = name.substr(cut + 1);
+        if (digits.find_first_not_of("0123456789") != std::string::npos || digits[0] == '0') return;
+        int suffix = std::stoi(digits);
+        auto base = bases_.find(name.substr(0, cut));
+        if (base != bases_.end() && suffix < base->second.next_suffix) base->second.freed.push(suffix);
+    }
+
+    struct Entry {
+        std::weak_ptr<Session> session;
+        std::string base; // Name as requested, before any suffix
+        int suffix = 0;   // The "_N" added to it, 0 for none
+    };
+    struct BaseInfo {
+        int next_suffix = 1;
+        std::priority_queue<int, std::vector<int>, std::greater<int>> freed; // Given back, below next_suffix
+        size_t holders = 0;
+    };
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Entry> by_name_;
+    std::unordered_map<std::string, BaseInfo> bases_;
+};
+
+UserDirectory users;
+
+// A blocking accept loop's pause after accept() fails. Running out of
+// descriptors or buffers lasts until something closes, so retrying at once
+// would only spin a core.
+const int ACCEPT_RETRY_MS = 100;
+
+void accept_failed() {
+    int err = socket_error();
+#ifdef _WIN32
+    bool exhausted = err == WSAEMFILE || err == WSAENOBUFS;
+#else
+    bool exhausted = err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM;
+#endif
+    if (exhausted) std::this_thread::sleep_for(std::chrono::milliseconds(ACCEPT_RETRY_MS));
+}
+
+// Decides in the accept loop whether a new connection gets a session at all.
+// Counts every open connection against MAX_CLIENTS and its address against
+// MAX_CLIENTS_PER_IP, and meters new connections through a token bucket.
+// Called from the accept thread and, on disconnect, from the reactors.
+class AdmissionControl {
+public:
+    enum class Verdict { Admit, ServerFull, AddressFull, RateLimited };
+
+    Verdict admit(uint32_t addr) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Verdict verdict = check(addr);
+        if (verdict == Verdict::Admit) {
+            ++active_;
+            ++per_addr_[addr]; // Even with no cap, which a reload may set
+        } else {
+            ++rejected_[(int)verdict];
+        }
+        return verdict;
+    }
+
+    // A connection taken over from the server we replaced, counted whatever
+    // the limits say
+    void adopt(uint32_t addr) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++active_;
+        ++per_addr_[addr];
+    }
+
+    void release(uint32_t addr) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --active_;
+        auto it = per_addr_.find(addr);
+        if (it != per_addr_.end() && --it->second == 0) per_addr_.erase(it);
+    }
+
+    size_t active() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return active_;
+    }
+
+    uint64_t rejected(Verdict verdict) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return rejected_[(int)verdict];
+    }
+
+private:
+    // Caller holds mutex_
+    Verdict check(uint32_t addr) {
+        const Tuning& limits = tuning();
+        if (active_ >= (size_t)limits.max_clients) return Verdict::ServerFull;
+        if (limits.max_clients_per_ip > 0) {
+            auto it = per_addr_.find(addr);
+            if (it != per_addr_.end() && it->second >= (size_t)limits.max_clients_per_ip) return Verdict::AddressFull;
+        }
+        if (limits.accept_rate > 0) {
+            double burst = limits.accept_burst > 0 ? limits.accept_burst : limits.accept_rate;
+            auto now = std::chrono::steady_clock::now();
+            if (!bucket_started_) {
+                tokens_ = burst;
+                bucket_started_ = true;
+            } else {
+                std::chrono::duration<double> elapsed = now - last_refill_;
+                tokens_ = std::min(burst, tokens_ + elapsed.count() * limits.accept_rate);
+            }
+            last_refill_ = now;
+            if (tokens_ < 1.0) return Verdict::RateLimited;
+            tokens_ -= 1.0;
+        }
+        return Verdict::Admit;
+    }
+
+    mutable std::mutex mutex_;
+    size_t active_ = 0;
+    std::unordered_map<uint32_t, size_t> per_addr_;
+    double tokens_ = 0;
+    bool bucket_started_ = false;
+    std::chrono::steady_clock::time_point last_refill_;
+    uint64_t rejected_[4] = {0, 0, 0, 0};
+};
+
+AdmissionControl admission;
+
+std::string format_ipv4(uint32_t addr) {
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(&addr);
+    return std::to_string(b[0]) + "." + std::to_string(b[1]) + "." + std::to_string(b[2]) + "." +
+           std::to_string(b[3]);
+}
+
+// ---------------------------------------------------------------------------
+// TLS: with TLS_CERT set, every client connection on PORT starts
+// with a TLS handshake, driven by the owning reactor like the rest of the
+// session state machine. How sends go out once it's done depends on who
+// encrypts records. With kTLS, OpenSSL has attached the "tls" upper-layer
+// protocol to the socket (TCP_ULP) and loaded the session keys into it, so
+// the reactor keeps writing the shared message segments with writev and
+// the kernel frames and encrypts them. Otherwise a flush copies up to one
+// record's worth of queued segments into a buffer for a single SSL_write, so
+// a burst costs one record rather than one per message. Reads always go
+// through SSL_read, which leaves alerts and post-handshake messages to
+// OpenSSL. Session tickets let a reconnecting client skip the full handshake.
+// ---------------------------------------------------------------------------
+enum class TlsStep { Done, WantRead, WantWrite, Failed };
+
+#if defined(CHAT_TLS)
+
+const size_t TLS_RECORD_BYTES = 16 * 1024; // Largest TLS record payload
+
+SSL_CTX* tls_context = nullptr;
+
+std::string tls_error() {
+    unsigned long code = ERR_get_error();
+    if (code == 0) return "unknown error";
+    char text[256];
+    ERR_error_string_n(code, text, sizeof(text));
+    return text;
+}
+
+bool tls_start() {
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == nullptr) {
+        std::cerr << "TLS setup failed: " << tls_error() << std::endl;
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION | (TLS_KTLS ? SSL_OP_ENABLE_KTLS : 0));
+    // Idle connections give their record buffers back; a flush may resend
+    // its bytes from a new buffer after a short write
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                              SSL_MODE_RELEASE_BUFFERS);
+    SSL_CTX_set_num_tickets(ctx, 1); // Reconnects use the newest ticket only
+    if (SSL_CTX_use_certificate_chain_file(ctx, TLS_CERT.c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, TLS_KEY.c_str(), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        std::cerr << "TLS certificate or key not usable: " << tls_error() << std::endl;
+        SSL_CTX_free(ctx);
+        return false;
+    }
+    if (!TLS_TICKET_KEY.empty()) {
+        // Without a shared key each process makes its own, and tickets only
+        // work against the instance that issued them
+        unsigned char keys[80];
+        FILE* file = std::fopen(TLS_TICKET_KEY.c_str(), "rb");
+        size_t got = file ? std::fread(keys, 1, sizeof(keys), file) : 0;
+        if (file) std::fclose(file);
+        if (got != sizeof(keys) || SSL_CTX_set_tlsext_ticket_keys(ctx, keys, sizeof(keys)) != 1) {
+            std::cerr << "TLS_TICKET_KEY must name a file of at least 80 bytes." << std::endl;
+            SSL_CTX_free(ctx);
+            return false;
+        }
+    }
+    tls_context = ctx;
+    return true;
+}
+
+inline bool tls_enabled() { return tls_context != nullptr; }
+
+// Starts the server side of a handshake on a freshly adopted socket
+bool tls_attach(Session& session) {
+    session.tls = SSL_new(tls_context);
+    if (session.tls == nullptr || SSL_set_fd(session.tls, (int)session.fd) != 1) return false;
+    SSL_set_accept_state(session.tls);
+    session.state = SessionState::TlsHandshake;
+    return true;
+}
+
+TlsStep tls_handshake(Session& session) {
+    ERR_clear_error();
+    int rc = SSL_do_handshake(session.tls);
+    if (rc == 1) {
+        session.tls_kernel_tx = BIO_get_ktls_send(SSL_get_wbio(session.tls)) > 0;
+        ThreadMetrics& m = metrics();
+        m.add(Counter::TlsHandshakes);
+        if (SSL_session_reused(session.tls)) m.add(Counter::TlsResumed);
+        if (session.tls_kernel_tx) m.add(Counter::TlsKernel);
+        return TlsStep::Done;
+    }
+    int err = SSL_get_error(session.tls, rc);
+    if (err == SSL_ERROR_WANT_READ) return TlsStep::WantRead;
+    if (err == SSL_ERROR_WANT_WRITE) return TlsStep::WantWrite;
+    log_event(LogLevel::Debug, {"TLS handshake failed from ", format_ipv4(session.peer_addr), ": ", tls_error()});
+    return TlsStep::Failed;
+}
+
+// Sends close_notify if the kernel takes it right away; never waits
+void tls_close(Session& session) {
+    if (session.tls == nullptr || session.state == SessionState::TlsHandshake) return;
+    if (SSL_shutdown(session.tls) < 0) ERR_clear_error();
+}
+
+#else
+
+bool tls_start() {
+    std::cerr << "TLS_CERT is set, but this build has no TLS support (needs OpenSSL, not on Windows)." << std::endl;
+    return false;
+}
+inline bool tls_enabled() { return false; }
+bool tls_attach(Session&) { return false; }
+TlsStep tls_handshake(Session&) { return TlsStep::Failed; }
+void tls_close(Session&) {}
+
+#endif
+
+// recv() for a session: plaintext bytes read, 0 once the peer has closed, or
+// -1, with blocked set if nothing is available yet
+long session_recv(Session& session, char* buffer, size_t len, bool& blocked) {
+#if defined(CHAT_TLS)
+    if (session.tls) {
+        ERR_clear_error();
+        int n = SSL_read(session.tls, buffer, (int)len);
+        if (n > 0) return n;
+        int err = SSL_get_error(session.tls, n);
+        blocked = err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE;
+        return err == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+    }
+#endif
+    long n = recv(session.fd, buffer, (int)len, 0);
+    blocked = n < 0 && would_block(socket_error());
+    return n;
+}
+
+// Plaintext OpenSSL has decrypted but session_recv hasn't returned yet; the
+// poller can't see it
+bool session_input_buffered(const Session& session) {
+#if defined(CHAT_TLS)
+    return session.tls != nullptr && SSL_pending(session.tls) > 0;
+#else
+    (void)session;
+    return false;
+#endif
+}
+
+// send_slices() for a session: bytes taken from the front of slices, or -1,
+// with blocked set if the socket is full
+long session_send(Session& session, io_slice* slices, int count, bool& blocked) {
+#if defined(CHAT_TLS)
+    if (session.tls && !session.tls_kernel_tx) {
+        static thread_local std::vector<char> record(TLS_RECORD_BYTES);
+        size_t len = 0;
+        for (int i = 0; i < count && len < TLS_RECORD_BYTES; ++i) {
+            size_t take = std::min(slices[i].iov_len, TLS_RECORD_BYTES - len);
+            memcpy(record.data() + len, slices[i].iov_base, take);
+            len += take;
+        }
+        ERR_clear_error();
+        int n = SSL_write(session.tls, record.data(), (int)len);
+        if (n > 0) return n;
+        int err = SSL_get_error(session.tls, n);
+        blocked = err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ;
+        return -1;
+    }
+#endif
+    long sent = send_slices(session.fd, slices, count);
+    blocked = sent < 0 && would_block(socket_error());
+    return sent;
+}
+
+// ---------------------------------------------------------------------------
+// Rooms: every registered session is in exactly one room ("lobby" until it
+// /joins another). A room's members are partitioned by owning reactor, each
+// partition an append-only block that joins and leaves update in place, so
+// a broadcast costs O(room size), a join or leave O(1) amortized, and the
+// per-member work runs on the thread that owns those members.
+// ---------------------------------------------------------------------------
+const char DEFAULT_ROOM[] = "lobby";
+
+// Fixed-capacity ring of a room's most recent chat lines, bounded by
+// HISTORY_DEPTH lines and HISTORY_BYTES. It has its own lock, so neither
+// recording on the chat path nor a replay to a joiner holds rooms_mutex.
+// The slots are allocated with the first line.
+class RoomHistory {
+public:
+    RoomHistory() : head_(0), count_(0), bytes_(0) {}
+
+    // line is a Message::copy_of, kept by reference
+    void record(const MessageRef& line) {
+        size_t size = line->text_size();
+        if (HISTORY_DEPTH <= 0 || size > (size_t)HISTORY_BYTES) return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (ring_.empty()) ring_.resize(HISTORY_DEPTH);
+        while (count_ > 0 && (count_ == ring_.size() || bytes_ + size > (size_t)HISTORY_BYTES)) {
+            bytes_ -= ring_[head_]->text_size();
+            ring_[head_] = MessageRef();
+            head_ = (head_ + 1) % ring_.size();
+            --count_;
+        }
+        ring_[(head_ + count_) % ring_.size()] = line;
+        ++count_;
+        bytes_ += size;
+    }
+
+    // Appends the stored lines numbered up to upto_seq to out, oldest first;
+    // with after_seq set, only those numbered above it
+    void snapshot(std::vector<MessageRef>& out, uint64_t upto_seq, uint64_t after_seq = 0) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < count_; ++i) {
+            const MessageRef& line = ring_[(head_ + i) % ring_.size()];
+            if (line->seq() <= upto_seq && (after_seq == 0 || line->seq() > after_seq)) out.push_back(line);
+        }
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::vector<MessageRef> ring_;
+    size_t head_;
+    size_t count_;
+    size_t bytes_;
+};
+
+// One reactor's members of a room. A join fills the next slot and a leave
+// only clears the slot's live flag, so neither copies the list; the block is
+// rebuilt without its dead slots once it is full or the dead outnumber the
+// live, which keeps both O(1) amortized. A slot is written once, before
+// used covers it, so readers need no lock.
+struct MemberBlock {
+    struct Slot {
+        SessionPtr session;
+        std::atomic<bool> live{false};
+    };
+
+    explicit MemberBlock(size_t slot_count)
+        : capacity(slot_count), slots(new Slot[slot_count]), used(0), live(0) {}
+
+    const size_t capacity;
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<size_t> used; // Slots filled so far
+    std::atomic<size_t> live; // Of those, members still in the room
+};
+
+// A broadcast's view of one shard: the slots filled when it looked, less
+// anyone who has left since
+class MemberList {
+public:
+    MemberList() : count_(0) {}
+    explicit MemberList(std::shared_ptr<const MemberBlock> block)
+        : block_(std::move(block)), count_(block_->used.load(std::memory_order_acquire)) {}
+
+    template <typename Fn>
+    void for_each(Fn fn) const {
+        for (size_t i = 0; i < count_; ++i) {
+            const MemberBlock::Slot& slot = block_->slots[i];
+            if (slot.live.load(std::memory_order_relaxed)) fn(slot.session);
+        }
+    }
+
+    // True if nobody but sender (null for nobody) is left in view. Only
+    // looks at the slots once at most one member is left, and then there
+    // are at most two of them.
+    bool empty_but(const Session* sender) const {
+        if (count_ == 0 || block_->live.load(std::memory_order_relaxed) > 1) return count_ == 0;
+        bool others = false;
+        for_each([&](const SessionPtr& session) { others = others || session.get() != sender; });
+        return !others;
+    }
+
+private:
+    std::shared_ptr<const MemberBlock> block_;
+    size_t count_;
+};
+
+struct Room {
+    Room(const std::string& room_name, size_t shard_count)
+        : name(room_name), member_count(0) {
+        for (size_t i = 0; i < shard_count; ++i) shards.push_back(std::make_shared<MemberBlock>(0));
+    }
+
+    const std::string name;
+    // shards[i] holds the members owned by reactors[i]; read with
+    // std::atomic_load, filled and rebuilt under rooms_mutex
+    std::vector<std::shared_ptr<MemberBlock>> shards;
+    // Orders joins against chat lines: a join's slot is published, and a
+    // line is numbered along with its view of the shards, under this lock.
+    // A member sees a line live exactly when it joined before the line was
+    // numbered.
+    mutable std::mutex order_mutex;
+    std::atomic<size_t> member_count;
+    RoomHistory history;
+
+    // Presence, under rooms_mutex. The roster names this node's members,
+    // counting sessions held for resume; every change bumps roster_version
+    // and is noted in roster_changes (name -> present) until the next
+    // update goes out, where a change undone within the window cancels out.
+    std::set<std::string> roster;
+    uint64_t roster_version = 0;
+    std::map<std::string, bool> roster_changes;
+    size_t roster_wanted = 0;        // Members entered since the last update
+    bool presence_scheduled = false; // An update is due on some reactor
+};
+
+using RoomPtr = std::shared_ptr<Room>;
+
+// Room directory. Only joins, leaves and /rooms take rooms_mutex; broadcasts
+// never do.
+std::map<std::string, RoomPtr> rooms;
+std::mutex rooms_mutex;
+RoomPtr lobby;
+
+// Chat lines are numbered in one series across every room on this node, so
+// a resuming client needs only the newest number it saw, whichever rooms it
+// was in
+std::atomic<uint64_t> line_seq(0);
+
+inline uint64_t next_line_seq() {
+    return line_seq.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+// Version 2 sessions that dropped without /quit, by resume token. Their name
+// stays claimed and their room stays alive until the client resumes or the
+// owning reactor's RESUME_GRACE_MS timer gives them up; whichever of the two
+// take()s the entry first wins. Tokens are random and valid on this node
+// only.
+struct ParkedSession {
+    std::string username;
+    SharedName shared_name;
+    RoomPtr room;
+};
+
+class ResumeTable {
+public:
+    std::string issue() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        char token[33];
+        snprintf(token, sizeof(token), "%08x%08x%08x%08x", (unsigned)random_(), (unsigned)random_(),
+                 (unsigned)random_(), (unsigned)random_());
+        return token;
+    }
+
+    void park(const std::string& token, ParkedSession parked) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        parked_[token] = std::move(parked);
+    }
+
+    // Removes the entry into out; false if it was taken already or never existed
+    bool take(const std::string& token, ParkedSession& out) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = parked_.find(token);
+        if (it == parked_.end()) return false;
+        out = std::move(it->second);
+        parked_.erase(it);
+        return true;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return parked_.size();
+    }
+
+    // Copies of every entry, for an upgrade handoff
+    std::vector<std::pair<std::string, ParkedSession>> entries() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return std::vector<std::pair<std::string, ParkedSession>>(parked_.begin(), parked_.end());
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::random_device random_; // Unpredictable, unlike a seeded engine
+    std::unordered_map<std::string, ParkedSession> parked_;
+};
+
+ResumeTable resumes;
+
+// ---------------------------------------------------------------------------
+// Journal: with JOURNAL_DIR set, every line kept in a room's history is also
+// appended to disk. Reactors hand records to a writer thread through a
+// lock-free list; the writer copies each batch into a memory-mapped segment
+// and syncs the mapped pages at most every JOURNAL_FSYNC_MS (group commit).
+//
+// A segment is a fixed-size, preallocated file, journal-<number>.seg:
+//
+//     header (64 bytes) | time index (JOURNAL_INDEX_ENTRIES x 16 bytes) | records
+//
+// Each record is a JournalRecord followed by the room name, sender name and
+// body, padded to 8 bytes, in host byte order. The header's end field says
+// how far records go; the CRC in each record catches a tail the crash left
+// half written. The time index holds (time, offset) for a record at least
+// every segment_bytes / JOURNAL_INDEX_ENTRIES bytes, so a reader can seek
+// to a time without scanning. On startup the newest segments warm up the
+// room history rings, read straight from the mapped pages.
+// ---------------------------------------------------------------------------
+const char JOURNAL_MAGIC[8] = {'C', 'H', 'A', 'T', 'J', 'R', 'N', 'L'};
+const uint32_t JOURNAL_VERSION = 1;
+const size_t JOURNAL_INDEX_ENTRIES = 4096;
+const size_t JOURNAL_HEADER_BYTES = 64;
+const size_t JOURNAL_DATA_START = JOURNAL_HEADER_BYTES + JOURNAL_INDEX_ENTRIES * 16;
+const size_t JOURNAL_QUEUE_MAX = 64 * 1024; // Records waiting for the writer before new ones are dropped
+const int JOURNAL_IDLE_SLEEP_MS = 5;
+
+enum JournalKind : uint8_t {
+    JOURNAL_CHAT = 1, // name and body of a local user's chat line
+    JOURNAL_LINE = 2  // a whole displayed line (relayed from a peer node)
+};
+
+struct JournalSegmentHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t index_entries;
+    uint64_t segment_bytes;
+    uint64_t end;         // Offset just past the last record
+    uint64_t index_count; // Time index entries in use
+    int64_t created_us;
+    char reserved[JOURNAL_HEADER_BYTES - 48];
+};
+
+struct JournalIndexEntry {
+    int64_t time_us;
+    uint64_t offset;
+};
+
+struct JournalRecord {
+    uint32_t size; // Whole record, this header and padding included
+    uint32_t crc;  // CRC-32 of everything after this field, padding excluded
+    int64_t time_us; // Wall clock
+    uint8_t kind;
+    uint8_t room_len;
+    uint16_t name_len;
+    uint32_t body_len;
+};
+
+// Lines read back from the journal at startup, handed to each room's
+// history when the room is created (rooms_mutex)
+std::map<std::string, std::deque<MessageRef>> warm_history;
+
+// A line on its way to the writer thread
+struct JournalEntry : MpscNode {
+    MessageRef line;
+    int64_t time_us;
+    uint8_t room_len;
+    char room[MAX_ROOM_NAME];
+
+    static void* operator new(size_t bytes) { return slab_alloc(bytes); }
+    static void operator delete(void* p) { slab_free(p); }
+};
+
+uint32_t journal_crc32(uint32_t crc, const char* data, size_t len) {
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) crc = table[(crc ^ (unsigned char)data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+int64_t wall_clock_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+#if !defined(_WIN32)
+
+class Journal {
+public:
+    Journal() : pending_(0), stopping_(false), stopped_(false), fd_(-1), base_(nullptr), segment_bytes_(0),
+                next_number_(0), last_sync_ns_(0), dirty_(false), failed_(false) {}
+
+    // Reads the newest segments into warm_history, opens a fresh segment and
+    // starts the writer; prints the reason and returns false on failure
+    bool start(const std::string& dir, size_t segment_bytes);
+
+    // Any thread; drops the line if the writer is too far behind
+    void append(const Room& room, const MessageRef& line) {
+        if (pending_.fetch_add(1, std::memory_order_relaxed) >= JOURNAL_QUEUE_MAX || failed_.load()) {
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+            metrics().add(Counter::JournalDropped);
+            return;
+        }
+        JournalEntry* entry = new JournalEntry();
+        entry->line = line;
+        entry->time_us = wall_clock_us();
+        entry->room_len = (uint8_t)std::min(room.name.size(), MAX_ROOM_NAME);
+        memcpy(entry->room, room.name.data(), entry->room_len);
+        queue_.push(entry);
+    }
+
+    // Shutdown: waits until the writer has written and synced everything
+    // appended so far, then leaves it stopped
+    void stop();
+
+private:
+    void run();
+    bool open_segment();
+    void close_segment();
+    void write(const JournalEntry& entry);
+    void sync();
+    std::string segment_path(uint64_t number) const;
+    std::vector<uint64_t> list_segments() const;
+    void warm_up(const std::vector<uint64_t>& numbers);
+    void read_segment(const char* base, size_t size);
+
+    MpscList queue_;
+    std::atomic<size_t> pending_;
+    std::atomic<bool> stopping_;
+    std::atomic<bool> stopped_;
+
+    // Writer thread only
+    std::string dir_;
+    int fd_;
+    char* base_;
+    size_t segment_bytes_;
+    uint64_t next_number_;
+    int64_t last_sync_ns_;
+    bool dirty_; // Records written since the last sync
+    std::atomic<bool> failed_;
+};
+
+std::string Journal::segment_path(uint64_t number) const {
+    char name[64];
+    snprintf(name, sizeof(name), "/journal-%020llu.seg", (unsigned long long)number);
+    return dir_ + name;
+}
+
+std::vector<uint64_t> Journal::list_segments() const {
+    std::vector<uint64_t> numbers;
+    DIR* dir = opendir(dir_.c_str());
+    if (dir == nullptr) return numbers;
+    while (struct dirent* e = readdir(dir)) {
+        unsigned long long number;
+        char tail[8];
+        if (sscanf(e->d_name, "journal-%20llu.%3s", &number, tail) == 2 && strcmp(tail, "seg") == 0) {
+            numbers.push_back(number);
+        }
+    }
+    closedir(dir);
+    std::sort(numbers.begin(), numbers.end());
+    return numbers;
+}
+
+bool Journal::start(const std::string& dir, size_t segment_bytes) {
+    dir_ = dir;
+    segment_bytes_ = segment_bytes;
+    if (mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+        std::cerr << "Cannot create journal directory " << dir_ << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    std::vector<uint64_t> numbers = list_segments();
+    warm_up(numbers);
+    // Never append to a segment a crash may have left torn; start a new one
+    next_number_ = numbers.empty() ? 1 : numbers.back() + 1;
+    if (!open_segment()) {
+        std::cerr << "Cannot create journal segment in " << dir_ << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    std::thread(&Journal::run, this).detach();
+    return true;
+}
+
+// Fills warm_history with up to HISTORY_DEPTH recent lines per room. Every
+// start opens a new segment, so the newest files may be nearly empty: walk
+// back until about one segment's worth of records is covered, then read
+// those files oldest first.
+void Journal::warm_up(const std::vector<uint64_t>& numbers) {
+    if (HISTORY_DEPTH <= 0) return;
+    size_t first = numbers.size();
+    size_t covered = 0;
+    while (first > 0 && covered < segment_bytes_) {
+        --first;
+        int fd = ::open(segment_path(numbers[first]).c_str(), O_RDONLY);
+        if (fd < 0) continue;
+        JournalSegmentHeader header;
+        if (pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) && header.end > JOURNAL_DATA_START) {
+            covered += (size_t)(header.end - JOURNAL_DATA_START);
+        }
+        ::close(fd);
+    }
+    for (size_t i = first; i < numbers.size(); ++i) {
+        int fd = ::open(segment_path(numbers[i]).c_str(), O_RDONLY);
+        if (fd < 0) continue;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= JOURNAL_DATA_START) {
+            void* base = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (base != MAP_FAILED) {
+                read_segment(static_cast<const char*>(base), (size_t)st.st_size);
+                munmap(base, (size_t)st.st_size);
+            }
+        }
+        ::close(fd);
+    }
+}
+
+void Journal::read_segment(const char* base, size_t size) {
+    JournalSegmentHeader header;
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0 || header.version != JOURNAL_VERSION) return;
+    size_t end = std::min((size_t)header.end, size);
+    size_t offset = JOURNAL_DATA_START;
+    JournalRecord record;
+    while (offset + sizeof(record) <= end) {
+        memcpy(&record, base + offset, sizeof(record));
+        size_t payload = (size_t)record.room_len + record.name_len + record.body_len;
+        if (record.size < sizeof(record) + payload || record.size > end - offset) break;
+        const char* after_crc = base + offset + 2 * sizeof(uint32_t);
+        if (journal_crc32(0, after_crc, sizeof(record) - 2 * sizeof(uint32_t) + payload) != record.crc) break;
+        const char* room = base + offset + sizeof(record);
+        const char* name = room + record.room_len;
+        const char* body = name + record.name_len;
+        MessageRef line = record.kind == JOURNAL_CHAT
+            ? Message::chat(std::make_shared<const std::string>(name, record.name_len), body, record.body_len)
+            : Message::text(body, record.body_len);
+        std::deque<MessageRef>& lines = warm_history[std::string(room, record.room_len)];
+        lines.push_back(line);
+        if (lines.size() > (size_t)HISTORY_DEPTH) lines.pop_front();
+        offset += record.size;
+    }
+}
+
+bool Journal::open_segment() {
+    std::string path = segment_path(next_number_);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) return false;
+    // Reserve the blocks up front: a store into a hole on a full disk would
+    // be a SIGBUS rather than an error
+    #if defined(__linux__)
+        bool sized = posix_fallocate(fd, 0, (off_t)segment_bytes_) == 0;
+    #else
+        bool sized = ftruncate(fd, (off_t)segment_bytes_) == 0;
+    #endif
+    void* base = sized ? mmap(nullptr, segment_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (base == MAP_FAILED) {
+        ::close(fd);
+        unlink(path.c_str());
+        return false;
+    }
+    fd_ = fd;
+    base_ = static_cast<char*>(base);
+    ++next_number_;
+
+    JournalSegmentHeader* header = reinterpret_cast<JournalSegmentHeader*>(base_);
+    memset(base_, 0, JOURNAL_DATA_START);
+    memcpy(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+    header->version = JOURNAL_VERSION;
+    header->index_entries = (uint32_t)JOURNAL_INDEX_ENTRIES;
+    header->segment_bytes = segment_bytes_;
+    header->end = JOURNAL_DATA_START;
+    header->created_us = wall_clock_us();
+    dirty_ = true;
+
+    // Retention: keep the newest JOURNAL_SEGMENTS files
+    if (JOURNAL_SEGMENTS > 0) {
+        std::vector<uint64_t> numbers = list_segments();
+        for (size_t i = 0; i + (size_t)JOURNAL_SEGMENTS < numbers.size(); ++i) unlink(segment_path(numbers[i]).c_str());
+    }
+    return true;
+}
+
+void Journal::close_segment() {
+    sync();
+    munmap(base_, segment_bytes_);
+    ::close(fd_);
+    base_ = nullptr;
+    fd_ = -1;
+}
+
+// Group commit: one msync covers every record since the last one
+void Journal::sync() {
+    if (!dirty_) return;
+    if (JOURNAL_FSYNC_MS >= 0) {
+        const JournalSegmentHeader* header = reinterpret_cast<const JournalSegmentHeader*>(base_);
+        msync(base_, (size_t)header->end, MS_SYNC);
+    }
+    dirty_ = false;
+    last_sync_ns_ = monotonic_ns();
+}
+
+void Journal::write(const JournalEntry& entry) {
+    const Message& line = *entry.line;
+    JournalRecord record;
+    record.time_us = entry.time_us;
+    record.kind = line.is_chat() ? JOURNAL_CHAT : JOURNAL_LINE;
+    record.room_len = entry.room_len;
+    const std::string* name = line.is_chat() ? line.name().get() : nullptr;
+    record.name_len = name ? (uint16_t)std::min(name->size(), (size_t)UINT16_MAX) : 0;
+    record.body_len = (uint32_t)line.body_size();
+    size_t payload = (size_t)record.room_len + record.name_len + record.body_len;
+    record.size = (uint32_t)((sizeof(record) + payload + 7) & ~(size_t)7);
+    if (JOURNAL_DATA_START + record.size > segment_bytes_) return; // Can never fit
+
+    JournalSegmentHeader* header = reinterpret_cast<JournalSegmentHeader*>(base_);
+    if (header->end + record.size > segment_bytes_) {
+        close_segment();
+        if (!open_segment()) {
+            log_event(LogLevel::Error, {"Journal disabled: cannot create a segment in ", dir_, ": ", strerror(errno)});
+            failed_.store(true);
+            return;
+        }
+        header = reinterpret_cast<JournalSegmentHeader*>(base_);
+    }
+
+    char* out = base_ + header->end;
+    char* p = out + sizeof(record);
+    memcpy(p, entry.room, record.room_len);
+    p += record.room_len;
+    if (name) memcpy(p, name->data(), record.name_len);
+    p += record.name_len;
+    memcpy(p, line.body(), record.body_len);
+    record.crc = 0;
+    memcpy(out, &record, sizeof(record));
+    record.crc = journal_crc32(0, out + 2 * sizeof(uint32_t), sizeof(record) - 2 * sizeof(uint32_t) + payload);
+    memcpy(out + sizeof(uint32_t), &record.crc, sizeof(record.crc));
+
+    // Index the first record of every stretch of segment_bytes / entries bytes
+    size_t spacing = segment_bytes_ / JOURNAL_INDEX_ENTRIES;
+    if (header->index_count < JOURNAL_INDEX_ENTRIES &&
+        header->end - JOURNAL_DATA_START >= header->index_count * spacing) {
+        JournalIndexEntry* index = reinterpret_cast<JournalIndexEntry*>(base_ + JOURNAL_HEADER_BYTES);
+        index[header->index_count].time_us = record.time_us;
+        index[header->index_count].offset = header->end;
+        ++header->index_count;
+    }
+    header->end += record.size;
+    dirty_ = true;
+    metrics().add(Counter::JournalRecords);
+}
+
+void Journal::run() {
+    while (true) {
+        bool busy = false;
+        while (MpscNode* node = queue_.pop()) {
+            JournalEntry* entry = static_cast<JournalEntry*>(node);
+            if (!failed_.load(std::memory_order_relaxed)) write(*entry);
+            delete entry;
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+            busy = true;
+        }
+        if (stopping_.load() && pending_.load() == 0) {
+            if (dirty_ && JOURNAL_FSYNC_MS >= 0 && !failed_.load()) sync();
+            stopped_.store(true);
+            return;
+        }
+        if (failed_.load(std::memory_order_relaxed)) {
+            if (!busy) std::this_thread::sleep_for(std::chrono::milliseconds(JOURNAL_IDLE_SLEEP_MS));
+            continue;
+        }
+        if (dirty_ && (JOURNAL_FSYNC_MS <= 0 || monotonic_ns() - last_sync_ns_ >= (int64_t)JOURNAL_FSYNC_MS * 1000000)) {
+            sync();
+        }
+        if (!busy) std::this_thread::sleep_for(std::chrono::milliseconds(JOURNAL_IDLE_SLEEP_MS));
+    }
+}
+
+void Journal::stop() {
+    stopping_.store(true);
+    while (!stopped_.load()) std::this_thread::sleep_for(std::chrono::milliseconds(JOURNAL_IDLE_SLEEP_MS));
+}
+
+Journal* journal = nullptr; // Null unless JOURNAL_DIR is set; never destroyed
+
+bool journal_start() {
+    journal = new Journal();
+    return journal->start(JOURNAL_DIR, (size_t)JOURNAL_SEGMENT_MB * 1024 * 1024);
+}
+
+void journal_append(const Room& room, const MessageRef& line) {
+    if (journal) journal->append(room, line);
+}
+
+void journal_stop() {
+    if (journal) journal->stop();
+}
+
+#else // _WIN32: no mmap-based journal
+
+bool journal_start() {
+    std::cerr << "JOURNAL_DIR is not supported on Windows." << std::endl;
+    return false;
+}
+
+void journal_append(const Room&, const MessageRef&) {}
+
+void journal_stop() {}
+
+#endif
+
+// Caller holds rooms_mutex
+void journal_warm_up(Room& room) {
+    auto it = warm_history.find(room.name);
+    if (it == warm_history.end()) return;
+    for (const MessageRef& line : it->second) room.history.record(line);
+    warm_history.erase(it);
+}
+
+// ---------------------------------------------------------------------------
+// Upgrade handoff: with UPGRADE_SOCKET set, a running server waits on that
+// Unix socket for its replacement, and a new server started with the same
+// path connects to it before binding anything. The new server says HELLO
+// with its handoff version, and the old one answers HELLO with its own and
+// passes its listening sockets over (SCM_RIGHTS). Only once the new server
+// has them and says READY does the old one commit, answer COMMIT and drain;
+// a successor that can't take over, or never hears COMMIT, leaves it
+// serving as before. Connections keep being
+// accepted throughout. Each reactor hands over every logged-in plaintext
+// client it can, with its socket, session and unsent output; the rest get
+// the usual reconnect hint and are parked on the new server for a resume.
+// Rooms go last, with their history, roster and roster version, so clients
+// handed over see no change and a release doesn't start with cold replays.
+// Records on the channel are
+//
+//     type (1 byte) | 4-byte big-endian payload length | payload
+//
+// with a passed socket riding on the record's first byte, and strings in a
+// payload sent as a 4-byte big-endian length and the bytes. Not on Windows,
+// and not from IO_ENGINE=uring, whose multishot requests would go on
+// reading the sockets handed over.
+// ---------------------------------------------------------------------------
+enum HandoffRecord : unsigned char {
+    HANDOFF_HELLO = 1,      // HANDOFF_VERSION, first each way; from the old server then a 4-byte
+                            // count of the LISTENER records that follow (0 if it won't hand over)
+    HANDOFF_LISTENER = 2,   // A listening socket, attached
+    HANDOFF_SESSION = 3,    // A logged-in client's socket, attached: 4-byte address, version, format,
+                            // saw newline, roster wanted, 8-byte roster_from, then username, resume
+                            // token, room and unsent output
+    HANDOFF_CONNECTION = 4, // A client socket nothing was read from yet, attached: 4-byte address
+    HANDOFF_PARKED = 5,     // A session to hold for resume: token, username, room
+    HANDOFF_ROOM = 6,       // Name, 8-byte roster version, roster, roster changes not yet sent (present
+                            // flag and name each), history lines (chat flag, 8-byte seq, then name and
+                            // body, or the whole line); each list after a 4-byte count
+    HANDOFF_DONE = 7,       // 8-byte line_seq; the old server only drains from here on
+    HANDOFF_READY = 8,      // New server to old, empty: has the listeners, the old server may drain
+    HANDOFF_COMMIT = 9      // Old server to new, empty, right after READY: it has committed and drains
+};
+
+const unsigned char HANDOFF_VERSION = 3;
+// Largest record either side sends or takes. A client with more output
+// than this waiting is parked for resume instead, and a room's oldest
+// history lines stay behind.
+const uint32_t HANDOFF_MAX_RECORD = 64 * 1024 * 1024;
+
+void put_handoff_u32(std::string& out, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8) out.push_back((char)((value >> shift) & 0xff));
+}
+
+void put_handoff_u64(std::string& out, uint64_t value) {
+    char bytes[8];
+    put_u64_be(bytes, value);
+    out.append(bytes, sizeof(bytes));
+}
+
+void put_handoff_string(std::string& out, const std::string& value) {
+    put_handoff_u32(out, (uint32_t)value.size());
+    out += value;
+}
+
+// Takes a record's payload apart field by field; reading past its end
+// clears ok and returns zeros and empty strings from then on
+struct HandoffReader {
+    const char* p;
+    size_t left;
+    bool ok;
+
+    explicit HandoffReader(const std::string& payload) : p(payload.data()), left(payload.size()), ok(true) {}
+
+    unsigned char u8() {
+        if (!have(1)) return 0;
+        unsigned char value = (unsigned char)*p;
+        skip(1);
+        return value;
+    }
+    uint32_t u32() {
+        if (!have(4)) return 0;
+        uint32_t value = 0;
+        for (int i = 0; i < 4; ++i) value = (value << 8) | (unsigned char)p[i];
+        skip(4);
+        return value;
+    }
+    uint64_t u64() {
+        if (!have(8)) return 0;
+        uint64_t value = get_u64_be(p);
+        skip(8);
+        return value;
+    }
+    std::string string() {
+        uint32_t len = u32();
+        if (!have(len)) return std::string();
+        std::string value(p, len);
+        skip(len);
+        return value;
+    }
+
+private:
+    bool have(size_t n) {
+        if (left < n) ok = false;
+        return ok;
+    }
+    void skip(size_t n) {
+        p += n;
+        left -= n;
+    }
+};
+
+// A handoff in progress, on the old server. After the listeners every
+// record goes out under mutex, from whichever thread has one: the reactors
+// as they drain, the shared accept thread and main.
+struct Handoff {
+    std::mutex mutex;
+    std::condition_variable changed;
+    socket_t fd = INVALID_SOCKET;    // Channel to the new server; INVALID_SOCKET once closed or broken
+    std::atomic<bool> started{false}; // A successor took the listeners; set once
+    size_t quiesced = 0;             // Reactors that have stopped taking input
+    size_t finished = 0;             // Reactors done handing sessions over
+    size_t sessions = 0;             // Clients handed over, for the log
+    std::map<std::string, RoomPtr> rooms; // Rooms of the sessions handed over or parked
+};
+
+Handoff handoff;
+std::vector<socket_t> handoff_listeners; // Every listening socket; filled by main before serving
+
+bool handoff_write(socket_t fd, unsigned char type, const std::string& payload, socket_t attached);
+
+bool handoff_active() {
+    return handoff.started.load();
+}
+
+// Sends one record to the new server (any thread). A failed send ends the
+// handoff, and callers drain what they were handing over as usual.
+bool handoff_send(unsigned char type, const std::string& payload, socket_t attached = INVALID_SOCKET) {
+    if (payload.size() > HANDOFF_MAX_RECORD) {
+        // The new server would refuse it; what it carries stays with us
+        log_event(LogLevel::Warn, {"Upgrade handoff: a ", std::to_string(payload.size()), "-byte record is too large to send"});
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(handoff.mutex);
+    if (handoff.fd == INVALID_SOCKET) return false;
+    if (handoff_write(handoff.fd, type, payload, attached)) return true;
+    log_event(LogLevel::Warn, {"Upgrade handoff failed: ", strerror(socket_error()), "; draining the rest"});
+    close_socket(handoff.fd);
+    handoff.fd = INVALID_SOCKET;
+    return false;
+}
+
+// Each draining reactor: returns once all reactor_count have stopped taking
+// input, so no line is still on its way to a client about to be handed over
+void handoff_quiesce(size_t reactor_count) {
+    std::unique_lock<std::mutex> lock(handoff.mutex);
+    ++handoff.quiesced;
+    handoff.changed.notify_all();
+    handoff.changed.wait(lock, [reactor_count] { return handoff.quiesced >= reactor_count; });
+}
+
+void handoff_reactor_done() {
+    std::lock_guard<std::mutex> lock(handoff.mutex);
+    ++handoff.finished;
+    handoff.changed.notify_all();
+}
+
+// A logged-in client, with whatever it hasn't been sent yet (owner only)
+bool handoff_session(const Session& session, const std::string& pending) {
+    std::string payload;
+    put_handoff_u32(payload, session.peer_addr);
+    payload.push_back((char)session.version);
+    payload.push_back((char)session.format);
+    payload.push_back(session.lines.saw_newline() ? 1 : 0);
+    payload.push_back(session.roster_wanted ? 1 : 0);
+    put_handoff_u64(payload, session.roster_from);
+    put_handoff_string(payload, session.username);
+    put_handoff_string(payload, session.resume_token);
+    put_handoff_string(payload, session.room->name);
+    put_handoff_string(payload, pending);
+    if (!handoff_send(HANDOFF_SESSION, payload, session.fd)) return false;
+    std::lock_guard<std::mutex> lock(handoff.mutex);
+    handoff.rooms.insert(std::make_pair(session.room->name, session.room));
+    ++handoff.sessions;
+    return true;
+}
+
+// A client sent off with a reconnect hint instead (owner only): parked on
+// the new server, its RESUME there replays what it missed
+void handoff_park(const Session& session) {
+    if (session.resume_token.empty()) return;
+    std::string payload;
+    put_handoff_string(payload, session.resume_token);
+    put_handoff_string(payload, session.username);
+    put_handoff_string(payload, session.room->name);
+    if (!handoff_send(HANDOFF_PARKED, payload)) return;
+    std::lock_guard<std::mutex> lock(handoff.mutex);
+    handoff.rooms.insert(std::make_pair(session.room->name, session.room));
+}
+
+// A connection nothing was read from yet; the new server starts it afresh
+bool handoff_connection(socket_t fd, uint32_t peer_addr) {
+    std::string payload;
+    put_handoff_u32(payload, peer_addr);
+    return handoff_send(HANDOFF_CONNECTION, payload, fd);
+}
+
+std::string handoff_room_record(const Room& room) {
+    std::string payload;
+    put_handoff_string(payload, room.name);
+    {
+        std::lock_guard<std::mutex> lock(rooms_mutex);
+        put_handoff_u64(payload, room.roster_version);
+        put_handoff_u32(payload, (uint32_t)room.roster.size());
+        for (const std::string& name : room.roster) put_handoff_string(payload, name);
+        put_handoff_u32(payload, (uint32_t)room.roster_changes.size());
+        for (const auto& change : room.roster_changes) {
+            payload.push_back(change.second ? 1 : 0);
+            put_handoff_string(payload, change.first);
+        }
+    }
+    std::vector<MessageRef> lines;
+    room.history.snapshot(lines, UINT64_MAX);
+    std::vector<std::string> encoded(lines.size());
+    for (size_t i = 0; i < lines.size(); ++i) {
+        const MessageRef& line = lines[i];
+        encoded[i].push_back(line->is_chat() ? 1 : 0);
+        put_handoff_u64(encoded[i], line->seq());
+        if (line->is_chat()) {
+            put_handoff_string(encoded[i], *line->name());
+            put_handoff_string(encoded[i], std::string(line->body(), line->body_size()));
+        } else {
+            std::string text;
+            line->append_text(text);
+            put_handoff_string(encoded[i], text);
+        }
+    }
+    // The newest lines that fit in one record
+    size_t room_left = payload.size() + 4 < HANDOFF_MAX_RECORD ? HANDOFF_MAX_RECORD - payload.size() - 4 : 0;
+    size_t first = encoded.size();
+    while (first > 0 && encoded[first - 1].size() <= room_left) room_left -= encoded[--first].size();
+    put_handoff_u32(payload, (uint32_t)(encoded.size() - first));
+    for (size_t i = first; i < encoded.size(); ++i) payload += encoded[i];
+    return payload;
+}
+
+// Main, once the drain has started: waits for every reactor's part, then
+// sends the sessions already parked, every room anyone handed over is in
+// and the line numbering to carry on from. The journal is written out
+// first, so from here on the new server is the only one appending to it.
+void handoff_finish(size_t reactor_count) {
+    std::map<std::string, RoomPtr> send_rooms;
+    {
+        std::lock_guard<std::mutex> lock(rooms_mutex);
+        send_rooms = rooms;
+    }
+    {
+        std::unique_lock<std::mutex> lock(handoff.mutex);
+        handoff.changed.wait(lock, [reactor_count] { return handoff.finished >= reactor_count; });
+        send_rooms.insert(handoff.rooms.begin(), handoff.rooms.end());
+    }
+    journal_stop();
+    for (const auto& entry : resumes.entries()) {
+        const ParkedSession& parked = entry.second;
+        std::string payload;
+        put_handoff_string(payload, entry.first);
+        put_handoff_string(payload, parked.username);
+        put_handoff_string(payload, parked.room->name);
+        handoff_send(HANDOFF_PARKED, payload);
+        send_rooms.insert(std::make_pair(parked.room->name, parked.room));
+    }
+    for (const auto& entry : send_rooms) handoff_send(HANDOFF_ROOM, handoff_room_record(*entry.second));
+    std::string done;
+    put_handoff_u64(done, line_seq.load());
+    bool sent = handoff_send(HANDOFF_DONE, done);
+
+    std::lock_guard<std::mutex> lock(handoff.mutex);
+    if (handoff.fd != INVALID_SOCKET) close_socket(handoff.fd);
+    handoff.fd = INVALID_SOCKET;
+    if (sent) {
+        log_event("Handed " + std::to_string(handoff.sessions) + " client(s) and " +
+                  std::to_string(send_rooms.size()) + " room(s) over to the new server");
+    }
+}
+
+// What a new server takes over from the old one
+struct HandedSession {
+    socket_t fd;
+    uint32_t peer_addr;
+    unsigned char version;
+    WireFormat format;
+    bool saw_newline;
+    bool roster_wanted;
+    uint64_t roster_from;
+    std::string username;
+    std::string resume_token;
+    std::string room;
+    std::string pending; // Output the old server had not sent yet
+};
+
+struct HandedParked {
+    std::string token;
+    std::string username;
+    std::string room;
+};
+
+struct HandedRoom {
+    std::string name;
+    uint64_t roster_version;
+    std::vector<std::string> roster;
+    std::map<std::string, bool> changes;
+    std::vector<MessageRef> lines;
+};
+
+struct HandoffIntake {
+    std::vector<socket_t> listeners;
+    std::vector<HandedSession> sessions;
+    std::vector<std::pair<socket_t, uint32_t>> connections; // Socket and address
+    std::vector<HandedParked> parked;
+    std::vector<HandedRoom> rooms;
+};
+
+// Takes one record apart into intake; false if it is malformed. attached
+// is reset once intake owns it.
+bool handoff_take(HandoffIntake& intake, unsigned char type, const std::string& payload, socket_t& attached) {
+    HandoffReader in(payload);
+    switch (type) {
+    case HANDOFF_LISTENER:
+        if (attached == INVALID_SOCKET) return false;
+        intake.listeners.push_back(attached);
+        break;
+    case HANDOFF_SESSION: {
+        HandedSession session;
+        session.fd = attached;
+        session.peer_addr = in.u32();
+        session.version = in.u8();
+        unsigned char format = in.u8();
+        session.format = (WireFormat)format;
+        session.saw_newline = in.u8() != 0;
+        session.roster_wanted = in.u8() != 0;
+        session.roster_from = in.u64();
+        session.username = in.string();
+        session.resume_token = in.string();
+        session.room = in.string();
+        session.pending = in.string();
+        if (!in.ok || attached == INVALID_SOCKET || format > (unsigned char)WireFormat::Deflated) return false;
+        intake.sessions.push_back(std::move(session));
+        break;
+    }
+    case HANDOFF_CONNECTION: {
+        uint32_t peer_addr = in.u32();
+        if (!in.ok || attached == INVALID_SOCKET) return false;
+        intake.connections.push_back(std::make_pair(attached, peer_addr));
+        break;
+    }
+    case HANDOFF_PARKED: {
+        HandedParked parked;
+        parked.token = in.string();
+        parked.username = in.string();
+        parked.room = in.string();
+        if (!in.ok) return false;
+        intake.parked.push_back(std::move(parked));
+        return true;
+    }
+    case HANDOFF_ROOM: {
+        HandedRoom room;
+        room.name = in.string();
+        room.roster_version = in.u64();
+        for (uint32_t n = in.u32(); n > 0 && in.ok; --n) room.roster.push_back(in.string());
+        for (uint32_t n = in.u32(); n > 0 && in.ok; --n) {
+            bool present = in.u8() != 0;
+            room.changes[in.string()] = present;
+        }
+        for (uint32_t n = in.u32(); n > 0 && in.ok; --n) {
+            bool chat = in.u8() != 0;
+            uint64_t seq = in.u64();
+            if (seq > line_seq.load()) line_seq.store(seq); // In case DONE never comes
+            std::string text = in.string();
+            if (chat) {
+                std::string body = in.string();
+                room.lines.push_back(Message::chat(std::make_shared<const std::string>(text), body.data(),
+                                                   body.size(), 0, seq));
+            } else {
+                room.lines.push_back(Message::text(text.data(), text.size(), seq));
+            }
+        }
+        if (!in.ok) return false;
+        intake.rooms.push_back(std::move(room));
+        return true;
+    }
+    case HANDOFF_DONE:
+        line_seq.store(in.u64());
+        return in.ok;
+    default:
+        return false;
+    }
+    attached = INVALID_SOCKET;
+    return true;
+}
+
+#if !defined(_WIN32)
+
+// Writes one record, with attached (if not INVALID_SOCKET) passed along on
+// its first byte
+bool handoff_write(socket_t fd, unsigned char type, const std::string& payload, socket_t attached) {
+    std::string record(1, (char)type);
+    put_handoff_u32(record, (uint32_t)payload.size());
+    record += payload;
+    size_t sent = 0;
+    while (sent < record.size()) {
+        struct iovec iov;
+        iov.iov_base = &record[sent];
+        iov.iov_len = record.size() - sent;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        char control[CMSG_SPACE(sizeof(int))];
+        if (sent == 0 && attached != INVALID_SOCKET) {
+            memset(control, 0, sizeof(control));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &attached, sizeof(int));
+        }
+        ssize_t n = sendmsg(fd, &msg, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += (size_t)n;
+    }
+    return true;
+}
+
+// Reads one record. The header is read on its own, so a socket passed with
+// the next record is never taken in with this one's payload.
+bool handoff_read(socket_t fd, unsigned char& type, std::string& payload, socket_t& attached) {
+    attached = INVALID_SOCKET;
+    char header[5];
+    struct iovec iov;
+    iov.iov_base = header;
+    iov.iov_len = sizeof(header);
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n;
+    do {
+        n = recvmsg(fd, &msg, MSG_WAITALL);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                memcpy(&attached, CMSG_DATA(cmsg), sizeof(int));
+            }
+        }
+    }
+    uint32_t size = 0;
+    for (int i = 1; i < 5; ++i) size = (size << 8) | (unsigned char)header[i];
+    bool ok = n == (ssize_t)sizeof(header) && size <= HANDOFF_MAX_RECORD;
+    if (ok) {
+        type = (unsigned char)header[0];
+        payload.resize(size);
+        size_t got = 0;
+        while (ok && got < size) {
+            ssize_t r = recv(fd, &payload[got], size - got, 0);
+            if (r < 0 && errno == EINTR) continue;
+            ok = r > 0;
+            if (ok) got += (size_t)r;
+        }
+    }
+    if (!ok && attached != INVALID_SOCKET) {
+        close_socket(attached);
+        attached = INVALID_SOCKET;
+    }
+    return ok;
+}
+
+bool handoff_address(struct sockaddr_un& address) {
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (UPGRADE_SOCKET.size() >= sizeof(address.sun_path)) return false;
+    memcpy(address.sun_path, UPGRADE_SOCKET.data(), UPGRADE_SOCKET.size());
+    return true;
+}
+
+// Makes each read on fd give up after ms
+void handoff_read_timeout(socket_t fd, long ms) {
+    struct timeval timeout;
+    timeout.tv_sec = ms / 1000;
+    timeout.tv_usec = (ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+// Reads one record from a would-be successor within UPGRADE_HELLO_TIMEOUT_MS;
+// false unless it is of type want
+bool handoff_expect(socket_t fd, unsigned char want, std::string& payload) {
+    unsigned char type = 0;
+    socket_t attached;
+    bool ok = handoff_read(fd, type, payload, attached) && type == want;
+    if (attached != INVALID_SOCKET) close_socket(attached);
+    return ok;
+}
+
+// Checks a would-be successor's HELLO, passes it the listening sockets and
+// waits for its READY. Until that arrives nothing is committed: on any
+// failure we go on serving as before.
+bool handoff_offer(socket_t fd) {
+    handoff_read_timeout(fd, UPGRADE_HELLO_TIMEOUT_MS);
+    std::string payload;
+    if (!handoff_expect(fd, HANDOFF_HELLO, payload) || payload.empty()) {
+        log_event(LogLevel::Warn, {"Upgrade: ignoring a connection to UPGRADE_SOCKET that sent no HELLO"});
+        return false;
+    }
+    unsigned char version = (unsigned char)payload[0];
+    bool compatible = version == HANDOFF_VERSION;
+    std::string hello(1, (char)HANDOFF_VERSION);
+    put_handoff_u32(hello, compatible ? (uint32_t)handoff_listeners.size() : 0);
+    bool sent = handoff_write(fd, HANDOFF_HELLO, hello, INVALID_SOCKET);
+    if (!compatible) {
+        log_event(LogLevel::Warn, {"Upgrade refused: the new server speaks handoff version ", std::to_string(version),
+                                   ", this one ", std::to_string(HANDOFF_VERSION), "; still serving"});
+        return false;
+    }
+    for (socket_t listener : handoff_listeners) sent = sent && handoff_write(fd, HANDOFF_LISTENER, "", listener);
+    // The successor serves only once it hears COMMIT, so a READY we gave up
+    // on just before it came can't leave two of us on the listeners
+    if (!sent || !handoff_expect(fd, HANDOFF_READY, payload) || !handoff_write(fd, HANDOFF_COMMIT, "", INVALID_SOCKET)) {
+        log_event(LogLevel::Warn, {"Upgrade abandoned: the new server did not take the listeners; still serving"});
+        return false;
+    }
+    return true;
+}
+
+// Waits on UPGRADE_SOCKET for the server that replaces this one. Once it
+// has the listening sockets and said READY, a SIGTERM to ourselves starts
+// the drain that hands everything else over.
+void handoff_accept_loop(socket_t listen_fd) {
+    while (true) {
+        socket_t fd = accept(listen_fd, nullptr, nullptr);
+        if (fd == INVALID_SOCKET) {
+            accept_failed();
+            continue;
+        }
+        if (draining.load()) {
+            close_socket(fd); // Shutting down already; it binds once we're gone
+            continue;
+        }
+        if (!handoff_offer(fd)) {
+            close_socket(fd);
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> lock(handoff.mutex);
+            handoff.fd = fd;
+        }
+        handoff.started.store(true);
+        close_socket(listen_fd);
+        log_event("Upgrade: a new server has taken over the listeners");
+        kill(getpid(), SIGTERM);
+        return;
+    }
+}
+
+// Opens UPGRADE_SOCKET for a successor (main, once this server is serving)
+void handoff_listen() {
+    if (UPGRADE_SOCKET.empty()) return;
+    if (IO_ENGINE == IoEngine::Uring) {
+        log_event(LogLevel::Warn, {"UPGRADE_SOCKET: IO_ENGINE=uring can take over but not hand over; not listening"});
+        return;
+    }
+    struct sockaddr_un address;
+    if (!handoff_address(address)) {
+        log_event(LogLevel::Warn, {"UPGRADE_SOCKET path is too long: ", UPGRADE_SOCKET});
+        return;
+    }
+    unlink(UPGRADE_SOCKET.c_str()); // Left by the server we replaced, or one that crashed
+    socket_t fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == INVALID_SOCKET || bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 1) != 0) {
+        log_event(LogLevel::Warn, {"Cannot listen on UPGRADE_SOCKET ", UPGRADE_SOCKET, ": ", strerror(errno)});
+        if (fd != INVALID_SOCKET) close_socket(fd);
+        return;
+    }
+    std::thread(handoff_accept_loop, fd).detach();
+}
+
+// Connects to the server on UPGRADE_SOCKET, if one is running, and takes
+// everything it hands over (main, before binding). False if there is
+// nobody to take over from. A handoff cut short keeps what arrived; the old
+// server drains the rest. An old server that stops answering is given
+// UPGRADE_HELLO_TIMEOUT_MS per read up to COMMIT, and DRAIN_TIMEOUT_MS (plus
+// the same again as slack) for everything after.
+bool handoff_receive(HandoffIntake& intake) {
+    struct sockaddr_un address;
+    if (!handoff_address(address)) return false;
+    socket_t fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == INVALID_SOCKET) return false;
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close_socket(fd);
+        return false;
+    }
+    handoff_read_timeout(fd, UPGRADE_HELLO_TIMEOUT_MS);
+    unsigned char type = 0;
+    std::string payload;
+    socket_t attached;
+    bool hello = handoff_write(fd, HANDOFF_HELLO, std::string(1, (char)HANDOFF_VERSION), INVALID_SOCKET) &&
+                 handoff_read(fd, type, payload, attached) && type == HANDOFF_HELLO;
+    if (attached != INVALID_SOCKET) close_socket(attached);
+    HandoffReader in(payload);
+    unsigned char version = in.u8();
+    uint32_t listeners = in.u32();
+    if (!hello || !in.ok || version != HANDOFF_VERSION || listeners == 0) {
+        close_socket(fd);
+        if (!hello) {
+            std::cerr << "The server on " << UPGRADE_SOCKET << " did not answer HELLO; not taking over." << std::endl;
+            return false;
+        }
+        std::cerr << "The server on " << UPGRADE_SOCKET << " can't hand over to this version";
+        if (in.ok) std::cerr << " (handoff version " << (int)version << ", this one " << (int)HANDOFF_VERSION << ")";
+        std::cerr << "; it keeps serving." << std::endl;
+        return false;
+    }
+    // Nothing is committed until the old server answers READY with COMMIT:
+    // a failure up to then leaves it serving, and this one closes its copies
+    bool taken = true;
+    for (uint32_t i = 0; i < listeners && taken; ++i) {
+        taken = handoff_read(fd, type, payload, attached) && type == HANDOFF_LISTENER &&
+                handoff_take(intake, type, payload, attached);
+        if (attached != INVALID_SOCKET) close_socket(attached);
+    }
+    taken = taken && handoff_write(fd, HANDOFF_READY, "", INVALID_SOCKET);
+    if (taken) {
+        taken = handoff_read(fd, type, payload, attached) && type == HANDOFF_COMMIT;
+        if (attached != INVALID_SOCKET) close_socket(attached);
+    }
+    if (!taken) {
+        for (socket_t listener : intake.listeners) close_socket(listener);
+        intake.listeners.clear();
+        close_socket(fd);
+        std::cerr << "Upgrade handoff from " << UPGRADE_SOCKET << " failed before it started; it keeps serving." << std::endl;
+        return false;
+    }
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(DRAIN_TIMEOUT_MS + UPGRADE_HELLO_TIMEOUT_MS);
+    bool done = false;
+    while (!done) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (left.count() <= 0) break;
+        handoff_read_timeout(fd, (long)left.count());
+        if (!handoff_read(fd, type, payload, attached)) break;
+        if (!handoff_take(intake, type, payload, attached)) {
+            log_event(LogLevel::Warn, {"Skipping a malformed upgrade handoff record"});
+        }
+        if (attached != INVALID_SOCKET) close_socket(attached);
+        done = type == HANDOFF_DONE;
+    }
+    close_socket(fd);
+    if (!done) log_event(LogLevel::Warn, {"Upgrade handoff was cut short; keeping what arrived"});
+    return true;
+}
+
+#else // _WIN32: no Unix domain socket handoff
+
+bool handoff_write(socket_t, unsigned char, const std::string&, socket_t) {
+    return false;
+}
+
+void handoff_listen() {}
+
+bool handoff_receive(HandoffIntake&) {
+    std::cerr << "UPGRADE_SOCKET is not supported on Windows." << std::endl;
+    return false;
+}
+
+#endif
+
+bool queue_output(const SessionPtr& session, const MessageRef& message);
+void cluster_relay(const Room& room, const Message& message);
+void cluster_interest(const std::string& room, bool has_members);
+
+// One window's roster update for a room, shared by every reactor with
+// members there; each member gets whichever part fits it
+struct PresenceUpdate {
+    const Room* room;
+    uint64_t version;  // Roster version it brings members to
+    MessageRef frame;  // PRESENCE frames for version 3 clients, null if nothing changed
+    MessageRef text;   // The same changes as a notice for older clients
+    MessageRef roster; // ROSTER frames for members that just entered, null if none did
+    std::vector<std::string> joined, left; // The names text is made of
+};
+
+// A slice of a room broadcast handed to the reactor owning those members
+struct FanoutJob : MpscNode {
+    MemberList members;
+    MessageRef message;
+    const Session* sender;
+    std::shared_ptr<const PresenceUpdate> presence; // Sent instead of message if set
+
+    static void* operator new(size_t bytes) { return slab_alloc(bytes); }
+    static void operator delete(void* p) { slab_free(p); }
+};
+
+// A fixed set of these multiplexes every client socket. Each one runs its own
+// poll loop on a dedicated thread and exclusively owns the sessions attached
+// to it.
+class Reactor {
+public:
+    explicit Reactor(int index)
+        : index_(index), listen_fd_(INVALID_SOCKET), wake_pending_(false), drain_requested_(false),
+          draining_(false), deferred_head_(0) {}
+
+    void start() { thread_ = std::thread(&Reactor::run, this); }
+    void join() { thread_.join(); }
+
+    // Accepts connections from fd on this reactor's thread (reuseport mode);
+    // call before start()
+    bool listen_on(socket_t fd);
+
+    // Hands a freshly accepted socket to this reactor (any thread)
+    void attach(const SessionPtr& session);
+    // Asks the owner to drain the session's outbox (any thread)
+    void schedule_flush(const SessionPtr& session);
+    // Queues message to this reactor's share of a room (any thread)
+    void post_fanout(const MemberList& members, const MessageRef& message, const Session* sender);
+    // Queues a roster update to this reactor's share of a room (any thread)
+    void post_presence(const MemberList& members, const std::shared_ptr<const PresenceUpdate>& update);
+    // Sends room's roster update PRESENCE_WINDOW_MS from now (owner of the
+    // calling thread only)
+    void schedule_presence(const RoomPtr& room);
+    // Gives a session parked on disconnect RESUME_GRACE_MS to come back
+    // (owner only)
+    void hold_for_resume(const std::string& token);
+    // Starts this reactor's part of a shutdown (any thread); run() returns
+    // once every session is closed, flushed or cut off at deadline
+    void drain(std::chrono::steady_clock::time_point deadline);
+
+    int index() const { return index_; }
+
+private:
+    void notify(const SessionPtr& session);
+    void wake();
+    void post_job(FanoutJob* job);
+    void run();
+    void accept_ready();
+    void adopt(const SessionPtr& session);
+    void drain_mailbox();
+    void send_outgoing();
+    void request_flush(const SessionPtr& session);
+    void flush_due();
+    void expire_timers();
+    void idle_expired(const SessionPtr& session);
+    void stall_expired(const SessionPtr& session);
+    void output_waiting(Session& session);
+    void expire_resumes();
+    void begin_drain();
+    bool hand_off(const SessionPtr& session);
+    void close_drained();
+    int next_timeout_ms() const;
+    bool handle_events(const PollEvent* events, int n);
+    bool end_iteration();
+    bool continue_tls(const SessionPtr& session);
+    void on_readable(const SessionPtr& session);
+    bool deliver(const SessionPtr& session, const char* data, size_t len);
+    void flush(const SessionPtr& session);
+    int gather_output(Session& session, io_slice* slices);
+    void advance_output(Session& session, size_t sent);
+    void close_session(const SessionPtr& session);
+#if defined(CHAT_URING)
+    void run_ring();
+    bool ring_arm_poller();
+    void ring_accept_via_poller();
+    void ring_accepted(const io_uring_cqe& cqe);
+    void ring_completed(const io_uring_cqe& cqe);
+    void ring_flush(const SessionPtr& session);
+    void ring_close_doomed();
+#endif
+
+    int index_;
+    Poller poller_;
+    std::thread thread_;
+    socket_t listen_fd_;
+    char listen_token_; // Poller token for listen_fd_; only its address is used
+    std::unordered_map<Session*, SessionPtr> sessions_;
+    // Closed sessions stay alive until the current batch of events is done
+    std::vector<SessionPtr> graveyard_;
+
+    MpscList mailbox_;
+    MpscList jobs_;
+    std::atomic<bool> wake_pending_;
+    std::atomic<bool> drain_requested_;
+    std::chrono::steady_clock::time_point drain_deadline_; // Published by drain_requested_
+    bool draining_;
+    std::vector<SessionPtr> drain_batch_;
+    // Fan-out jobs this thread made for other reactors during the current
+    // iteration, one chain per target, handed over in one push and one
+    // wakeup each by send_outgoing()
+    struct JobChain {
+        MpscNode* first;
+        MpscNode* last;
+    };
+    std::vector<JobChain> outgoing_;
+    std::vector<SessionPtr> local_flushes_;
+    std::vector<SessionPtr> flush_batch_; // Swapped with local_flushes_ so neither reallocates
+    // Sessions holding output for the flush window, in deadline order. A
+    // vector consumed from deferred_head_ rather than a deque, whose blocks
+    // would be allocated and freed as the queue cycles.
+    std::vector<SessionPtr> deferred_;
+    size_t deferred_head_;
+    // Handshake, heartbeat and write stall timeouts of our sessions, and
+    // presence_timer_ for the rooms in presence_due_
+    TimerWheel timers_;
+    Timer presence_timer_;
+    std::vector<RoomPtr> presence_due_;
+    // Tokens of sessions parked here, in deadline order (likewise)
+    struct ResumeTimer {
+        std::string token;
+        std::chrono::steady_clock::time_point deadline;
+    };
+    std::deque<ResumeTimer> resume_timers_;
+#if defined(CHAT_URING)
+    Ring ring_;
+    bool ring_on_ = false; // run_ring() is the loop; set once the ring is up
+    bool ring_poller_armed_ = false; // A POLL_ADD on the epoll set is with the kernel
+    bool ring_poller_stuck_ = false; // The last try to queue one failed
+    // Closed sessions the kernel still has requests for, kept alive (and
+    // their address unused) until the last completion
+    std::unordered_map<Session*, SessionPtr> ring_closing_;
+    // Sockets of sessions closed this iteration. Shut down after the next
+    // submit, so sends queued before the close still go out, and the
+    // shutdown ends the requests still waiting on them.
+    std::vector<socket_t> ring_doomed_;
+#endif
+};
+
+thread_local Reactor* current_reactor = nullptr;
+
+std::vector<std::unique_ptr<Reactor>> reactors;
+
+// block's members in a fresh block with room for as many again; caller
+// holds rooms_mutex
+std::shared_ptr<MemberBlock> member_compact(const MemberBlock& block) {
+    size_t live = block.live.load(std::memory_order_relaxed);
+    std::shared_ptr<MemberBlock> next = std::make_shared<MemberBlock>(std::max<size_t>(8, live * 2));
+    size_t used = 0;
+    for (size_t i = 0; i < block.used.load(std::memory_order_relaxed); ++i) {
+        const MemberBlock::Slot& slot = block.slots[i];
+        if (!slot.live.load(std::memory_order_relaxed)) continue;
+        next->slots[used].session = slot.session;
+        next->slots[used].live.store(true, std::memory_order_relaxed);
+        slot.session->member_slot = used++;
+    }
+    next->used.store(used, std::memory_order_relaxed);
+    next->live.store(live, std::memory_order_relaxed);
+    return next;
+}
+
+// Caller holds rooms_mutex
+void room_update(Room& room, const SessionPtr& session, bool add) {
+    std::shared_ptr<MemberBlock>& shard = room.shards[session->owner->index()];
+    size_t before;
+    if (add) {
+        if (shard->used.load(std::memory_order_relaxed) == shard->capacity) {
+            std::atomic_store(&shard, member_compact(*shard));
+        }
+        size_t slot = shard->used.load(std::memory_order_relaxed);
+        shard->slots[slot].session = session;
+        shard->slots[slot].live.store(true, std::memory_order_relaxed);
+        session->member_slot = slot;
+        shard->live.fetch_add(1, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> order(room.order_mutex);
+            shard->used.store(slot + 1, std::memory_order_release);
+            session->joined_seq = line_seq.load();
+        }
+        before = room.member_count.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        shard->slots[session->member_slot].live.store(false, std::memory_order_relaxed);
+        size_t live = shard->live.fetch_sub(1, std::memory_order_relaxed) - 1;
+        if (shard->used.load(std::memory_order_relaxed) - live > live) {
+            std::atomic_store(&shard, member_compact(*shard));
+        }
+        before = room.member_count.fetch_sub(1, std::memory_order_relaxed);
+    }
+    // Peer nodes only relay a room to us while it has members here
+    if (before == (add ? 0 : 1)) cluster_interest(room.name, add);
+}
+
+// Moves session into the named room (created on demand) and returns it;
+// empty rooms other than the lobby are dropped from the directory
+RoomPtr room_move(const SessionPtr& session, const std::string& name) {
+    std::lock_guard<std::mutex> lock(rooms_mutex);
+    if (session->room) {
+        room_update(*session->room, session, false);
+        if (session->room != lobby && session->room->member_count.load() == 0) rooms.erase(session->room->name);
+        session->room.reset();
+    }
+    if (name.empty()) return nullptr;
+    RoomPtr& room = rooms[name];
+    if (!room) {
+        room = std::make_shared<Room>(name, reactors.size());
+        journal_warm_up(*room);
+    }
+    room_update(*room, session, true);
+    session->room = room;
+    return room;
+}
+
+// Puts a resumed session back into the room it was parked from. If nobody
+// reopened that room while it stood empty, the same room, history and all,
+// goes back into the directory.
+RoomPtr room_restore(const SessionPtr& session, const RoomPtr& parked) {
+    std::lock_guard<std::mutex> lock(rooms_mutex);
+    RoomPtr& room = rooms[parked->name];
+    if (!room) room = parked;
+    room_update(*room, session, true);
+    session->room = room;
+    return room;
+}
+
+void fan_out(const MemberList& members, const MessageRef& message, const Session* sender) {
+    members.for_each([&](const SessionPtr& session) {
+        if (session.get() != sender) {
+            queue_output(session, message);
+        }
+    });
+}
+
+// update's notice without name in it; null if that leaves nothing to say
+MessageRef presence_notice_without(const PresenceUpdate& update, const std::string& name) {
+    std::vector<std::string> joined, left;
+    for (const std::string& other : update.joined) {
+        if (other != name) joined.push_back(other);
+    }
+    for (const std::string& other : update.left) {
+        if (other != name) left.push_back(other);
+    }
+    if (joined.empty() && left.empty()) return MessageRef();
+    if (joined.size() == update.joined.size() && left.size() == update.left.size()) return update.text;
+    return Message::text(presence_summary(update.room->name, joined.data(), joined.size(), left.data(), left.size()));
+}
+
+// Runs on the members' owner. A member that just entered the room skips the
+// changes up to its own entry and gets the roster instead, if it can read
+// one. Older clients have no roster to catch up from, so they get the
+// window's notice less their own entry, if anything changed after it.
+// Everyone else gets the changes.
+void fan_out_presence(const MemberList& members, const PresenceUpdate& update) {
+    members.for_each([&](const SessionPtr& session) {
+        if (session->room.get() != update.room) return; // Moved on since the shard was read
+        if (session->roster_wanted) {
+            // Wait for an update that covers our entry (and has the roster, if we read one)
+            if (update.version < session->roster_from || (session->version >= 3 && !update.roster)) return;
+            session->roster_wanted = false;
+            if (session->version >= 3) {
+                queue_output(session, update.roster);
+            } else if (update.version > session->roster_from && update.text) {
+                MessageRef notice = presence_notice_without(update, session->username);
+                if (notice) queue_output(session, notice);
+            }
+            return;
+        }
+        const MessageRef& changes = session->version >= 3 ? update.frame : update.text;
+        if (changes) queue_output(session, changes);
+    });
+}
+
+// This thread's scratch list of a room's shards, views[i] being
+// reactors[i]'s share; empty between broadcasts
+std::vector<MemberList>& member_views() {
+    thread_local std::vector<MemberList> views;
+    return views;
+}
+
+// Numbers a chat line for room and takes the members it goes to into views
+// in the same step
+uint64_t room_number_line(const Room& room, std::vector<MemberList>& views) {
+    std::lock_guard<std::mutex> order(room.order_mutex);
+    for (const auto& shard : room.shards) views.emplace_back(std::atomic_load(&shard));
+    return next_line_seq();
+}
+
+// Delivers to the members in views and empties it
+void deliver_local(std::vector<MemberList>& views, const MessageRef& message, const Session* sender) {
+    for (size_t i = 0; i < views.size(); ++i) {
+        if (views[i].empty_but(sender)) continue;
+        Reactor* target = reactors[i].get();
+        if (target == current_reactor) fan_out(views[i], message, sender);
+        else target->post_fanout(views[i], message, sender);
+    }
+    views.clear();
+}
+
+// Delivers to the room's members on this node only
+void broadcast_local(const Room& room, const MessageRef& message, const Session* sender = nullptr) {
+    std::vector<MemberList>& views = member_views();
+    for (const auto& shard : room.shards) views.emplace_back(std::atomic_load(&shard));
+    deliver_local(views, message, sender);
+}
+
+// Function to broadcast a message to everyone in a room except the sender,
+// here and on every peer node with members in the room
+void broadcast_message(const Room& room, const MessageRef& message, const Session* sender = nullptr) {
+    broadcast_local(room, message, sender);
+    cluster_relay(room, *message);
+}
+
+void broadcast_message(const Room& room, const std::string& message, const Session* sender = nullptr) {
+    broadcast_message(room, Message::text(message), sender);
+}
+
+// ---------------------------------------------------------------------------
+// Presence: each room keeps a versioned roster of its members here. A member
+// entering gets the whole roster once, in ROSTER frames; after that joins
+// and leaves reach the room in batches, one update per PRESENCE_WINDOW_MS
+// that had changes, as PRESENCE frames for version 3 clients and a notice
+// for the rest. Peer nodes get the notice only; a roster covers this node.
+// ---------------------------------------------------------------------------
+
+// Frames of type for payload, started by prefix and continued by entries as
+// they fit under MAX_FRAME_SIZE. set_first(frame_payload, first) marks each
+// frame's place in the run. An entry too long for any frame (a name near
+// the line limit) is left out.
+template <typename SetFirst>
+std::string encode_presence_frames(unsigned char type, const std::string& prefix, const std::vector<std::string>& entries,
+                                   SetFirst&& set_first) {
+    std::string out;
+    std::string payload = prefix;
+    bool first = true;
+    auto emit = [&]() {
+        set_first(payload, first);
+        out += encode_frame(type, payload);
+        payload = prefix;
+        first = false;
+    };
+    for (const std::string& entry : entries) {
+        if (prefix.size() + entry.size() + 1 > MAX_FRAME_SIZE) continue;
+        if (payload.size() + entry.size() + 1 > MAX_FRAME_SIZE) emit();
+        payload += entry;
+    }
+    if (first || payload.size() > prefix.size()) emit();
+    return out;
+}
+
+std::string presence_prefix(uint64_t version, const std::string& room, bool with_flags) {
+    std::string prefix(8, '\0');
+    put_u64_be(&prefix[0], version);
+    if (with_flags) prefix.push_back('\0');
+    prefix.push_back((char)room.size());
+    return prefix + room;
+}
+
+void append_presence_name(std::string& out, const std::string& name) {
+    out.push_back((char)(name.size() >> 8));
+    out.push_back((char)(name.size() & 0xff));
+    out += name;
+}
+
+// Caller holds rooms_mutex
+void presence_note(Room& room, const std::string& name, bool present) {
+    ++room.roster_version;
+    auto it = room.roster_changes.find(name);
+    if (it != room.roster_changes.end()) room.roster_changes.erase(it);
+    else room.roster_changes[name] = present;
+    metrics().add(Counter::PresenceChanges);
+}
+
+void presence_send(const RoomPtr& room);
+
+// Queues room's next update on this thread's reactor, or sends it at once
+// from any other thread or with batching off
+void presence_schedule(const RoomPtr& room) {
+    if (current_reactor != nullptr && tuning().presence_window_ms > 0) current_reactor->schedule_presence(room);
+    else presence_send(room);
+}
+
+// session entered room (owner only); the next update brings its roster
+void presence_enter(const SessionPtr& session, const RoomPtr& room) {
+    bool schedule;
+    {
+        std::lock_guard<std::mutex> lock(rooms_mutex);
+        if (room->roster.insert(session->username).second) presence_note(*room, session->username, true);
+        if (session->version >= 3) ++room->roster_wanted;
+        session->roster_wanted = true;
+        session->roster_from = room->roster_version;
+        schedule = !room->presence_scheduled;
+        room->presence_scheduled = true;
+    }
+    if (schedule) presence_schedule(room);
+}
+
+void presence_leave(const RoomPtr& room, const std::string& name) {
+    bool schedule = false;
+    {
+        std::lock_guard<std::mutex> lock(rooms_mutex);
+        if (room->roster.erase(name) == 0) return;
+        presence_note(*room, name, false);
+        schedule = !room->presence_scheduled;
+        room->presence_scheduled = true;
+    }
+    if (schedule) presence_schedule(room);
+}
+
+// Sends the changes since room's last update, and its roster if anyone is
+// waiting for one
+void presence_send(const RoomPtr& room) {
+    std::map<std::string, bool> changes;
+    std::vector<std::string> names;
+    uint64_t version;
+    bool roster = false;
+    {
+        std::lock_guard<std::mutex> lock(rooms_mutex);
+        room->presence_scheduled = false;
+        changes.swap(room->roster_changes);
+        version = room->roster_version;
+        if (room->roster_wanted > 0) {
+            room->roster_wanted = 0;
+            roster = true;
+            names.reserve(room->roster.size());
+            for (const std::string& name : room->roster) {
+                names.emplace_back();
+                append_presence_name(names.back(), name);
+            }
+        }
+    }
+    // Everyone is being disconnected during a drain; spare the rest the noise
+    if (draining.load() || (changes.empty() && !roster)) return;
+
+    auto update = std::make_shared<PresenceUpdate>();
+    update->room = room.get();
+    update->version = version;
+    if (roster) {
+        update->roster = Message::raw(encode_presence_frames(FRAME_ROSTER, presence_prefix(version, room->name, true),
+                                                             names, [](std::string& payload, bool first) {
+                                                                 payload[8] = first ? 1 : 0;
+                                                             }));
+    }
+    if (!changes.empty()) {
+        std::vector<std::string> entries, joined, left;
+        for (const auto& change : changes) {
+            entries.emplace_back(1, change.second ? '+' : '-');
+            append_presence_name(entries.back(), change.first);
+            (change.second ? joined : left).push_back(change.first);
+        }
+        update->frame = Message::raw(encode_presence_frames(FRAME_PRESENCE, presence_prefix(version, room->name, false),
+                                                            entries, [](std::string&, bool) {}));
+        update->text = Message::text(presence_summary(room->name, joined.data(), joined.size(), left.data(), left.size()));
+        update->joined.swap(joined);
+        update->left.swap(left);
+    }
+    metrics().add(Counter::PresenceUpdates);
+
+    for (size_t i = 0; i < room->shards.size(); ++i) {
+        MemberList members(std::atomic_load(&room->shards[i]));
+        if (members.empty_but(nullptr)) continue;
+        Reactor* target = reactors[i].get();
+        if (target == current_reactor) fan_out_presence(members, *update);
+        else target->post_presence(members, update);
+    }
+    if (update->text) cluster_relay(*room, *update->text);
+}
+
+// Caller has already added bytes to queued_bytes
+bool queue_try_push(Session& session, const MessageRef& message, size_t bytes) {
+    // A lone message larger than the byte limit still goes through
+    size_t queued = session.queued_bytes.load(std::memory_order_relaxed);
+    bool over_bytes = queued > (size_t)tuning().outbound_queue_bytes && queued != bytes;
+    return !over_bytes && session.outbox.push(message);
+}
+
+// Hands message to the session's owner for sending (any thread); false if
+// flow control dropped it instead
+bool queue_output(const SessionPtr& session, const MessageRef& message) {
+    size_t bytes = message->wire_size(session->format);
+    // Counted before the push so the owner's subtraction can't run first
+    session->queued_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    message->mark_queued();
+    bool queued = queue_try_push(*session, message, bytes);
+    if (!queued && tuning().overflow_policy == OverflowPolicy::DropOldest) {
+        // Evict from the head until the new message fits; pop() is safe
+        // alongside the owner's own draining
+        MessageRef oldest;
+        while (!queued && session->outbox.pop(oldest)) {
+            session->queued_bytes.fetch_sub(oldest->wire_size(session->format), std::memory_order_relaxed);
+            session->dropped.fetch_add(1, std::memory_order_relaxed);
+            metrics().add(Counter::DroppedOldest);
+            queued = queue_try_push(*session, message, bytes);
+        }
+    }
+    if (!queued) {
+        session->queued_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+        session->dropped.fetch_add(1, std::memory_order_relaxed);
+        if (tuning().overflow_policy == OverflowPolicy::Disconnect) {
+            // Slow consumer: the owner drops the connection on its next flush
+            if (!session->overflowed.exchange(true)) metrics().add(Counter::SlowConsumers);
+        } else {
+            // Drop rather than stall the sender
+            metrics().add(Counter::DroppedNewest);
+        }
+    }
+    if (!session->flush_scheduled.exchange(true)) {
+        session->owner->schedule_flush(session);
+    }
+    return queued;
+}
+
+void queue_output(const SessionPtr& session, const std::string& data) {
+    queue_output(session, Message::text(data));
+}
+
+// Keeps a chat line for later joiners and, with JOURNAL_DIR set, on disk.
+// Both hold a copy so the original's delivery clock isn't held up.
+void room_remember(Room& room, const Message& line) {
+    if (HISTORY_DEPTH <= 0 && JOURNAL_DIR.empty()) return;
+    MessageRef copy = Message::copy_of(line);
+    room.history.record(copy);
+    journal_append(room, copy);
+}
+
+// Queues the room's recent lines for someone who just joined it (a resuming
+// client: only the ones numbered above after_seq). They reach the outbox back
+// to back, so its next flush gathers them into one writev. Lines numbered
+// after the session's joined_seq reach it live, and may be recorded by now,
+// so they are left out.
+void replay_history(const SessionPtr& session, const Room& room, uint64_t after_seq = 0) {
+    if (HISTORY_DEPTH <= 0) return;
+    std::vector<MessageRef> lines;
+    room.history.snapshot(lines, session->joined_seq, after_seq);
+    for (const MessageRef& line : lines) queue_output(session, line);
+}
+
+// Trims trailing whitespace the way every handshake and chat line is cleaned up
+std::string trim_line(const char* data, size_t len) {
+    return std::string(data, scan_trim_right(data, len));
+}
+
+// Version 2 clients get a fresh resume token with every login and resume
+void session_issue_token(const SessionPtr& session) {
+    if (!is_sequenced(session->format) || RESUME_GRACE_MS <= 0) return;
+    session->resume_token = resumes.issue();
+    queue_output(session, Message::raw(encode_frame(FRAME_SESSION, session->resume_token)));
+}
+
+// Text and version 1 or 2 clients can't answer PING, so once one logs in the
+// kernel watches its socket instead; probes only go out on a quiet socket
+void session_keepalive(const Session& session) {
+    const Tuning& limits = tuning();
+    if (limits.heartbeat_interval_ms <= 0 || session.version >= 3) return;
+    set_tcp_keepalive(session.fd, std::max(1, limits.heartbeat_interval_ms / 1000),
+                      std::max(1, limits.heartbeat_timeout_ms / 3000), 3);
+}
+
+// 1-2. Username handshake and registration
+void session_register(const SessionPtr& session, const char* data, size_t len) {
+    std::string username = trim_line(data, len);
+    if (username.empty() || !scan_utf8_valid(username.data(), username.size())) username = "Anonymous";
+    // /msg ends the recipient list at the first space and splits it at
+    // commas, so neither may be part of a name
+    for (char& c : username) {
+        if (c == ',' || isspace((unsigned char)c)) c = '_';
+    }
+    if (username.size() > MAX_USERNAME) {
+        // Cut between characters, so every notice naming us still fits a frame
+        size_t cut = MAX_USERNAME;
+        while (cut > 0 && ((unsigned char)username[cut] & 0xc0) == 0x80) --cut;
+        username.resize(cut);
+    }
+
+    // Handle duplicate names
+    session->username = users.claim(username, session);
+    session->shared_name = std::make_shared<const std::string>(session->username);
+    session->state = SessionState::Chatting;
+    session_keepalive(*session);
+    room_move(session, DEFAULT_ROOM);
+
+    log_event(LogLevel::Info, {"User connected: ", session->username, " (Socket: ", std::to_string(session->fd), ")"});
+    queue_output(session, "Welcome, " + session->username + "!");
+    session_issue_token(session);
+    replay_history(session, *session->room);
+    presence_enter(session, session->room);
+}
+
+// 2b. RESUME instead of LOGIN: takes back a parked session's name and room
+// and replays only the lines numbered above the client's newest. An unknown
+// or expired token falls back to a plain login with the username sent along.
+void session_resume(const SessionPtr& session, const char* payload, size_t len) {
+    if (len < 9 || len - 9 < (unsigned char)payload[8]) {
+        session_register(session, "", 0);
+        return;
+    }
+    uint64_t last_seq = get_u64_be(payload);
+    size_t token_len = (unsigned char)payload[8];
+    std::string token(payload + 9, token_len);
+    ParkedSession parked;
+    if (token.empty() || !resumes.take(token, parked)) {
+        queue_output(session, "Your previous session has expired; logging in again.");
+        session_register(session, payload + 9 + token_len, len - 9 - token_len);
+        return;
+    }
+
+    session->username = parked.username;
+    session->shared_name = parked.shared_name;
+    users.rebind(session->username, session);
+    session->state = SessionState::Chatting;
+    session_keepalive(*session);
+    RoomPtr room = room_restore(session, parked.room);
+
+    log_event(LogLevel::Info, {"User resumed: ", session->username, " (Socket: ", std::to_string(session->fd), ")"});
+    queue_output(session, "Welcome back, " + session->username + "!");
+    session_issue_token(session);
+    replay_history(session, *parked.room, last_seq);
+    if (room != parked.room) replay_history(session, *room, last_seq);
+    // Still on the roster unless the room was reopened; a fresh copy either way
+    presence_enter(session, room);
+}
+
+bool valid_room_name(const std::string& name) {
+    if (name.empty() || name.size() > MAX_ROOM_NAME) return false;
+    for (char c : name) {
+        if (!isalnum((unsigned char)c) && c != '_' && c != '-') return false;
+    }
+    return true;
+}
+
+void session_join_room(const SessionPtr& session, const std::string& name) {
+    if (session->room->name == name) {
+        queue_output(session, "You are already in #" + name + ".");
+        return;
+    }
+    RoomPtr old_room = session->room;
+    RoomPtr room = room_move(session, name);
+    presence_leave(old_room, session->username);
+    queue_output(session, "Now chatting in #" + name + " (" + std::to_string(room->member_count.load()) + " online).");
+    replay_history(session, *room);
+    presence_enter(session, room);
+}
+
+void session_list_rooms(const SessionPtr& session) {
+    std::string listing = "Rooms:";
+    {
+        std::lock_guard<std::mutex> lock(rooms_mutex);
+        for (const auto& pair : rooms) {
+            listing += " #" + pair.first + " (" + std::to_string(pair.second->member_count.load()) + ")";
+        }
+    }
+    queue_output(session, listing);
+}
+
+// /who: the current room's roster, in lines of up to about 4 KiB
+void session_list_members(const SessionPtr& session) {
+    const size_t LINE_BYTES = 4096;
+    std::vector<std::string> names;
+    {
+        std::lock_guard<std::mutex> lock(rooms_mutex);
+        names.assign(session->room->roster.begin(), session->room->roster.end());
+    }
+    const std::string header = "In #" + session->room->name + " (" + std::to_string(names.size()) + "):";
+    std::string line = header;
+    for (const std::string& name : names) {
+        if (line.size() > header.size() && line.size() + name.size() + 2 > LINE_BYTES) {
+            queue_output(session, line);
+            line = header;
+        }
+        line += (line.size() == header.size() ? " " : ", ") + name;
+    }
+    queue_output(session, line);
+}
+
+// /msg <user>[,<user>...] <text>: one copy of the line, queued straight to
+// each recipient through the user directory, so no room member list or
+// client table is walked. The sender gets one receipt for the whole batch.
+const size_t MAX_MSG_TARGETS = 16;
+
+void session_private_message(const SessionPtr& session, const std::string& arg) {
+    size_t space = arg.find(' ');
+    size_t start = space == std::string::npos ? space : arg.find_first_not_of(' ', space);
+    std::vector<std::string> names;
+    if (start != std::string::npos) {
+        for (size_t begin = 0; begin < space;) {
+            size_t comma = std::min(arg.find(',', begin), space);
+            std::string name = arg.substr(begin, comma - begin);
+            begin = comma + 1;
+            if (!name.empty() && std::find(names.begin(), names.end(), name) == names.end()) names.push_back(name);
+        }
+    }
+    if (names.empty() || names.size() > MAX_MSG_TARGETS) {
+        queue_output(session, "Usage: /msg <user>[,<user>...] <message> (up to " +
+                              std::to_string(MAX_MSG_TARGETS) + " users)");
+        return;
+    }
+
+    std::vector<std::pair<std::string, SessionPtr>> targets;
+    std::string to, away, offline;
+    for (const std::string& name : names) {
+        bool held = false;
+        SessionPtr target = users.find(name, &held);
+        std::string& list = target ? to : held ? away : offline;
+        if (!list.empty()) list += ", ";
+        list += name;
+        if (target) targets.emplace_back(name, std::move(target));
+    }
+    std::string sent, dropped;
+    if (!targets.empty()) {
+        std::string prefix = "[" + session->username + " -> " + to + "]: ";
+        if (prefix.size() + arg.size() - start > MAX_LINE_SIZE) {
+            queue_output(session, "Message dropped: longer than " + std::to_string(MAX_LINE_SIZE - prefix.size()) +
+                                  " bytes for these recipients.");
+            return;
+        }
+        log_event(LogLevel::Debug, {"Private message from ", session->username, " to ", to, ": ",
+                                    LogPiece(arg.data() + start, arg.size() - start)});
+        MessageRef line = Message::text(prefix + arg.substr(start));
+        for (const auto& target : targets) {
+            bool queued = queue_output(target.second, line);
+            if (queued) metrics().add(Counter::PrivateMessages);
+            std::string& list = queued ? sent : dropped;
+            if (!list.empty()) list += ", ";
+            list += target.first;
+        }
+    }
+    std::string receipt;
+    auto note = [&receipt](const std::string& text) { receipt += (receipt.empty() ? "" : " ") + text; };
+    if (!sent.empty()) note("Queued for " + sent + ".");
+    if (!dropped.empty()) note("Not sent to " + dropped + " (too far behind).");
+    if (!away.empty()) note("Not sent to " + away + " (away, held for resume).");
+    if (!offline.empty()) note("Not online: " + offline + ".");
+    queue_output(session, receipt);
+}
+
+// Chat lines starting with '/' are commands for the server
+void session_command(const SessionPtr& session, const std::string& line) {
+    size_t space = line.find(' ');
+    std::string command = line.substr(0, space);
+    std::string arg;
+    if (space != std::string::npos) {
+        size_t start = line.find_first_not_of(' ', space);
+        if (start != std::string::npos) arg = line.substr(start);
+    }
+
+    if (command == "/join") {
+        if (!valid_room_name(arg)) {
+            queue_output(session, "Usage: /join <room> (letters, digits, '-' and '_', up to 32)");
+            return;
+        }
+        session_join_room(session, arg);
+    } else if (command == "/leave") {
+        if (session->room == lobby) queue_output(session, "You are already in the lobby.");
+        else session_join_room(session, DEFAULT_ROOM);
+    } else if (command == "/rooms") {
+        session_list_rooms(session);
+    } else if (command == "/who") {
+        session_list_members(session);
+    } else if (command == "/msg") {
+        session_private_message(session, arg);
+    } else if (command == "/quit") {
+        session->resume_token.clear(); // Leaving for good: no resume window
+        queue_output(session, "Goodbye.");
+        session->hangup = true;
+    } else {
+        queue_output(session, "Unknown command: " + command + ". Try /join <room>, /leave, /rooms, /who, /msg <user> <message> or /quit.");
+    }
+}
+
+// 3. One chat line from a registered client
+// Token bucket on inbound messages; refuses the message when it is empty
+bool session_rate_allows(Session& session) {
+    const Tuning& limits = tuning();
+    if (limits.msg_rate <= 0) return true;
+    double burst = limits.msg_burst > 0 ? limits.msg_burst : limits.msg_rate;
+    auto now = std::chrono::steady_clock::now();
+    if (session.msg_tokens < 0) {
+        session.msg_tokens = burst;
+    } else {
+        std::chrono::duration<double> elapsed = now - session.msg_refill;
+        session.msg_tokens = std::min(burst, session.msg_tokens + elapsed.count() * limits.msg_rate);
+    }
+    session.msg_refill = now;
+    if (session.msg_tokens >= 1.0) {
+        session.msg_tokens -= 1.0;
+        session.rate_warned = false;
+        return true;
+    }
+    ++session.rate_limited;
+    metrics().add(Counter::RateLimited);
+    return false;
+}
+
+void session_message(const SessionPtr& session, const char* data, size_t len) {
+    int64_t received_ns = monotonic_ns();
+    metrics().add(Counter::MessagesIn);
+    // Chat lines stay a slice of the read buffer until they are copied into
+    // their Message; only the rare command is turned into a string. Blank
+    // lines go before the rate check, so they cost no tokens.
+    len = scan_trim_right(data, len);
+    if (len == 0) return;
+    if (!session_rate_allows(*session)) {
+        if (!session->rate_warned) {
+            session->rate_warned = true;
+            queue_output(session, "You are sending messages too fast; some were dropped.");
+        }
+        return;
+    }
+
+    if (!scan_utf8_valid(data, len)) {
+        queue_output(session, "Message dropped: not valid UTF-8.");
+        return;
+    }
+
+    if (data[0] == '/') {
+        session_command(session, std::string(data, len));
+        return;
+    }
+
+    // "[name]: " goes in front, and the whole line must fit in a frame
+    size_t longest = MAX_LINE_SIZE - 4 - session->username.size();
+    if (len > longest) {
+        queue_output(session, "Message dropped: longer than " + std::to_string(longest) + " bytes.");
+        return;
+    }
+
+    log_event(LogLevel::Debug, {"Message from ", session->username, ": ", LogPiece(data, len)});
+
+    int64_t broadcast_start = monotonic_ns();
+    std::vector<MemberList>& members = member_views();
+    uint64_t seq = room_number_line(*session->room, members);
+    MessageRef line = Message::chat(session->shared_name, data, len, received_ns, seq);
+    deliver_local(members, line, session.get());
+    cluster_relay(*session->room, *line);
+    metrics().observe(Histogram::Broadcast, monotonic_ns() - broadcast_start);
+    room_remember(*session->room, *line);
+}
+
+// A complete line from a text-protocol client
+void session_on_line(const SessionPtr& session, const char* line, size_t len) {
+    if (session->state == SessionState::AwaitingUsername) session_register(session, line, len);
+    else if (session->state == SessionState::Chatting) session_message(session, line, len);
+}
+
+// Agrees to DEFLATE frames if the client asked for our codec. Nothing but raw
+// frames, which are the same size in every format, is queued before login,
+// so changing format here can't upset the queue's byte count.
+void session_negotiate_compression(const SessionPtr& session, const char* codec, size_t len) {
+    bool agreed = COMPRESSION && std::string(codec, len) == DEFLATE_CODEC;
+    if (agreed) session->format = WireFormat::Deflated;
+    queue_output(session, Message::raw(encode_frame(FRAME_COMPRESS, agreed ? DEFLATE_CODEC : "")));
+}
+
+// A complete frame from a framed client
+void session_on_frame(const SessionPtr& session, unsigned char type, const char* payload, size_t len) {
+    if (type == FRAME_LOGIN && session->state == SessionState::AwaitingUsername) {
+        session_register(session, payload, len);
+    } else if (type == FRAME_RESUME && session->state == SessionState::AwaitingUsername &&
+               is_sequenced(session->format)) {
+        session_resume(session, payload, len);
+    } else if (type == FRAME_COMPRESS && session->state == SessionState::AwaitingUsername &&
+               session->format == WireFormat::Sequenced) {
+        session_negotiate_compression(session, payload, len);
+    } else if (type == FRAME_CHAT && session->state == SessionState::Chatting) {
+        session_message(session, payload, len);
+    }
+    // PONG needs nothing more: every read counts as a heartbeat (Reactor::deliver)
+}
+
+// Feeds bytes read from the socket through the state machine. Returns false
+// when the peer violated the protocol and should be disconnected.
+bool session_on_data(const SessionPtr& session, const char* data, size_t len) {
+    if (session->state == SessionState::AwaitingHello) {
+        if (session->preamble.empty() && (unsigned char)data[0] != (unsigned char)PROTOCOL_MAGIC[0]) {
+            session->state = SessionState::AwaitingUsername; // Old text client
+        } else {
+            size_t take = std::min(len, PROTOCOL_PREAMBLE_SIZE - session->preamble.size());
+            session->preamble.append(data, take);
+            data += take;
+            len -= take;
+            if (session->preamble.size() < PROTOCOL_PREAMBLE_SIZE) return true;
+            unsigned char version = (unsigned char)session->preamble[PROTOCOL_MAGIC_SIZE];
+            if (memcmp(session->preamble.data(), PROTOCOL_MAGIC, PROTOCOL_MAGIC_SIZE) != 0 || version < 1) {
+                return false;
+            }
+            version = std::min(version, PROTOCOL_VERSION);
+            session->format = version >= 2 ? WireFormat::Sequenced : WireFormat::Framed;
+            session->version = version;
+            session->state = SessionState::AwaitingUsername;
+            queue_output(session, Message::raw(protocol_preamble(version)));
+        }
+    }
+
+    if (session->format != WireFormat::Text) {
+        return session->frames.feed(data, len, [&](unsigned char type, const char* payload, size_t n) {
+            session_on_frame(session, type, payload, n);
+        });
+    }
+    session->lines.feed(data, len, [&](const char* line, size_t n) {
+        session_on_line(session, line, n);
+    });
+    return true;
+}
+
+// 4. Disconnect
+void session_on_disconnect(const SessionPtr& session) {
+    bool registered = session->state == SessionState::Chatting;
+    session->state = SessionState::Closed;
+
+    // Clean up
+    {
+        ClientShard& shard = *clients[session->owner->index()];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        int64_t locked_at = monotonic_ns();
+        shard.sessions.erase(session->fd);
+        metrics().observe(Histogram::ClientsLock, monotonic_ns() - locked_at);
+    }
+    admission.release(session->peer_addr);
+
+    if (registered) {
+        RoomPtr room = session->room;
+        room_move(session, "");
+        if (!session->resume_token.empty() && !draining.load()) {
+            // Lost, not gone: hold the name and room for a resume, quietly
+            resumes.park(session->resume_token, ParkedSession{session->username, session->shared_name, room});
+            users.rebind(session->username, SessionPtr()); // Held, with nobody behind it until the resume
+            session->owner->hold_for_resume(session->resume_token);
+            log_event(LogLevel::Info, {"User dropped: ", session->username, " (held for resume)"});
+            return;
+        }
+        users.release(session->username);
+        log_event(LogLevel::Info, {"User disconnected: ", session->username});
+        uint64_t dropped = session->dropped.load(std::memory_order_relaxed);
+        if (dropped > 0 || session->rate_limited > 0) {
+            log_event(LogLevel::Warn, {"Flow control for ", session->username, ": ", std::to_string(dropped),
+                                       " outbound dropped, ", std::to_string(session->rate_limited),
+                                       " inbound rate limited"});
+        }
+        presence_leave(room, session->username);
+    }
+}
+
+// The resume window of a parked session ended; finishes its disconnect
+// unless the client came back first
+void session_resume_expired(const std::string& token) {
+    ParkedSession parked;
+    if (!resumes.take(token, parked)) return;
+    users.release(parked.username);
+    log_event(LogLevel::Info, {"User disconnected: ", parked.username, " (not resumed)"});
+    presence_leave(parked.room, parked.username);
+}
+
+// Admission control and client table entry for an accepted socket, from
+// either accept path. Rejected or unusable sockets are closed here and
+// nullptr is returned; otherwise the session still has to be attached to
+// owner.
+SessionPtr admit_connection(socket_t client_socket, const struct sockaddr_in& client_address, Reactor* owner) {
+    if (!set_nonblocking(client_socket)) {
+        close_socket(client_socket);
+        return nullptr;
+    }
+
+    // Reject before anything is allocated for the connection
+    uint32_t peer_addr = client_address.sin_addr.s_addr;
+    AdmissionControl::Verdict verdict = admission.admit(peer_addr);
+    if (verdict != AdmissionControl::Verdict::Admit) {
+        if (verdict == AdmissionControl::Verdict::RateLimited) {
+            log_event(LogLevel::Debug, {"Rate limited connection from ", format_ipv4(peer_addr)});
+        } else {
+            const char* msg = verdict == AdmissionControl::Verdict::ServerFull
+                                  ? "Server full.\n" : "Too many connections from your address.\n";
+            if (!tls_enabled()) send(client_socket, msg, strlen(msg), 0); // A TLS client couldn't read it
+            log_event(LogLevel::Debug, {"Rejected connection from ", format_ipv4(peer_addr)});
+        }
+        close_socket(client_socket);
+        return nullptr;
+    }
+
+    SessionPtr session = std::make_shared<Session>(client_socket, owner, peer_addr);
+    ClientShard& shard = *clients[owner->index()];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    int64_t locked_at = monotonic_ns();
+    shard.sessions[client_socket] = session;
+    metrics().observe(Histogram::ClientsLock, monotonic_ns() - locked_at);
+    return session;
+}
+
+void apply_tcp_policy(Session& session) {
+    TcpPolicy policy = TCP_POLICY;
+    if (policy == TcpPolicy::Auto) policy = tuning().flush_window_us > 0 ? TcpPolicy::NoDelay : TcpPolicy::Nagle;
+    if (policy == TcpPolicy::Cork && !set_tcp_cork(session.fd, false)) policy = TcpPolicy::NoDelay;
+    if (policy == TcpPolicy::NoDelay || policy == TcpPolicy::Cork) set_tcp_nodelay(session.fd, true);
+    session.tcp_policy = policy;
+}
+
+void Reactor::wake() {
+    if (!wake_pending_.exchange(true)) poller_.wakeup();
+}
+
+void Reactor::notify(const SessionPtr& session) {
+    session->mailbox_ref = session;
+    mailbox_.push(session.get());
+    wake();
+}
+
+void Reactor::post_fanout(const MemberList& members, const MessageRef& message, const Session* sender) {
+    FanoutJob* job = new FanoutJob();
+    job->members = members;
+    job->message = message;
+    job->sender = sender;
+    post_job(job);
+}
+
+void Reactor::post_presence(const MemberList& members, const std::shared_ptr<const PresenceUpdate>& update) {
+    FanoutJob* job = new FanoutJob();
+    job->members = members;
+    job->sender = nullptr;
+    job->presence = update;
+    post_job(job);
+}
+
+void Reactor::post_job(FanoutJob* job) {
+    if (current_reactor != nullptr) {
+        // A reactor thread: batched with its other jobs for us this iteration
+        Reactor::JobChain& chain = current_reactor->outgoing_[index_];
+        job->mpsc_next.store(nullptr, std::memory_order_relaxed);
+        if (chain.first == nullptr) chain.first = job;
+        else chain.last->mpsc_next.store(job, std::memory_order_relaxed);
+        chain.last = job;
+        return;
+    }
+    jobs_.push(job);
+    wake();
+}
+
+void Reactor::send_outgoing() {
+    for (size_t i = 0; i < outgoing_.size(); ++i) {
+        JobChain& chain = outgoing_[i];
+        if (chain.first == nullptr) continue;
+        reactors[i]->jobs_.push_chain(chain.first, chain.last);
+        reactors[i]->wake();
+        chain.first = nullptr;
+        chain.last = nullptr;
+    }
+}
+
+void Reactor::attach(const SessionPtr& session) {
+    // The first trip through the mailbox registers the socket with the poller
+    session->flush_scheduled.store(true);
+    notify(session);
+}
+
+void Reactor::schedule_flush(const SessionPtr& session) {
+    if (current_reactor == this) {
+        local_flushes_.push_back(session);
+        return;
+    }
+    notify(session);
+}
+
+void Reactor::drain_mailbox() {
+    wake_pending_.store(false);
+    while (MpscNode* node = jobs_.pop()) {
+        FanoutJob* job = static_cast<FanoutJob*>(node);
+        if (job->presence) fan_out_presence(job->members, *job->presence);
+        else fan_out(job->members, job->message, job->sender);
+        delete job;
+    }
+    while (MpscNode* node = mailbox_.pop()) {
+        Session* raw = static_cast<Session*>(node);
+        SessionPtr session = std::move(raw->mailbox_ref);
+        if (!session->attached) {
+            adopt(session);
+            if (session->state == SessionState::Closed) continue;
+        }
+        request_flush(session);
+    }
+}
+
+// Registers a new session's socket and starts its handshake clock (owner only)
+void Reactor::adopt(const SessionPtr& session) {
+    session->attached = true;
+#if defined(CHAT_URING)
+    // OpenSSL reads and writes the socket itself, so TLS sessions stay on
+    // the poller
+    session->ring_io = ring_on_ && !tls_enabled();
+    bool registered;
+    if (session->ring_io) {
+        registered = ring_.recv(session->fd, (uint64_t)(uintptr_t)session.get() | RING_RECV);
+        if (registered) session->ring_ops = 1;
+    } else {
+        registered = poller_.add(session->fd, session.get());
+    }
+#else
+    bool registered = poller_.add(session->fd, session.get());
+#endif
+    if (!registered) {
+        session_on_disconnect(session);
+        close_socket(session->fd);
+        return;
+    }
+    sessions_[session.get()] = session;
+    apply_tcp_policy(*session);
+    if (tls_enabled() && !tls_attach(*session)) {
+        close_session(session);
+        return;
+    }
+    session->last_heard = timers_.now();
+    const Tuning& limits = tuning();
+    if (limits.handshake_timeout_ms > 0) timers_.schedule(session->idle_timer, limits.handshake_timeout_ms);
+    else if (limits.heartbeat_interval_ms > 0) timers_.schedule(session->idle_timer, limits.heartbeat_interval_ms);
+}
+
+bool Reactor::listen_on(socket_t fd) {
+    if (!set_nonblocking(fd) || !poller_.add(fd, &listen_token_)) return false;
+    listen_fd_ = fd;
+    return true;
+}
+
+// Reuseport mode: takes what the kernel queued on our own listener. Level
+// triggered, so a backlog longer than one batch shows up again next wait.
+void Reactor::accept_ready() {
+    for (int i = 0; i < MAX_ACCEPTS_PER_WAKEUP; ++i) {
+        struct sockaddr_in client_address;
+        socklen_t client_addr_len = sizeof(client_address);
+        socket_t client_socket = accept(listen_fd_, (struct sockaddr*)&client_address, &client_addr_len);
+        if (client_socket == INVALID_SOCKET) return;
+        SessionPtr session = admit_connection(client_socket, client_address, this);
+        if (!session) continue;
+        adopt(session);
+        if (session->state != SessionState::Closed) request_flush(session);
+    }
+}
+
+// Owner-side entry for every flush request: write now, or hold the output
+// for the batching window
+void Reactor::request_flush(const SessionPtr& session) {
+    session->flush_scheduled.store(false);
+    if (session->state == SessionState::Closed) return;
+    const Tuning& batching = tuning();
+    if (batching.flush_window_us <= 0 || session->write_interest ||
+        session->queued_bytes.load(std::memory_order_relaxed) >= (size_t)batching.flush_bytes) {
+        flush(session);
+        return;
+    }
+    if (session->flush_deferred) return;
+    session->flush_deferred = true;
+    session->flush_deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(batching.flush_window_us);
+    deferred_.push_back(session);
+}
+
+void Reactor::flush_due() {
+    auto now = std::chrono::steady_clock::now();
+    while (deferred_head_ < deferred_.size()) {
+        SessionPtr session = std::move(deferred_[deferred_head_]);
+        // Entries already flushed early are stale; one window is the same for
+        // everyone, so the queue stays ordered by deadline
+        if (session->flush_deferred) {
+            if (session->flush_deadline > now) {
+                deferred_[deferred_head_] = std::move(session);
+                break;
+            }
+            flush(session);
+        }
+        ++deferred_head_;
+    }
+    if (deferred_head_ == deferred_.size()) {
+        deferred_.clear();
+        deferred_head_ = 0;
+    } else if (deferred_head_ > deferred_.size() / 2) {
+        deferred_.erase(deferred_.begin(), deferred_.begin() + deferred_head_);
+        deferred_head_ = 0;
+    }
+}
+
+void Reactor::schedule_presence(const RoomPtr& room) {
+    presence_due_.push_back(room);
+    if (!presence_timer_.scheduled()) timers_.schedule(presence_timer_, tuning().presence_window_ms);
+}
+
+// Runs the timer wheel; closed sessions have cancelled theirs
+void Reactor::expire_timers() {
+    timers_.advance([this](Timer& timer) {
+        if (&timer == &presence_timer_) {
+            std::vector<RoomPtr> due;
+            due.swap(presence_due_);
+            for (const RoomPtr& room : due) presence_send(room);
+            return;
+        }
+        SessionTimer& fired = static_cast<SessionTimer&>(timer);
+        auto it = sessions_.find(fired.session);
+        if (it == sessions_.end()) return;
+        SessionPtr session = it->second;
+        if (&fired == &session->idle_timer) idle_expired(session);
+        else stall_expired(session);
+    });
+}
+
+// Before login: drops connections that took too long, so idle or slowloris
+// sockets can't hold MAX_CLIENTS slots forever. After: pings a version 3
+// client that has gone quiet and drops it if the PING goes unanswered.
+void Reactor::idle_expired(const SessionPtr& session) {
+    uint64_t now = timers_.current();
+    const Tuning& limits = tuning();
+    if (session->state != SessionState::Chatting) {
+        if (limits.handshake_timeout_ms > 0) {
+            log_event(LogLevel::Debug, {"Handshake timed out from ", format_ipv4(session->peer_addr)});
+            metrics().add(Counter::HandshakeTimeouts);
+            close_session(session);
+        } else if (limits.heartbeat_interval_ms > 0) {
+            timers_.schedule(session->idle_timer, limits.heartbeat_interval_ms);
+        }
+        // With both off, nothing is due until login starts the heartbeats
+        return;
+    }
+    if (limits.heartbeat_interval_ms <= 0 || session->version < 3) return; // TCP keepalive watches the rest
+    if (session->ping_sent != 0) {
+        if (session->last_heard < session->ping_sent) {
+            log_event(LogLevel::Info, {"No answer to heartbeat from ", session->username, "; disconnecting"});
+            metrics().add(Counter::HeartbeatTimeouts);
+            close_session(session);
+            return;
+        }
+        session->ping_sent = 0;
+    }
+    uint64_t quiet = now > session->last_heard ? now - session->last_heard : 0;
+    if (quiet < (uint64_t)limits.heartbeat_interval_ms) {
+        timers_.schedule(session->idle_timer, limits.heartbeat_interval_ms - quiet);
+        return;
+    }
+    // A PING that flow control drops is retried later; the write stall
+    // timeout covers a client that has stopped reading altogether
+    if (queue_output(session, Message::raw(encode_frame(FRAME_PING, "")))) {
+        session->ping_sent = std::max<uint64_t>(now, 1);
+        flush(session);
+    }
+    if (session->state != SessionState::Closed) timers_.schedule(session->idle_timer, limits.heartbeat_timeout_ms);
+}
+
+// Drops a client whose socket has taken none of its output for
+// WRITE_STALL_TIMEOUT_MS: a peer that vanished without a FIN or RST, or one
+// that stopped reading, would otherwise hold its queue until the kernel gives
+// up retransmitting
+void Reactor::stall_expired(const SessionPtr& session) {
+    if (session->sending.empty() && session->queued_bytes.load(std::memory_order_relaxed) == 0) {
+        return; // Caught up; the next write that has to wait starts the clock again
+    }
+    uint64_t now = timers_.current();
+    uint64_t stalled = now > session->last_written ? now - session->last_written : 0;
+    int timeout_ms = tuning().write_stall_timeout_ms;
+    if (timeout_ms <= 0) return; // Turned off since the clock started
+    if (stalled < (uint64_t)timeout_ms) {
+        timers_.schedule(session->stall_timer, timeout_ms - stalled);
+        return;
+    }
+    log_event(LogLevel::Warn, {"Disconnecting ", session->username.empty() ? format_ipv4(session->peer_addr)
+                                                                           : session->username,
+                               ": no output taken for ", std::to_string(stalled), " ms"});
+    metrics().add(Counter::WriteStalls);
+    close_session(session);
+}
+
+// Starts the write stall clock for output the socket hasn't taken yet
+void Reactor::output_waiting(Session& session) {
+    int timeout_ms = tuning().write_stall_timeout_ms;
+    if (timeout_ms <= 0 || session.stall_timer.scheduled()) return;
+    session.last_written = timers_.now();
+    timers_.schedule(session.stall_timer, timeout_ms);
+}
+
+void Reactor::drain(std::chrono::steady_clock::time_point deadline) {
+    drain_deadline_ = deadline;
+    drain_requested_.store(true);
+    poller_.wakeup();
+}
+
+// Shutdown, on this reactor: stop accepting, drop connections that never
+// logged in and queue each chat client a reconnect hint with its own random
+// delay. Framed clients also get it as a RECONNECT frame they can act on.
+// During an upgrade handoff, whatever the new server can take as it stands
+// goes to it instead, and the rest are parked there for a resume.
+void Reactor::begin_drain() {
+    draining_ = true;
+    if (listen_fd_ != INVALID_SOCKET) {
+        poller_.remove(listen_fd_);
+#if defined(CHAT_URING)
+        if (ring_on_) stop_listening(listen_fd_); // Ends the multishot accept, which holds the socket open
+#endif
+        close_socket(listen_fd_); // After a handoff the new server's copy stays open
+        listen_fd_ = INVALID_SOCKET;
+    }
+    bool handing_off = handoff_active();
+    if (handing_off) {
+        // Our jobs for the others go out first. Once every reactor has
+        // stopped taking input, what is left in the mailbox is the last
+        // our clients get from this server.
+        send_outgoing();
+        handoff_quiesce(reactors.size());
+        drain_mailbox();
+    }
+    std::minstd_rand random(std::random_device{}() + (unsigned)index_);
+    std::uniform_int_distribution<int> spread(0, DRAIN_SPREAD_MS);
+    for (const auto& entry : sessions_) drain_batch_.push_back(entry.second);
+    for (const SessionPtr& session : drain_batch_) {
+        if (handing_off && hand_off(session)) continue;
+        if (session->state != SessionState::Chatting) {
+            close_session(session);
+            continue;
+        }
+        if (handing_off) handoff_park(*session);
+        std::string delay = std::to_string(spread(random));
+        queue_output(session, "Server is shutting down. Please reconnect in " + delay + " ms.");
+        if (session->format != WireFormat::Text) queue_output(session, Message::raw(encode_frame(FRAME_RECONNECT, delay)));
+        flush(session);
+    }
+    drain_batch_.clear();
+    if (handing_off) handoff_reactor_done();
+}
+
+// Upgrade handoff: passes a session the new server can pick up as it
+// stands over to it, and lets go of our copy without a word to the client
+// or its room. That is a logged-in plaintext client with no partial line or
+// frame read, its unsent output going along, or a connection nothing was
+// read from yet. False for anything else, which drains as usual.
+bool Reactor::hand_off(const SessionPtr& session) {
+    Session& s = *session;
+    if (tls_enabled() || s.hangup || s.overflowed.load()) return false;
+    bool chatting = s.state == SessionState::Chatting && s.frames.buffered() == 0 && s.lines.buffered() == 0;
+    bool fresh = s.state == SessionState::AwaitingHello && s.preamble.empty();
+    if (fresh) {
+        if (!handoff_connection(s.fd, s.peer_addr)) return false;
+    } else if (chatting) {
+        // The rest of what's in flight, then the outbox
+        std::string pending;
+        size_t skip = s.sent_offset;
+        Message::Segment segs[Message::MAX_WIRE_SEGMENTS];
+        auto append = [&](const MessageRef& message) {
+            int n = message->wire_segments(s.format, segs);
+            for (int i = 0; i < n; ++i) {
+                if (skip >= segs[i].len) {
+                    skip -= segs[i].len;
+                    continue;
+                }
+                pending.append(segs[i].data + skip, segs[i].len - skip);
+                skip = 0;
+            }
+        };
+        for (size_t m = 0; m < s.sending.size(); ++m) append(s.sending[m]);
+        std::vector<MessageRef> queued;
+        MessageRef next;
+        while (s.outbox.pop(next)) {
+            append(next);
+            queued.push_back(std::move(next));
+        }
+        if (!handoff_session(s, pending)) {
+            for (const MessageRef& message : queued) s.outbox.push(message); // Popped by us, so it fits
+            return false;
+        }
+    } else {
+        return false;
+    }
+
+    // Removed from the poller before the close: the socket itself stays
+    // open in the new server
+    timers_.cancel(s.idle_timer);
+    timers_.cancel(s.stall_timer);
+    poller_.remove(s.fd);
+    {
+        ClientShard& shard = *clients[index_];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.sessions.erase(s.fd);
+    }
+    admission.release(s.peer_addr);
+    if (chatting) room_move(session, "");
+    s.state = SessionState::Closed;
+    close_socket(s.fd);
+    s.sending.clear();
+    graveyard_.push_back(session);
+    sessions_.erase(session.get());
+    return true;
+}
+
+// Closes sessions whose output has all been handed to the kernel, and every
+// remaining one once the drain deadline has passed
+void Reactor::close_drained() {
+    bool expired = std::chrono::steady_clock::now() >= drain_deadline_;
+    for (const auto& entry : sessions_) {
+        const Session& session = *entry.second;
+        if (expired || (session.sending.empty() && session.queued_bytes.load(std::memory_order_relaxed) == 0)) {
+            drain_batch_.push_back(entry.second);
+        }
+    }
+    if (expired && !drain_batch_.empty()) {
+        log_event(LogLevel::Warn, {"Drain deadline passed; cutting off ", std::to_string(drain_batch_.size()),
+                                   " client(s) on reactor ", std::to_string(index_)});
+    }
+    for (const SessionPtr& session : drain_batch_) close_session(session);
+    drain_batch_.clear();
+}
+
+void Reactor::hold_for_resume(const std::string& token) {
+    resume_timers_.push_back(ResumeTimer{token, std::chrono::steady_clock::now() +
+                                                    std::chrono::milliseconds(RESUME_GRACE_MS)});
+}
+
+void Reactor::expire_resumes() {
+    auto now = std::chrono::steady_clock::now();
+    while (!resume_timers_.empty() && resume_timers_.front().deadline <= now) {
+        session_resume_expired(resume_timers_.front().token);
+        resume_timers_.pop_front();
+    }
+}
+
+int Reactor::next_timeout_ms() const {
+    bool have_deadline = draining_;
+    std::chrono::steady_clock::time_point deadline;
+    if (draining_) deadline = drain_deadline_;
+    for (size_t i = deferred_head_; i < deferred_.size(); ++i) {
+        const SessionPtr& session = deferred_[i];
+        if (!session->flush_deferred) continue;
+        if (!have_deadline || session->flush_deadline < deadline) deadline = session->flush_deadline;
+        have_deadline = true;
+        break;
+    }
+    if (!resume_timers_.empty()) {
+        const ResumeTimer& timer = resume_timers_.front();
+        if (!have_deadline || timer.deadline < deadline) deadline = timer.deadline;
+        have_deadline = true;
+    }
+    int timers = timers_.next_timeout_ms();
+    if (!have_deadline) return timers;
+    auto wait = deadline - std::chrono::steady_clock::now();
+    long long us = std::chrono::duration_cast<std::chrono::microseconds>(wait).count();
+    int ms = us <= 0 ? 0 : (int)((us + 999) / 1000);
+    return timers >= 0 && timers < ms ? timers : ms;
+}
+
+void Reactor::run() {
+    current_reactor = this;
+    if (PIN_THREADS > 0 && !pin_current_thread(index_ % std::max(1u, std::thread::hardware_concurrency()))) {
+        log_event(LogLevel::Warn, {"Could not pin reactor ", std::to_string(index_), " to a CPU"});
+    }
+    outgoing_.assign(reactors.size(), JobChain{nullptr, nullptr});
+#if defined(CHAT_URING)
+    if (IO_ENGINE == IoEngine::Uring) {
+        std::string error;
+        if (ring_.start(error)) {
+            run_ring();
+            return;
+        }
+        log_event(LogLevel::Warn, {"Reactor ", std::to_string(index_), " falling back to epoll: ", error});
+    }
+#endif
+    std::vector<PollEvent> events(MAX_POLL_EVENTS);
+    while (true) {
+        int n = poller_.wait(events.data(), MAX_POLL_EVENTS, next_timeout_ms());
+        if (handle_events(events.data(), n)) drain_mailbox();
+        if (end_iteration()) return;
+    }
+}
+
+// Dispatches what the poller reported; true if the mailbox needs draining
+bool Reactor::handle_events(const PollEvent* events, int n) {
+    bool woken = false;
+    for (int i = 0; i < n; ++i) {
+        const PollEvent& ev = events[i];
+        if (ev.token == nullptr) {
+            woken = true;
+            continue;
+        }
+        if (ev.token == &listen_token_) {
+            accept_ready();
+            continue;
+        }
+        auto it = sessions_.find(static_cast<Session*>(ev.token));
+        if (it == sessions_.end()) continue;
+        SessionPtr session = it->second;
+        if (ev.readable) on_readable(session);
+        if (ev.writable && session->state != SessionState::Closed) flush(session);
+    }
+    return woken;
+}
+
+// The rest of a loop iteration, once events are handled; true when run()
+// should return
+bool Reactor::end_iteration() {
+    // Timers first: what they queue (pings, roster updates) goes out below
+    expire_timers();
+    expire_resumes();
+    // Output queued by this thread's own handlers (welcome lines, echoes)
+    while (!local_flushes_.empty()) {
+        flush_batch_.swap(local_flushes_);
+        for (const SessionPtr& session : flush_batch_) request_flush(session);
+        flush_batch_.clear();
+    }
+    flush_due();
+    if (!draining_ && drain_requested_.load()) begin_drain();
+    if (draining_) close_drained();
+    send_outgoing();
+    graveyard_.clear();
+    return draining_ && sessions_.empty();
+}
+
+#if defined(CHAT_URING)
+// The io_uring loop: one io_uring_enter per iteration submits everything
+// queued since the last (sends, rearmed requests) and waits for completions
+void Reactor::run_ring() {
+    ring_on_ = true;
+    if (listen_fd_ != INVALID_SOCKET) {
+        poller_.remove(listen_fd_);
+        if (!ring_.accept(listen_fd_, RING_ACCEPT)) ring_accept_via_poller();
+    }
+    std::vector<PollEvent> events(MAX_POLL_EVENTS);
+    while (true) {
+        // Without the POLL_ADD nothing wakes us for the mailbox or the epoll
+        // set, so they are polled directly every RING_REARM_RETRY_MS instead
+        bool polling = ring_poller_armed_ || ring_arm_poller();
+        int timeout_ms = next_timeout_ms();
+        if (!polling && (timeout_ms < 0 || timeout_ms > RING_REARM_RETRY_MS)) timeout_ms = RING_REARM_RETRY_MS;
+        ring_.submit_and_wait(timeout_ms);
+        bool woken = false;
+        if (!polling) {
+            int n = poller_.wait(events.data(), MAX_POLL_EVENTS, 0);
+            if (handle_events(events.data(), n)) woken = true;
+        }
+        ring_.reap([&](const io_uring_cqe& cqe) {
+            if (cqe.user_data == RING_POLLER) {
+                // One-shot, so rearming completes again at once while the
+                // epoll set still has events
+                ring_poller_armed_ = false;
+                int n = poller_.wait(events.data(), MAX_POLL_EVENTS, 0);
+                if (handle_events(events.data(), n)) woken = true;
+                ring_arm_poller();
+            } else if (cqe.user_data == RING_ACCEPT) {
+                ring_accepted(cqe);
+            } else {
+                ring_completed(cqe);
+            }
+        });
+        if (woken) drain_mailbox();
+        bool done = end_iteration();
+        ring_close_doomed();
+        if (done) return;
+    }
+}
+
+// Queues the POLL_ADD that reports the epoll set (mailbox, TLS sessions)
+// readable; false, logged once per outage, if the submission queue is stuck
+bool Reactor::ring_arm_poller() {
+    bool was_stuck = ring_poller_stuck_;
+    ring_poller_armed_ = ring_.poll(poller_.fd(), RING_POLLER);
+    ring_poller_stuck_ = !ring_poller_armed_;
+    if (ring_poller_stuck_ && !was_stuck) {
+        log_event(LogLevel::Error, {"Reactor ", std::to_string(index_),
+                                    ": io_uring poll of the epoll set not submitted; polling it every ",
+                                    std::to_string(RING_REARM_RETRY_MS), " ms until it is"});
+    }
+    return ring_poller_armed_;
+}
+
+// The multishot accept could not be (re)queued: the listener goes back in
+// the epoll set, and accept_ready() takes connections from there on
+void Reactor::ring_accept_via_poller() {
+    if (poller_.add(listen_fd_, &listen_token_)) {
+        log_event(LogLevel::Error, {"Reactor ", std::to_string(index_),
+                                    ": io_uring accept not submitted; accepting through epoll"});
+    } else {
+        log_event(LogLevel::Error, {"Reactor ", std::to_string(index_),
+                                    ": io_uring accept not submitted and the listener can't be polled; "
+                                    "not accepting"});
+    }
+}
+
+// Multishot accept: a new socket per completion, until the listener shuts
+// down or a failure ends the request
+void Reactor::ring_accepted(const io_uring_cqe& cqe) {
+    if (cqe.res >= 0) {
+        socket_t client_socket = cqe.res;
+        struct sockaddr_in client_address;
+        socklen_t client_addr_len = sizeof(client_address);
+        memset(&client_address, 0, sizeof(client_address));
+        if (draining_ || getpeername(client_socket, (struct sockaddr*)&client_address, &client_addr_len) != 0) {
+            close_socket(client_socket);
+        } else if (SessionPtr session = admit_connection(client_socket, client_address, this)) {
+            adopt(session);
+            if (session->state != SessionState::Closed) request_flush(session);
+        }
+    }
+    if (!(cqe.flags & IORING_CQE_F_MORE) && listen_fd_ != INVALID_SOCKET && !ring_.accept(listen_fd_, RING_ACCEPT)) {
+        ring_accept_via_poller();
+    }
+}
+
+// Recv and send completions for a session
+void Reactor::ring_completed(const io_uring_cqe& cqe) {
+    Session* raw = (Session*)(uintptr_t)(cqe.user_data & ~RING_KIND_MASK);
+    auto it = sessions_.find(raw);
+    SessionPtr session;
+    if (it != sessions_.end()) {
+        session = it->second;
+    } else {
+        auto closing = ring_closing_.find(raw);
+        if (closing == ring_closing_.end()) return; // Not ours; can't happen
+        session = closing->second;
+    }
+
+    bool open = session->state != SessionState::Closed;
+    if ((cqe.user_data & RING_KIND_MASK) == RING_RECV) {
+        bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+        if (!more) --session->ring_ops;
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            if (open && cqe.res > 0) {
+                metrics().add(Counter::BytesIn, (uint64_t)cqe.res);
+                // Read and ignored while draining, so closing doesn't reset the connection
+                if (!draining_) open = deliver(session, ring_.buffer(cqe), (size_t)cqe.res);
+            }
+            ring_.recycle(cqe);
+        }
+        if (open && (cqe.res == 0 || (cqe.res < 0 && cqe.res != -ENOBUFS))) {
+            close_session(session); // EOF or a socket error
+            open = false;
+        }
+        // Ended but fine (out of buffers, or the kernel stopped it): rearm
+        if (open && !more) {
+            if (ring_.recv(session->fd, cqe.user_data)) ++session->ring_ops;
+            else close_session(session);
+        }
+    } else {
+        session->ring_sending = false;
+        --session->ring_ops;
+        if (!open) {
+            session->sending.clear();
+        } else if (cqe.res > 0) {
+            metrics().add(Counter::BytesOut, (uint64_t)cqe.res);
+            advance_output(*session, (size_t)cqe.res);
+            flush(session);
+        } else {
+            close_session(session);
+        }
+    }
+    if (session->state == SessionState::Closed && session->ring_ops == 0) ring_closing_.erase(raw);
+}
+
+// flush() for an io_uring session: queues one SENDMSG of everything pending,
+// submitted with the rest of this iteration's requests
+void Reactor::ring_flush(const SessionPtr& session) {
+    if (session->ring_sending) return; // Ordering: one send per socket at a time
+    io_slice slices[MAX_IOVECS];
+    int count = gather_output(*session, slices);
+    if (count == 0) return;
+    if (!ring_.send(session->fd, slices, count, (uint64_t)(uintptr_t)session.get() | RING_SEND)) {
+        log_event(LogLevel::Warn, {"io_uring submission queue stuck; disconnecting ", session->username});
+        close_session(session);
+        return;
+    }
+    session->ring_sending = true;
+    ++session->ring_ops;
+    output_waiting(*session); // The send completes only once the socket has taken something
+}
+
+// Shuts down the sockets closed this iteration, once the sends queued for
+// them are with the kernel
+void Reactor::ring_close_doomed() {
+    if (ring_doomed_.empty()) return;
+    ring_.submit();
+    for (socket_t fd : ring_doomed_) {
+        shutdown(fd, SHUT_RDWR);
+        close_socket(fd);
+    }
+    ring_doomed_.clear();
+}
+#endif
+
+// Moves the TLS handshake along; true once it is done and the session is
+// sniffing for the preamble
+bool Reactor::continue_tls(const SessionPtr& session) {
+    TlsStep step = tls_handshake(*session);
+    if (step == TlsStep::Failed) {
+        close_session(session);
+        return false;
+    }
+    bool want_write = step == TlsStep::WantWrite;
+    if (session->write_interest != want_write) {
+        session->write_interest = want_write;
+        poller_.set_write_interest(session->fd, session.get(), want_write);
+    }
+    if (step != TlsStep::Done) return false;
+    session->state = SessionState::AwaitingHello;
+    return true;
+}
+
+void Reactor::on_readable(const SessionPtr& session) {
+    if (session->state == SessionState::TlsHandshake && !continue_tls(session)) return;
+    char buffer[BUFFER_SIZE];
+    // Past the read limit, only what OpenSSL already decrypted: the poller
+    // won't report it again
+    for (int i = 0; (i < MAX_READS_PER_WAKEUP || session_input_buffered(*session)) &&
+                    session->state != SessionState::Closed; ++i) {
+        bool blocked = false;
+        long bytes_received = session_recv(*session, buffer, BUFFER_SIZE, blocked);
+        if (bytes_received > 0) {
+            metrics().add(Counter::BytesIn, bytes_received);
+            if (draining_) continue; // Read and ignored, so closing doesn't reset the connection
+            if (!deliver(session, buffer, (size_t)bytes_received)) return;
+            continue;
+        }
+        if (blocked) return;
+        close_session(session);
+        return;
+    }
+}
+
+// Feeds received bytes to the session; false if that closed it
+bool Reactor::deliver(const SessionPtr& session, const char* data, size_t len) {
+    session->last_heard = timers_.now(); // Any byte will do for a heartbeat, PONG or not
+    if (session_on_data(session, data, len) && !session->hangup) return true;
+    if (session->hangup) flush(session); // The goodbye, as far as the kernel takes it
+    close_session(session);
+    return false;
+}
+
+void Reactor::flush(const SessionPtr& session) {
+    session->flush_deferred = false;
+    if (session->state == SessionState::Closed) return;
+    if (session->overflowed.load(std::memory_order_relaxed)) {
+        log_event(LogLevel::Warn, {"Disconnecting slow consumer ", session->username});
+        close_session(session);
+        return;
+    }
+    if (session->state == SessionState::TlsHandshake) {
+        continue_tls(session); // Nothing to send before it's done
+        return;
+    }
+#if defined(CHAT_URING)
+    if (session->ring_io) {
+        ring_flush(session);
+        return;
+    }
+#endif
+
+    bool corked = session->tcp_policy == TcpPolicy::Cork && set_tcp_cork(session->fd, true);
+    io_slice slices[MAX_IOVECS];
+    while (true) {
+        int count = gather_output(*session, slices);
+        if (count == 0) break;
+        bool blocked = false;
+        long sent = session_send(*session, slices, count, blocked);
+        if (sent > 0) {
+            metrics().add(Counter::BytesOut, (uint64_t)sent);
+            advance_output(*session, (size_t)sent);
+            continue;
+        }
+        if (blocked) {
+            if (corked) set_tcp_cork(session->fd, false);
+            output_waiting(*session);
+            if (!session->write_interest) {
+                session->write_interest = true;
+                poller_.set_write_interest(session->fd, session.get(), true);
+            }
+            return;
+        }
+        close_session(session);
+        return;
+    }
+
+    if (corked) set_tcp_cork(session->fd, false);
+    if (session->write_interest) {
+        session->write_interest = false;
+        poller_.set_write_interest(session->fd, session.get(), false);
+    }
+}
+
+// Tops up the session's in-flight ring from its outbox and gathers every
+// queued segment into slices, skipping what a short write already sent;
+// returns the slice count, 0 once nothing is left to send
+int Reactor::gather_output(Session& session, io_slice* slices) {
+    MessageRef next;
+    while (session.sending.size() < OUTBOUND_BATCH && session.outbox.pop(next)) {
+        session.queued_bytes.fetch_sub(next->wire_size(session.format), std::memory_order_relaxed);
+        session.sending.push_back(std::move(next));
+    }
+    int count = 0;
+    size_t skip = session.sent_offset;
+    Message::Segment segs[Message::MAX_WIRE_SEGMENTS];
+    for (size_t m = 0; m < session.sending.size(); ++m) {
+        int n = session.sending[m]->wire_segments(session.format, segs);
+        for (int i = 0; i < n && count < MAX_IOVECS; ++i) {
+            const Message::Segment& seg = segs[i];
+            if (skip >= seg.len) {
+                skip -= seg.len;
+                continue;
+            }
+            set_slice(slices[count++], seg.data + skip, seg.len - skip);
+            skip = 0;
+        }
+        if (count == MAX_IOVECS) break;
+    }
+    return count;
+}
+
+// Retires the messages the kernel has taken all of after sent more bytes
+void Reactor::advance_output(Session& session, size_t sent) {
+    if (session.stall_timer.scheduled()) session.last_written = timers_.now();
+    size_t advanced = session.sent_offset + sent;
+    while (!session.sending.empty() && advanced >= session.sending.front()->wire_size(session.format)) {
+        advanced -= session.sending.front()->wire_size(session.format);
+        session.sending.pop_front();
+        metrics().add(Counter::MessagesOut);
+    }
+    session.sent_offset = advanced;
+}
+
+void Reactor::close_session(const SessionPtr& session) {
+    if (session->state == SessionState::Closed) return;
+    timers_.cancel(session->idle_timer);
+    timers_.cancel(session->stall_timer);
+    session_on_disconnect(session);
+#if defined(CHAT_URING)
+    if (session->ring_io) {
+        // The socket closes after the next submit; what the kernel still
+        // reads (a send's segments) stays alive until its completion
+        ring_doomed_.push_back(session->fd);
+        if (session->ring_ops > 0) ring_closing_[session.get()] = session;
+        if (!session->ring_sending) session->sending.clear();
+        graveyard_.push_back(session);
+        sessions_.erase(session.get());
+        return;
+    }
+#endif
+    poller_.remove(session->fd);
+    tls_close(*session);
+    close_socket(session->fd);
+    session->sending.clear();
+    graveyard_.push_back(session);
+    sessions_.erase(session.get());
+}
+
+// ---------------------------------------------------------------------------
+// Metrics endpoint: Prometheus text format over plain HTTP on METRICS_PORT.
+// Served by its own thread; every request gets the full page.
+// ---------------------------------------------------------------------------
+void render_counter(std::string& out, const char* name, const char* help, uint64_t value,
+                    const char* labels = nullptr) {
+    if (help) {
+        out += "# HELP "; out += name; out += " "; out += help; out += "\n";
+        out += "# TYPE "; out += name; out += " counter\n";
+    }
+    out += name;
+    if (labels) { out += "{"; out += labels; out += "}"; }
+    out += " " + std::to_string(value) + "\n";
+}
+
+void render_gauge(std::string& out, const char* name, const char* help, uint64_t value) {
+    out += "# HELP "; out += name; out += " "; out += help; out += "\n";
+    out += "# TYPE "; out += name; out += " gauge\n";
+    out += name; out += " " + std::to_string(value) + "\n";
+}
+
+void render_histogram(std::string& out, const char* name, const char* help, Histogram which) {
+    uint64_t buckets[METRIC_BUCKETS + 1];
+    uint64_t sum_ns, count;
+    Metrics::instance().histogram(which, buckets, sum_ns, count);
+    out += "# HELP "; out += name; out += " "; out += help; out += "\n";
+    out += "# TYPE "; out += name; out += " histogram\n";
+    uint64_t cumulative = 0;
+    char bound[32];
+    for (int i = 0; i <= METRIC_BUCKETS; ++i) {
+        cumulative += buckets[i];
+        if (i < METRIC_BUCKETS) snprintf(bound, sizeof(bound), "%g", (double)(1ull << i) * 1e-6);
+        else snprintf(bound, sizeof(bound), "+Inf");
+        out += name; out += "_bucket{le=\""; out += bound; out += "\"} " + std::to_string(cumulative) + "\n";
+    }
+    char sum[32];
+    snprintf(sum, sizeof(sum), "%.9f", (double)sum_ns * 1e-9);
+    out += name; out += "_sum "; out += sum; out += "\n";
+    out += name; out += "_count " + std::to_string(count) + "\n";
+}
+
+// ---------------------------------------------------------------------------
+// Cluster relay: server instances peer over persistent TCP links so a room
+// spans every node. Each node tells its peers which rooms have members on it
+// (FRAME_INTEREST); a room broadcast crosses each link to an interested peer
+// once, as one FRAME_RELAY, and the receiving node fans it out to its own
+// members. Relayed broadcasts are never forwarded again, so the nodes must
+// form a full mesh (every node lists every other in CLUSTER_PEERS, or each
+// pair is listed on at least one side). One thread services every link;
+// frames queued by the reactors pile up in the link's buffer and leave
+// together on that thread's next wakeup.
+// ---------------------------------------------------------------------------
+struct PeerLink {
+    PeerLink(socket_t s, bool dialed)
+        : fd(s), outbound(dialed), ready(false), write_interest(false), sent_offset(0), closed(false),
+          dropped(0) {}
+
+    socket_t fd;
+    bool outbound; // We dialed it
+
+    // Cluster thread only
+    bool ready; // HELLO exchanged and the link kept
+    std::chrono::steady_clock::time_point hello_deadline; // Dropped if not ready by then
+    bool write_interest;
+    FrameDecoder frames;
+    std::string sending; // Taken from pending, partly written
+    size_t sent_offset;
+
+    std::mutex mutex; // Guards the rest
+    std::condition_variable closed_cv;
+    bool closed;
+    std::string peer_id; // Set once, before the link is published
+    std::string pending; // Frames queued since the last send
+    std::set<std::string> interest; // Rooms the peer has members in
+    uint64_t dropped;
+};
+
+using PeerLinkPtr = std::shared_ptr<PeerLink>;
+using PeerList = std::vector<PeerLinkPtr>;
+
+class Cluster {
+public:
+    Cluster() : links_(std::make_shared<const PeerList>()), wake_pending_(false) {}
+
+    void start() { std::thread(&Cluster::run, this).detach(); }
+
+    // Hands a connected peer socket to the cluster thread (any thread)
+    PeerLinkPtr add_link(socket_t fd, bool outbound);
+    bool connected_to(const std::string& node_id) const;
+    size_t peer_count() const { return std::atomic_load(&links_)->size(); }
+
+    // Queues a room broadcast for every peer with members in the room (any thread)
+    void relay(const Room& room, const Message& message);
+    // A room gained its first or lost its last local member; caller holds
+    // rooms_mutex
+    void interest(const std::string& room, bool has_members);
+
+private:
+    void run();
+    void wake();
+    void open(const PeerLinkPtr& link);
+    void on_readable(const PeerLinkPtr& link);
+    bool on_frame(const PeerLinkPtr& link, unsigned char type, const char* payload, size_t len);
+    bool on_hello(const PeerLinkPtr& link, const char* payload, size_t len);
+    void flush(const PeerLinkPtr& link);
+    void close_link(const PeerLinkPtr& link);
+    int expire_hellos();
+
+    Poller poller_;
+    // Links past the HELLO exchange. Replaced copy-on-write by the cluster
+    // thread; additions happen under rooms_mutex, so interest() can't miss
+    // a link that is being announced the current room set.
+    std::shared_ptr<const PeerList> links_;
+    std::map<PeerLink*, PeerLinkPtr> open_; // Cluster thread: every open link
+    std::mutex new_links_mutex_;
+    std::vector<PeerLinkPtr> new_links_;
+    std::atomic<bool> wake_pending_;
+};
+
+std::unique_ptr<Cluster> cluster; // Null unless CLUSTER_PORT or CLUSTER_PEERS is set
+
+// Appends one frame of type made of parts to link.pending; caller holds
+// link.mutex
+void append_peer_frame(PeerLink& link, unsigned char type, std::initializer_list<Message::Segment> parts) {
+    size_t payload = 0;
+    for (const Message::Segment& part : parts) payload += part.len;
+    char header[MAX_FRAME_HEADER_SIZE];
+    link.pending.append(header, encode_frame_header(type, payload, header));
+    for (const Message::Segment& part : parts) link.pending.append(part.data, part.len);
+}
+
+PeerLinkPtr Cluster::add_link(socket_t fd, bool outbound) {
+    PeerLinkPtr link = std::make_shared<PeerLink>(fd, outbound);
+    {
+        std::lock_guard<std::mutex> lock(new_links_mutex_);
+        new_links_.push_back(link);
+    }
+    wake();
+    return link;
+}
+
+bool Cluster::connected_to(const std::string& node_id) const {
+    std::shared_ptr<const PeerList> links = std::atomic_load(&links_);
+    for (const PeerLinkPtr& link : *links) {
+        if (link->peer_id == node_id) return true;
+    }
+    return false;
+}
+
+void Cluster::relay(const Room& room, const Message& message) {
+    std::shared_ptr<const PeerList> links = std::atomic_load(&links_);
+    if (links->empty()) return;
+    size_t payload = 2 + room.name.size() + message.text_size();
+    char header[MAX_FRAME_HEADER_SIZE];
+    // Chat lines also go into the peer's copy of the room history
+    size_t header_len = encode_frame_header(message.is_chat() ? FRAME_RELAY_CHAT : FRAME_RELAY, payload, header);
+    const char room_len[2] = {(char)(room.name.size() >> 8), (char)room.name.size()};
+    bool queued = false;
+    for (const PeerLinkPtr& link : *links) {
+        std::lock_guard<std::mutex> lock(link->mutex);
+        if (link->closed || link->interest.count(room.name) == 0) continue;
+        if (payload + 1 > MAX_FRAME_SIZE || link->pending.size() + header_len + payload > (size_t)CLUSTER_QUEUE_BYTES) {
+            ++link->dropped;
+            metrics().add(Counter::RelayDropped);
+            continue;
+        }
+        link->pending.append(header, header_len);
+        link->pending.append(room_len, 2);
+        link->pending.append(room.name);
+        message.append_text(link->pending);
+        metrics().add(Counter::RelayOut);
+        queued = true;
+    }
+    if (queued) wake();
+}
+
+void Cluster::interest(const std::string& room, bool has_members) {
+    std::shared_ptr<const PeerList> links = std::atomic_load(&links_);
+    if (links->empty()) return;
+    const char flag = has_members ? 1 : 0;
+    for (const PeerLinkPtr& link : *links) {
+        // Never dropped: a lost update would leave the peer's view wrong
+        std::lock_guard<std::mutex> lock(link->mutex);
+        append_peer_frame(*link, FRAME_INTEREST, {{&flag, 1}, {room.data(), room.size()}});
+    }
+    wake();
+}
+
+void Cluster::wake() {
+    if (!wake_pending_.exchange(true)) poller_.wakeup();
+}
+
+void Cluster::run() {
+    std::vector<PollEvent> events(MAX_POLL_EVENTS);
+    std::vector<PeerLinkPtr> adopted;
+    while (true) {
+        int n = poller_.wait(events.data(), MAX_POLL_EVENTS, expire_hellos());
+        bool woken = false;
+        for (int i = 0; i < n; ++i) {
+            const PollEvent& ev = events[i];
+            if (ev.token == nullptr) {
+                woken = true;
+                continue;
+            }
+            auto it = open_.find(static_cast<PeerLink*>(ev.token));
+            if (it == open_.end()) continue;
+            PeerLinkPtr link = it->second;
+            if (ev.readable) on_readable(link);
+            if (ev.writable && open_.count(link.get())) flush(link);
+        }
+        if (!woken) continue;
+
+        wake_pending_.store(false);
+        {
+            std::lock_guard<std::mutex> lock(new_links_mutex_);
+            adopted.swap(new_links_);
+        }
+        for (const PeerLinkPtr& link : adopted) open(link);
+        adopted.clear();
+        // Relays from every reactor since the last wakeup leave in one send per link
+        std::shared_ptr<const PeerList> links = std::atomic_load(&links_);
+        for (const PeerLinkPtr& link : *links) {
+            if (!link->write_interest) flush(link);
+        }
+    }
+}
+
+// Drops links still without a PEER_HELLO past their deadline, so a peer
+// that connects and says nothing can't hold one for good; returns the
+// milliseconds until the next deadline, -1 if none is pending
+int Cluster::expire_hellos() {
+    auto now = std::chrono::steady_clock::now();
+    std::vector<PeerLinkPtr> expired;
+    int wait_ms = -1;
+    for (const auto& entry : open_) {
+        const PeerLinkPtr& link = entry.second;
+        if (link->ready) continue;
+        if (link->hello_deadline <= now) {
+            expired.push_back(link);
+            continue;
+        }
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(link->hello_deadline - now).count() + 1;
+        if (wait_ms < 0 || left < wait_ms) wait_ms = (int)left;
+    }
+    for (const PeerLinkPtr& link : expired) {
+        log_event(LogLevel::Warn, {"Cluster: no PEER_HELLO within ", std::to_string(PEER_HELLO_TIMEOUT_MS), " ms; closing the link"});
+        close_link(link);
+    }
+    return wait_ms;
+}
+
+void Cluster::open(const PeerLinkPtr& link) {
+    if (!set_nonblocking(link->fd) || !poller_.add(link->fd, link.get())) {
+        close_socket(link->fd);
+        std::lock_guard<std::mutex> lock(link->mutex);
+        link->closed = true;
+        link->closed_cv.notify_all();
+        return;
+    }
+    open_[link.get()] = link;
+    link->hello_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(PEER_HELLO_TIMEOUT_MS);
+    const char version = (char)PEER_PROTOCOL_VERSION;
+    {
+        std::lock_guard<std::mutex> lock(link->mutex);
+        append_peer_frame(*link, FRAME_PEER_HELLO, {{&version, 1}, {NODE_ID.data(), NODE_ID.size()}});
+    }
+    flush(link);
+}
+
+void Cluster::on_readable(const PeerLinkPtr& link) {
+    char buffer[BUFFER_SIZE];
+    for (int i = 0; i < MAX_READS_PER_WAKEUP; ++i) {
+        int bytes_received = recv(link->fd, buffer, BUFFER_SIZE, 0);
+        if (bytes_received > 0) {
+            bool ok = true;
+            bool framed = link->frames.feed(buffer, bytes_received, [&](unsigned char type, const char* p, size_t len) {
+                if (ok) ok = on_frame(link, type, p, len);
+            });
+            if (!framed || !ok) {
+                close_link(link);
+                return;
+            }
+            continue;
+        }
+        if (bytes_received < 0 && would_block(socket_error())) break;
+        close_link(link);
+        return;
+    }
+    // HELLO replies and room announcements go out right away
+    flush(link);
+}
+
+bool Cluster::on_frame(const PeerLinkPtr& link, unsigned char type, const char* payload, size_t len) {
+    if (!link->ready) return type == FRAME_PEER_HELLO && on_hello(link, payload, len);
+    if (type == FRAME_INTEREST) {
+        if (len < 1) return false;
+        std::string room(payload + 1, len - 1);
+        std::lock_guard<std::mutex> lock(link->mutex);
+        if (payload[0]) link->interest.insert(room);
+        else link->interest.erase(room);
+        return true;
+    }
+    if (type == FRAME_RELAY || type == FRAME_RELAY_CHAT) {
+        if (len < 2) return false;
+        size_t room_len = ((size_t)(unsigned char)payload[0] << 8) | (unsigned char)payload[1];
+        if (len < 2 + room_len) return false;
+        metrics().add(Counter::RelayIn);
+        RoomPtr room;
+        {
+            std::lock_guard<std::mutex> lock(rooms_mutex);
+            auto it = rooms.find(std::string(payload + 2, room_len));
+            if (it != rooms.end()) room = it->second;
+        }
+        // While draining, our clients are on their way out and relays would
+        // only hold up their queues
+        if (!room || draining.load()) return true;
+        const char* text = payload + 2 + room_len;
+        size_t text_len = len - 2 - room_len;
+        if (type == FRAME_RELAY) {
+            broadcast_local(*room, Message::text(text, text_len));
+            return true;
+        }
+        std::vector<MemberList>& members = member_views();
+        uint64_t seq = room_number_line(*room, members);
+        MessageRef line = Message::text(text, text_len, seq);
+        deliver_local(members, line, nullptr);
+        room_remember(*room, *line);
+        return true;
+    }
+    return false;
+}
+
+bool Cluster::on_hello(const PeerLinkPtr& link, const char* payload, size_t len) {
+    if (len < 2 || (unsigned char)payload[0] != PEER_PROTOCOL_VERSION) {
+        log_event(LogLevel::Warn, {"Cluster peer rejected: unsupported protocol version"});
+        return false;
+    }
+    std::string id(payload + 1, len - 1);
+    {
+        // The dialer learns who it reached even if the link is dropped below
+        std::lock_guard<std::mutex> lock(link->mutex);
+        link->peer_id = id;
+    }
+    if (id == NODE_ID) return false; // Dialed ourselves
+
+    // Two links to one node (both sides dial, or two addresses for it): keep
+    // the one dialed by the smaller node id, or the older one if both were
+    // dialed from the same side. Both ends pick the same link.
+    const std::string& initiator = link->outbound ? NODE_ID : id;
+    PeerLinkPtr replaced;
+    std::shared_ptr<const PeerList> links = std::atomic_load(&links_);
+    for (const PeerLinkPtr& other : *links) {
+        if (other->peer_id != id) continue;
+        const std::string& other_initiator = other->outbound ? NODE_ID : id;
+        if (other_initiator <= initiator) return false;
+        replaced = other;
+    }
+    if (replaced) close_link(replaced);
+
+    link->ready = true;
+    std::lock_guard<std::mutex> rooms_lock(rooms_mutex);
+    {
+        std::lock_guard<std::mutex> lock(link->mutex);
+        const char flag = 1;
+        for (const auto& entry : rooms) {
+            if (entry.second->member_count.load(std::memory_order_relaxed) == 0) continue;
+            append_peer_frame(*link, FRAME_INTEREST, {{&flag, 1}, {entry.first.data(), entry.first.size()}});
+        }
+    }
+    std::shared_ptr<PeerList> next = std::make_shared<PeerList>(*std::atomic_load(&links_));
+    next->push_back(link);
+    std::atomic_store(&links_, std::shared_ptr<const PeerList>(next));
+    log_event(LogLevel::Info, {"Cluster link up: ", id});
+    return true;
+}
+
+void Cluster::flush(const PeerLinkPtr& link) {
+    while (true) {
+        if (link->sent_offset == link->sending.size()) {
+            link->sending.clear();
+            link->sent_offset = 0;
+            std::lock_guard<std::mutex> lock(link->mutex);
+            link->sending.swap(link->pending);
+            if (link->sending.empty()) break;
+        }
+        int sent = send(link->fd, link->sending.data() + link->sent_offset,
+                        (int)(link->sending.size() - link->sent_offset), 0);
+        if (sent > 0) {
+            link->sent_offset += sent;
+            continue;
+        }
+        if (sent < 0 && would_block(socket_error())) {
+            if (!link->write_interest) {
+                poller_.set_write_interest(link->fd, link.get(), true);
+                link->write_interest = true;
+            }
+            return;
+        }
+        close_link(link);
+        return;
+    }
+    if (link->write_interest) {
+        poller_.set_write_interest(link->fd, link.get(), false);
+        link->write_interest = false;
+    }
+}
+
+void Cluster::close_link(const PeerLinkPtr& link) {
+    if (open_.erase(link.get()) == 0) return;
+    poller_.remove(link->fd);
+    close_socket(link->fd);
+    if (link->ready) {
+        std::shared_ptr<PeerList> next = std::make_shared<PeerList>(*std::atomic_load(&links_));
+        next->erase(std::remove(next->begin(), next->end(), link), next->end());
+        std::atomic_store(&links_, std::shared_ptr<const PeerList>(next));
+        log_event(LogLevel::Warn, {"Cluster link down: ", link->peer_id, " (", std::to_string(link->dropped),
+                                   " relays dropped)"});
+    }
+    std::lock_guard<std::mutex> lock(link->mutex);
+    link->closed = true;
+    link->closed_cv.notify_all();
+}
+
+void cluster_relay(const Room& room, const Message& message) {
+    if (cluster) cluster->relay(room, message);
+}
+
+void cluster_interest(const std::string& room, bool has_members) {
+    if (cluster) cluster->interest(room, has_members);
+}
+
+// Connects non-blocking socket fd to address, giving up after timeout_ms
+bool connect_within(socket_t fd, const struct sockaddr* address, socklen_t len, int timeout_ms) {
+    if (connect(fd, address, len) == 0) return true;
+    if (!connect_pending(socket_error())) return false;
+    struct pollfd pending;
+    pending.fd = fd;
+    pending.events = POLLOUT;
+    pending.revents = 0;
+    if (poll_sockets(&pending, 1, timeout_ms) <= 0) return false;
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    return getsockopt(fd, SOL_SOCKET, SO_ERROR, (char*)&err, &err_len) == 0 && err == 0;
+}
+
+// Connects to host:port within PEER_CONNECT_TIMEOUT_MS, so a peer that
+// drops SYNs doesn't hold its dialer past the next redial; INVALID_SOCKET
+// on failure
+socket_t dial_peer(const std::string& host, const std::string& port) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* found = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0) return INVALID_SOCKET;
+    socket_t fd = INVALID_SOCKET;
+    for (struct addrinfo* a = found; a != nullptr; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd == INVALID_SOCKET) continue;
+        if (set_nonblocking(fd) && connect_within(fd, a->ai_addr, (socklen_t)a->ai_addrlen, PEER_CONNECT_TIMEOUT_MS)) {
+            break;
+        }
+        close_socket(fd);
+        fd = INVALID_SOCKET;
+    }
+    freeaddrinfo(found);
+    return fd;
+}
+
+// Keeps a link to one CLUSTER_PEERS entry up, redialing CLUSTER_RETRY_MS
+// after a failure. Once the node there is known, it isn't redialed while
+// some other link to it (perhaps one it dialed) is up.
+void cluster_dialer(std::string host, std::string port) {
+    std::string peer_id;
+    while (true) {
+        if (peer_id.empty() || !cluster->connected_to(peer_id)) {
+            socket_t fd = dial_peer(host, port);
+            if (fd == INVALID_SOCKET) {
+                log_event(LogLevel::Debug, {"Cluster peer ", host, ":", port, " unreachable"});
+            } else {
+                PeerLinkPtr link = cluster->add_link(fd, true);
+                std::unique_lock<std::mutex> lock(link->mutex);
+                link->closed_cv.wait(lock, [&] { return link->closed; });
+                if (!link->peer_id.empty()) peer_id = link->peer_id;
+            }
+            if (peer_id == NODE_ID) {
+                log_event(LogLevel::Warn, {"Cluster peer ", host, ":", port, " is this node; not dialing it"});
+                return;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(CLUSTER_RETRY_MS));
+    }
+}
+
+void cluster_accept_loop(socket_t listen_fd) {
+    while (true) {
+        socket_t fd = accept(listen_fd, nullptr, nullptr);
+        if (fd == INVALID_SOCKET) {
+            accept_failed();
+            continue;
+        }
+        cluster->add_link(fd, false);
+    }
+}
+
+std::string render_metrics() {
+    Metrics& m = Metrics::instance();
+    size_t room_count;
+    {
+        std::lock_guard<std::mutex> lock(rooms_mutex);
+        room_count = rooms.size();
+    }
+    uint64_t queued_bytes = 0;
+    for (const auto& shard : clients) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        for (const auto& entry : shard->sessions) {
+            queued_bytes += entry.second->queued_bytes.load(std::memory_order_relaxed);
+        }
+    }
+
+    std::string out;
+    render_gauge(out, "chat_sessions", "Open client connections, handshaking ones included.", admission.active());
+    render_gauge(out, "chat_users", "Logged-in users.", users.size());
+    render_gauge(out, "chat_sessions_parked", "Dropped sessions held for a resume, also counted in chat_users.",
+                 resumes.size());
+    render_gauge(out, "chat_rooms", "Rooms, the lobby included.", room_count);
+    render_gauge(out, "chat_outbound_queued_bytes", "Wire bytes waiting in outbound queues.", queued_bytes);
+    render_gauge(out, "chat_cluster_peers", "Peer nodes with an established relay link.",
+                 cluster ? cluster->peer_count() : 0);
+    render_gauge(out, "chat_config_version", "Version of the runtime tuning in force; 1 at startup, each reload adds one.",
+                 tuning().version);
+    render_counter(out, "chat_messages_received_total", "Chat lines and commands received.",
+                   m.counter(Counter::MessagesIn));
+    render_counter(out, "chat_messages_sent_total", "Messages fully written to client sockets.",
+                   m.counter(Counter::MessagesOut));
+    render_counter(out, "chat_bytes_received_total", "Bytes read from client sockets.", m.counter(Counter::BytesIn));
+    render_counter(out, "chat_bytes_sent_total", "Bytes written to client sockets.", m.counter(Counter::BytesOut));
+    render_counter(out, "chat_messages_rate_limited_total", "Inbound messages ignored for exceeding MSG_RATE.",
+                   m.counter(Counter::RateLimited));
+    render_counter(out, "chat_messages_dropped_total", "Outbound messages dropped on a full queue.",
+                   m.counter(Counter::DroppedNewest), "policy=\"drop-newest\"");
+    render_counter(out, "chat_messages_dropped_total", nullptr, m.counter(Counter::DroppedOldest),
+                   "policy=\"drop-oldest\"");
+    render_counter(out, "chat_slow_consumer_disconnects_total", "Clients disconnected for overflowing their queue.",
+                   m.counter(Counter::SlowConsumers));
+    render_counter(out, "chat_handshake_timeouts_total", "Connections dropped before logging in.",
+                   m.counter(Counter::HandshakeTimeouts));
+    render_counter(out, "chat_journal_records_total", "Chat lines written to the journal.",
+                   m.counter(Counter::JournalRecords));
+    render_counter(out, "chat_journal_dropped_total", "Chat lines not journaled: writer behind or failed.",
+                   m.counter(Counter::JournalDropped));
+    render_counter(out, "chat_tls_handshakes_total", "Completed TLS handshakes.", m.counter(Counter::TlsHandshakes));
+    render_counter(out, "chat_tls_resumed_total", "TLS handshakes resumed from a session ticket.",
+                   m.counter(Counter::TlsResumed));
+    render_counter(out, "chat_tls_kernel_total", "TLS connections whose records the kernel encrypts (kTLS).",
+                   m.counter(Counter::TlsKernel));
+    render_counter(out, "chat_deflate_input_bytes_total", "Bytes of lines sent as DEFLATE frames, before compression.",
+                   m.counter(Counter::DeflateIn));
+    render_counter(out, "chat_deflate_output_bytes_total", "Bytes of those DEFLATE frames, counted once per line.",
+                   m.counter(Counter::DeflateOut));
+    render_counter(out, "chat_private_messages_total", "Private /msg lines queued, counted once per recipient.",
+                   m.counter(Counter::PrivateMessages));
+    render_counter(out, "chat_heartbeat_timeouts_total", "Clients dropped for not answering a PING.",
+                   m.counter(Counter::HeartbeatTimeouts));
+    render_counter(out, "chat_write_stalls_total", "Clients dropped for taking no output for WRITE_STALL_TIMEOUT_MS.",
+                   m.counter(Counter::WriteStalls));
+    render_counter(out, "chat_presence_changes_total", "Joins and leaves recorded in room rosters.",
+                   m.counter(Counter::PresenceChanges));
+    render_counter(out, "chat_presence_updates_total", "Roster updates sent to rooms, each batching a window's joins and leaves.",
+                   m.counter(Counter::PresenceUpdates));
+    render_counter(out, "chat_uring_submits_total", "io_uring_enter calls that submitted requests (IO_ENGINE=uring).",
+                   m.counter(Counter::RingSubmits));
+    render_counter(out, "chat_uring_requests_total", "Requests those calls submitted; sends dominate under fan-out.",
+                   m.counter(Counter::RingRequests));
+    render_counter(out, "chat_relay_messages_sent_total", "Room broadcasts queued for peer nodes.",
+                   m.counter(Counter::RelayOut));
+    render_counter(out, "chat_relay_messages_received_total", "Room broadcasts relayed from peer nodes.",
+                   m.counter(Counter::RelayIn));
+    render_counter(out, "chat_relay_messages_dropped_total", "Room broadcasts not relayed: peer link backlog full.",
+                   m.counter(Counter::RelayDropped));
+    render_counter(out, "chat_connections_rejected_total", "Connections refused by admission control.",
+                   admission.rejected(AdmissionControl::Verdict::ServerFull), "reason=\"server_full\"");
+    render_counter(out, "chat_connections_rejected_total", nullptr,
+                   admission.rejected(AdmissionControl::Verdict::AddressFull), "reason=\"address_full\"");
+    render_counter(out, "chat_connections_rejected_total", nullptr,
+                   admission.rejected(AdmissionControl::Verdict::RateLimited), "reason=\"rate_limited\"");
+    render_histogram(out, "chat_broadcast_duration_seconds", "Time to fan a chat line out to its room.",
+                     Histogram::Broadcast);
+    render_histogram(out, "chat_delivery_latency_seconds",
+                     "Time from receiving a chat line to sending its last copy.", Histogram::Delivery);
+    render_histogram(out, "chat_clients_lock_hold_seconds", "Time a client table shard is locked.", Histogram::ClientsLock);
+    return out;
+}
+
+void serve_metrics(socket_t listen_fd) {
+    while (true) {
+        socket_t fd = accept(listen_fd, nullptr, nullptr);
+        if (fd == INVALID_SOCKET) {
+            accept_failed();
+            continue;
+        }
+        // Scrapers send a small GET; read it so closing doesn't reset the
+        // connection, but don't let a silent peer hold the thread
+        #ifdef _WIN32
+            DWORD timeout_ms = 1000;
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout_ms, sizeof(timeout_ms));
+        #else
+            struct timeval timeout = {1, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        #endif
+        char request[BUFFER_SIZE];
+        int received = recv(fd, request, sizeof(request), 0);
+
+        // POST /reload re-reads CONFIG_FILE, like SIGHUP; anything else is a scrape
+        static const char RELOAD[] = "POST /reload";
+        std::string status = "200 OK";
+        std::string content_type = "text/plain; version=0.0.4";
+        std::string body;
+        if (received >= (int)sizeof(RELOAD) - 1 && memcmp(request, RELOAD, sizeof(RELOAD) - 1) == 0) {
+            bool reloaded = tuning_reload(body);
+            log_event(reloaded ? LogLevel::Info : LogLevel::Warn, {body});
+            if (!reloaded) status = "422 Unprocessable Entity";
+            content_type = "text/plain";
+            body += "\n";
+        } else {
+            body = render_metrics();
+        }
+        std::string response = "HTTP/1.0 " + status + "\r\nContent-Type: " + content_type + "\r\nContent-Length: " +
+                               std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        size_t offset = 0;
+        while (offset < response.size()) {
+            int sent = send(fd, response.data() + offset, (int)(response.size() - offset), 0);
+            if (sent <= 0) break;
+            offset += sent;
+        }
+        close_socket(fd);
+    }
+}
+
+// Listening socket on INADDR_ANY:port for the metrics endpoint and the
+// extra reuseport shards; main() still opens the chat socket step by step
+socket_t open_listener(int port, int backlog, bool reuse_port) {
+    socket_t fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == INVALID_SOCKET) return INVALID_SOCKET;
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt));
+    if (reuse_port && !set_reuse_port(fd)) {
+        close_socket(fd);
+        return INVALID_SOCKET;
+    }
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) == SOCKET_ERROR ||
+        listen(fd, backlog) == SOCKET_ERROR) {
+        close_socket(fd);
+        return INVALID_SOCKET;
+    }
+    return fd;
+}
+
+// Reads an integer tunable from the environment, keeping fallback when the
+// variable is unset, malformed or outside [min_value, max_value]
+int env_int(const char* name, int fallback, int min_value, int max_value) {
+    const char* value = std::getenv(name);
+    if (!value) return fallback;
+    try {
+        int v = std::stoi(value);
+        if (v >= min_value && v <= max_value) return v;
+        std::cerr << "Invalid " << name << " environment variable. Using default " << fallback << "." << std::endl;
+    } catch (...) {
+        std::cerr << "Invalid " << name << " format. Using default " << fallback << "." << std::endl;
+    }
+    return fallback;
+}
+
+// One of the listening sockets handed over that is bound to port, taken out
+// of intake; INVALID_SOCKET if there is none
+socket_t handoff_take_listener(HandoffIntake& intake, int port) {
+    for (size_t i = 0; i < intake.listeners.size(); ++i) {
+        struct sockaddr_in address;
+        socklen_t address_len = sizeof(address);
+        if (getsockname(intake.listeners[i], (struct sockaddr*)&address, &address_len) != 0 ||
+            address.sin_family != AF_INET || ntohs(address.sin_port) != port) {
+            continue;
+        }
+        socket_t fd = intake.listeners[i];
+        intake.listeners.erase(intake.listeners.begin() + i);
+        return fd;
+    }
+    return INVALID_SOCKET;
+}
+
+// Sets up what the old server handed over (main, once the reactors exist
+// and before they run). Clients come back into their rooms quietly: the
+// rooms arrive with their history, roster version and pending roster
+// changes, and anyone on the old roster who didn't come along is sent as
+// having left. Parked sessions get a fresh RESUME_GRACE_MS.
+void handoff_restore(HandoffIntake& intake) {
+    std::map<std::string, RoomPtr> handed_rooms;
+    for (const HandedRoom& handed : intake.rooms) {
+        RoomPtr room = std::make_shared<Room>(handed.name, reactors.size());
+        for (const MessageRef& line : handed.lines) room->history.record(line);
+        room->roster_version = handed.roster_version;
+        room->roster_changes = handed.changes;
+        handed_rooms[handed.name] = room;
+        std::lock_guard<std::mutex> lock(rooms_mutex);
+        warm_history.erase(handed.name); // The journal's copy is older
+        if (handed.name == DEFAULT_ROOM) lobby = rooms[DEFAULT_ROOM] = room;
+    }
+    auto room_for = [&handed_rooms](const std::string& name) {
+        auto it = handed_rooms.find(name);
+        return it != handed_rooms.end() ? it->second : lobby;
+    };
+
+    size_t next_reactor = 0;
+    for (HandedSession& handed : intake.sessions) {
+        if (tls_enabled()) {
+            close_socket(handed.fd); // A plaintext client, and we only speak TLS; it reconnects
+            continue;
+        }
+        Reactor* owner = reactors[next_reactor++ % reactors.size()].get();
+        set_nonblocking(handed.fd);
+        admission.adopt(handed.peer_addr);
+        SessionPtr session = std::make_shared<Session>(handed.fd, owner, handed.peer_addr);
+        {
+            ClientShard& shard = *clients[owner->index()];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.sessions[handed.fd] = session;
+        }
+        session->version = handed.version;
+        session->format = handed.format;
+        session->lines = LineDecoder(handed.saw_newline);
+        session->username = users.claim(handed.username, session);
+        session->shared_name = std::make_shared<const std::string>(session->username);
+        session->resume_token = handed.resume_token;
+        session->state = SessionState::Chatting;
+        session_keepalive(*session);
+        RoomPtr room = room_restore(session, room_for(handed.room));
+        {
+            std::lock_guard<std::mutex> lock(rooms_mutex);
+            room->roster.insert(session->username);
+            if (handed.roster_wanted) {
+                session->roster_wanted = true;
+                session->roster_from = handed.roster_from;
+                if (session->version >= 3) ++room->roster_wanted;
+            }
+        }
+        owner->attach(session);
+        if (!handed.pending.empty()) queue_output(session, Message::raw(handed.pending));
+    }
+    for (const HandedParked& handed : intake.parked) {
+        ParkedSession parked;
+        parked.username = users.claim(handed.username, SessionPtr());
+        parked.shared_name = std::make_shared<const std::string>(parked.username);
+        parked.room = room_for(handed.room);
+        {
+            std::lock_guard<std::mutex> lock(rooms_mutex);
+            parked.room->roster.insert(parked.username);
+        }
+        resumes.park(handed.token, parked);
+        reactors[next_reactor++ % reactors.size()]->hold_for_resume(handed.token);
+    }
+    for (const auto& handed : intake.connections) {
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = handed.second;
+        Reactor* owner = reactors[next_reactor % reactors.size()].get();
+        SessionPtr session = admit_connection(handed.first, address, owner);
+        if (!session) continue;
+        ++next_reactor;
+        owner->attach(session);
+    }
+
+    for (const HandedRoom& handed : intake.rooms) {
+        const RoomPtr& room = handed_rooms[handed.name];
+        bool schedule;
+        {
+            std::lock_guard<std::mutex> lock(rooms_mutex);
+            for (const std::string& name : handed.roster) {
+                if (room->roster.count(name) == 0) presence_note(*room, name, false);
+            }
+            schedule = !room->roster_changes.empty() || room->roster_wanted > 0;
+            room->presence_scheduled = schedule;
+        }
+        if (schedule) presence_send(room);
+    }
+    log_event("Took over " + std::to_string(intake.sessions.size()) + " client(s), " +
+              std::to_string(intake.parked.size()) + " held for resume and " +
+              std::to_string(intake.rooms.size()) + " room(s) from the previous server");
+}
+
+// Shared accept mode: the main listener's own thread, dealing sessions out
+// to the reactors round-robin until a drain starts
+void accept_loop(socket_t server_fd) {
+    size_t next_reactor = 0;
+    while (!draining.load()) {
+#if !defined(_WIN32)
+        // Upgradable: the drain can't shut the socket down to wake us, as the
+        // new server accepts on it too, so wait in poll() and look now and then.
+        // The socket is non-blocking then, in case the new server got there first.
+        if (!UPGRADE_SOCKET.empty()) {
+            struct pollfd ready = {server_fd, POLLIN, 0};
+            if (poll(&ready, 1, UPGRADE_POLL_MS) <= 0) continue;
+        }
+#endif
+        struct sockaddr_in client_address;
+        socklen_t client_addr_len = sizeof(client_address);
+        socket_t client_socket = accept(server_fd, (struct sockaddr*)&client_address, &client_addr_len);
+
+        if (client_socket == INVALID_SOCKET) {
+            accept_failed();
+            continue;
+        }
+        if (draining.load()) {
+            // Handed over, the new server has a copy of its own
+            if (handoff_active()) handoff_connection(client_socket, client_address.sin_addr.s_addr);
+            close_socket(client_socket);
+            break;
+        }
+
+        // The owning reactor runs the handshake
+        Reactor* owner = reactors[next_reactor % reactors.size()].get();
+        SessionPtr session = admit_connection(client_socket, client_address, owner);
+        if (!session) continue;
+        ++next_reactor;
+        owner->attach(session);
+    }
+}
+
+// bench_micro.cpp includes this file for the functions it times
+#ifndef CHAT_NO_MAIN
+int main() {
+    init_sockets();
+    install_shutdown_handler();
+
+    // 1. Configuration from Env
+    const char* env_port = std::getenv("PORT");
+    if (env_port) {
+        try {
+            int p = std::stoi(env_port);
+            if (p > 0 && p <= 65535) PORT = p;
+            else std::cerr << "Invalid PORT environment variable. Using default 8080." << std::endl;
+        } catch (...) {
+            std::cerr << "Invalid PORT format. Using default 8080." << std::endl;
+        }
+    }
+
+    const char* env_log_level = std::getenv("LOG_LEVEL");
+    if (env_log_level) {
+        int level = name_index(LOG_LEVEL_NAMES, env_log_level);
+        if (level >= 0) tuning_base.log_level = (LogLevel)level;
+        else std::cerr << "Invalid LOG_LEVEL environment variable. Using debug." << std::endl;
+    }
+    // The runtime tunables' base, which CONFIG_FILE overrides
+    for (const TuningSetting& setting : TUNING_SETTINGS) {
+        tuning_base.*setting.field = env_int(setting.name, tuning_base.*setting.field, setting.min_value,
+                                             setting.max_value);
+    }
+
+    REACTOR_THREADS = env_int("REACTOR_THREADS", REACTOR_THREADS, 0, 256);
+    const char* env_policy = std::getenv("TCP_POLICY");
+    if (env_policy) {
+        std::string policy = env_policy;
+        if (policy == "auto") TCP_POLICY = TcpPolicy::Auto;
+        else if (policy == "nagle") TCP_POLICY = TcpPolicy::Nagle;
+        else if (policy == "nodelay") TCP_POLICY = TcpPolicy::NoDelay;
+        else if (policy == "cork") TCP_POLICY = TcpPolicy::Cork;
+        else std::cerr << "Invalid TCP_POLICY environment variable. Using auto." << std::endl;
+    }
+    LISTEN_BACKLOG = env_int("LISTEN_BACKLOG", LISTEN_BACKLOG, 1, 65535);
+    METRICS_PORT = env_int("METRICS_PORT", METRICS_PORT, 0, 65535);
+    OUTBOUND_QUEUE_DEPTH = env_int("OUTBOUND_QUEUE_DEPTH", OUTBOUND_QUEUE_DEPTH, 1, 1 << 20);
+    // A replay has to fit in the joiner's outbound queue with room to spare
+    HISTORY_DEPTH = std::min(env_int("HISTORY_DEPTH", HISTORY_DEPTH, 0, 1 << 20), OUTBOUND_QUEUE_DEPTH / 2);
+    HISTORY_BYTES = std::min(env_int("HISTORY_BYTES", HISTORY_BYTES, 0, 1 << 30), tuning_base.outbound_queue_bytes / 2);
+    RESUME_GRACE_MS = env_int("RESUME_GRACE_MS", RESUME_GRACE_MS, 0, 3600 * 1000);
+    const char* env_compression = std::getenv("COMPRESSION");
+    if (env_compression) {
+        std::string codec = env_compression;
+        if (codec == "off") {
+            COMPRESSION = false;
+        } else if (codec != "deflate") {
+            std::cerr << "Invalid COMPRESSION environment variable. Using " << (COMPRESSION ? "deflate" : "off") << "." << std::endl;
+        } else if (!COMPRESSION) {
+            std::cerr << "COMPRESSION=deflate needs a build with zlib. Using off." << std::endl;
+        }
+    }
+    if (const char* env_cert = std::getenv("TLS_CERT")) TLS_CERT = env_cert;
+    if (const char* env_key = std::getenv("TLS_KEY")) TLS_KEY = env_key;
+    if (const char* env_ticket_key = std::getenv("TLS_TICKET_KEY")) TLS_TICKET_KEY = env_ticket_key;
+    TLS_KTLS = env_int("TLS_KTLS", TLS_KTLS, 0, 1);
+    if (TLS_KEY.empty()) TLS_KEY = TLS_CERT; // One PEM file may hold both
+    const char* env_overflow = std::getenv("OVERFLOW_POLICY");
+    if (env_overflow) {
+        int policy = name_index(OVERFLOW_POLICY_NAMES, env_overflow);
+        if (policy >= 0) tuning_base.overflow_policy = (OverflowPolicy)policy;
+        else std::cerr << "Invalid OVERFLOW_POLICY environment variable. Using drop-newest." << std::endl;
+    }
+    const char* env_accept = std::getenv("ACCEPT_MODE");
+    if (env_accept) {
+        std::string mode = env_accept;
+        if (mode == "shared") ACCEPT_MODE = AcceptMode::Shared;
+        else if (mode == "reuseport") ACCEPT_MODE = AcceptMode::ReusePort;
+        else std::cerr << "Invalid ACCEPT_MODE environment variable. Using shared." << std::endl;
+    }
+    #if defined(CHAT_POLLER_IOCP)
+        if (ACCEPT_MODE == AcceptMode::ReusePort) {
+            // The IOCP poller can't wait on a listening socket
+            std::cerr << "ACCEPT_MODE=reuseport is not supported on Windows. Using shared." << std::endl;
+            ACCEPT_MODE = AcceptMode::Shared;
+        }
+    #endif
+    const char* env_engine = std::getenv("IO_ENGINE");
+    if (env_engine) {
+        std::string engine = env_engine;
+        if (engine == "poll" || engine == "epoll") IO_ENGINE = IoEngine::Poll;
+        else if (engine == "uring") IO_ENGINE = IoEngine::Uring;
+        else std::cerr << "Invalid IO_ENGINE environment variable. Using poll." << std::endl;
+    }
+    #if !defined(CHAT_URING)
+        if (IO_ENGINE == IoEngine::Uring) {
+            std::cerr << "IO_ENGINE=uring needs a Linux build with io_uring headers (6.1 or later). Using poll." << std::endl;
+            IO_ENGINE = IoEngine::Poll;
+        }
+    #endif
+    if (const char* env_journal = std::getenv("JOURNAL_DIR")) JOURNAL_DIR = env_journal;
+    JOURNAL_SEGMENT_MB = env_int("JOURNAL_SEGMENT_MB", JOURNAL_SEGMENT_MB, 1, 4096);
+    JOURNAL_FSYNC_MS = env_int("JOURNAL_FSYNC_MS", JOURNAL_FSYNC_MS, -1, 3600 * 1000);
+    JOURNAL_SEGMENTS = env_int("JOURNAL_SEGMENTS", JOURNAL_SEGMENTS, 0, 1000000);
+    CLUSTER_PORT = env_int("CLUSTER_PORT", CLUSTER_PORT, 0, 65535);
+    if (const char* env_peers = std::getenv("CLUSTER_PEERS")) CLUSTER_PEERS = env_peers;
+    if (const char* env_node = std::getenv("NODE_ID")) NODE_ID = env_node;
+    if (NODE_ID.empty()) {
+        std::random_device random;
+        char id[17];
+        snprintf(id, sizeof(id), "%08x%08x", (unsigned)random(), (unsigned)random());
+        NODE_ID = id;
+    }
+    CLUSTER_RETRY_MS = env_int("CLUSTER_RETRY_MS", CLUSTER_RETRY_MS, 10, 3600 * 1000);
+    CLUSTER_QUEUE_BYTES = env_int("CLUSTER_QUEUE_BYTES", CLUSTER_QUEUE_BYTES, 64 * 1024, 1 << 30);
+    DRAIN_TIMEOUT_MS = env_int("DRAIN_TIMEOUT_MS", DRAIN_TIMEOUT_MS, 0, 3600 * 1000);
+    DRAIN_SPREAD_MS = env_int("DRAIN_SPREAD_MS", DRAIN_SPREAD_MS, 0, 3600 * 1000);
+    if (const char* env_upgrade = std::getenv("UPGRADE_SOCKET")) UPGRADE_SOCKET = env_upgrade;
+    PIN_THREADS = env_int("PIN_THREADS", PIN_THREADS, -1, 1);
+    if (PIN_THREADS < 0) PIN_THREADS = ACCEPT_MODE == AcceptMode::ReusePort ? 1 : 0;
+    if (REACTOR_THREADS == 0) REACTOR_THREADS = std::max(1u, std::thread::hardware_concurrency());
+    if (const char* env_config = std::getenv("CONFIG_FILE")) CONFIG_FILE = env_config;
+    std::string config_status;
+    if (!tuning_reload(config_status)) {
+        std::cerr << config_status << std::endl;
+        cleanup_sockets();
+        return EXIT_FAILURE;
+    }
+    if (!CONFIG_FILE.empty()) log_event(config_status);
+
+    // 1b. Take over from the server on UPGRADE_SOCKET, if one is running:
+    // its listening sockets stand in for the ones made below
+    HandoffIntake intake;
+    bool taking_over = !UPGRADE_SOCKET.empty() && handoff_receive(intake);
+
+    socket_t server_fd = handoff_take_listener(intake, PORT);
+    struct sockaddr_in server_address;
+
+    if (server_fd == INVALID_SOCKET) {
+        // 2. Create Socket
+        server_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (server_fd == INVALID_SOCKET) {
+            std::cerr << "Socket creation failed." << std::endl;
+            cleanup_sockets();
+            return EXIT_FAILURE;
+        }
+
+        int opt = 1;
+        #ifdef _WIN32
+            if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt)) == SOCKET_ERROR) {
+                 // warning
+            }
+        #else
+            if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+                // warning
+            }
+        #endif
+        if (ACCEPT_MODE == AcceptMode::ReusePort && !set_reuse_port(server_fd)) {
+            std::cerr << "SO_REUSEPORT is not available." << std::endl;
+            close_socket(server_fd);
+            cleanup_sockets();
+            return EXIT_FAILURE;
+        }
+
+        // 3. Bind
+        memset(&server_address, 0, sizeof(server_address));
+        server_address.sin_family = AF_INET;
+        server_address.sin_addr.s_addr = INADDR_ANY;
+        server_address.sin_port = htons(PORT);
+
+        if (bind(server_fd, (struct sockaddr*)&server_address, sizeof(server_address)) == SOCKET_ERROR) {
+            std::cerr << "Bind failed." << std::endl;
+            close_socket(server_fd);
+            cleanup_sockets();
+            return EXIT_FAILURE;
+        }
+
+        // 4. Listen
+        if (listen(server_fd, LISTEN_BACKLOG) == SOCKET_ERROR) {
+            std::cerr << "Listen failed." << std::endl;
+            close_socket(server_fd);
+            cleanup_sockets();
+            return EXIT_FAILURE;
+        }
+    }
+    // The shared accept thread polls when upgradable (see accept_loop)
+    if (ACCEPT_MODE == AcceptMode::Shared && !UPGRADE_SOCKET.empty()) set_nonblocking(server_fd);
+
+    if (METRICS_PORT > 0) {
+        socket_t metrics_fd = handoff_take_listener(intake, METRICS_PORT);
+        if (metrics_fd == INVALID_SOCKET) metrics_fd = open_listener(METRICS_PORT, 16, false);
+        if (metrics_fd == INVALID_SOCKET) {
+            std::cerr << "Metrics listener failed on port " << METRICS_PORT << "." << std::endl;
+            close_socket(server_fd);
+            cleanup_sockets();
+            return EXIT_FAILURE;
+        }
+        handoff_listeners.push_back(metrics_fd);
+        std::thread(serve_metrics, metrics_fd).detach();
+    }
+
+    socket_t cluster_fd = INVALID_SOCKET;
+    if (CLUSTER_PORT > 0 || !CLUSTER_PEERS.empty()) {
+        cluster.reset(new Cluster());
+        if (CLUSTER_PORT > 0) {
+            cluster_fd = handoff_take_listener(intake, CLUSTER_PORT);
+            if (cluster_fd == INVALID_SOCKET) cluster_fd = open_listener(CLUSTER_PORT, 16, false);
+            if (cluster_fd == INVALID_SOCKET) {
+                std::cerr << "Cluster listener failed on port " << CLUSTER_PORT << "." << std::endl;
+                close_socket(server_fd);
+                cleanup_sockets();
+                return EXIT_FAILURE;
+            }
+            handoff_listeners.push_back(cluster_fd);
+        }
+    }
+
+    // 5. Start the reactor threads. All of them exist before any runs, so
+    // reactors and clients never change under a running thread.
+    if (!JOURNAL_DIR.empty() && !journal_start()) {
+        close_socket(server_fd);
+        cleanup_sockets();
+        return EXIT_FAILURE;
+    }
+    if (!TLS_CERT.empty() && !tls_start()) {
+        close_socket(server_fd);
+        cleanup_sockets();
+        return EXIT_FAILURE;
+    }
+    lobby = std::make_shared<Room>(DEFAULT_ROOM, REACTOR_THREADS);
+    journal_warm_up(*lobby);
+    rooms[DEFAULT_ROOM] = lobby;
+    for (int i = 0; i < REACTOR_THREADS; ++i) {
+        reactors.emplace_back(new Reactor(i));
+        clients.emplace_back(new ClientShard());
+    }
+    if (ACCEPT_MODE == AcceptMode::ReusePort) {
+        // Reactor 0 takes the socket made above; the rest bind their own,
+        // or take one of those handed over
+        for (int i = 0; i < REACTOR_THREADS; ++i) {
+            socket_t fd = i == 0 ? server_fd : handoff_take_listener(intake, PORT);
+            if (fd == INVALID_SOCKET) fd = open_listener(PORT, LISTEN_BACKLOG, true);
+            if (fd == INVALID_SOCKET || !reactors[i]->listen_on(fd)) {
+                std::cerr << "Listen failed for reactor " << i << "." << std::endl;
+                cleanup_sockets();
+                return EXIT_FAILURE;
+            }
+            handoff_listeners.push_back(fd);
+        }
+    } else {
+        handoff_listeners.push_back(server_fd);
+    }
+    // Listeners handed over that nobody here wants (a port or reactor count
+    // that changed with the upgrade)
+    for (socket_t fd : intake.listeners) close_socket(fd);
+    if (taking_over) handoff_restore(intake);
+    for (auto& reactor : reactors) reactor->start();
+
+    // Peer links deliver into rooms, so they start once the reactors run
+    if (cluster) {
+        cluster->start();
+        if (cluster_fd != INVALID_SOCKET) std::thread(cluster_accept_loop, cluster_fd).detach();
+        size_t begin = 0;
+        while (begin < CLUSTER_PEERS.size()) {
+            size_t end = CLUSTER_PEERS.find(',', begin);
+            if (end == std::string::npos) end = CLUSTER_PEERS.size();
+            std::string peer = CLUSTER_PEERS.substr(begin, end - begin);
+            begin = end + 1;
+            size_t colon = peer.rfind(':');
+            if (colon == std::string::npos || colon == 0 || colon + 1 == peer.size()) {
+                if (!peer.empty()) std::cerr << "Invalid CLUSTER_PEERS entry \"" << peer << "\". Skipping it." << std::endl;
+                continue;
+            }
+            std::thread(cluster_dialer, peer.substr(0, colon), peer.substr(colon + 1)).detach();
+        }
+        log_event("Cluster node " + NODE_ID + (CLUSTER_PORT > 0 ? " listening for peers on port " +
+                  std::to_string(CLUSTER_PORT) : std::string(" (not accepting peer links)")));
+    }
+
+    log_event("Server started on port " + std::to_string(PORT) + " with " +
+              std::to_string(REACTOR_THREADS) + " reactor thread(s), " +
+              (ACCEPT_MODE == AcceptMode::ReusePort ? "one listener each" : "shared listener") +
+              (IO_ENGINE == IoEngine::Uring ? ", io_uring" : "") + (tls_enabled() ? ", TLS" : ""));
+
+    // 6. Accept Loop (reuseport mode: the reactors accept on their own
+    // listeners)
+    std::thread acceptor;
+    if (ACCEPT_MODE == AcceptMode::Shared) acceptor = std::thread(accept_loop, server_fd);
+    handoff_listen();
+
+    // 7. Drain on SIGTERM/SIGINT: stop accepting, let every reactor send its
+    // clients off and flush them, then write out the journal and the log. A
+    // successor on UPGRADE_SOCKET starts the same drain, with the listeners
+    // left open for it and the clients handed over.
+    wait_for_shutdown([]() {
+        std::string status;
+        bool reloaded = tuning_reload(status);
+        log_event(reloaded ? LogLevel::Info : LogLevel::Warn, {status});
+    });
+    draining.store(true);
+    bool handing_off = handoff_active();
+    log_event((handing_off ? "Upgrading: handing clients over, draining the rest for up to "
+                           : "Shutting down: draining clients for up to ") + std::to_string(DRAIN_TIMEOUT_MS) + " ms");
+    if (ACCEPT_MODE == AcceptMode::Shared && !handing_off) stop_listening(server_fd); // Reactors close their own
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(DRAIN_TIMEOUT_MS);
+    for (auto& reactor : reactors) reactor->drain(deadline);
+    if (handing_off) {
+        if (acceptor.joinable()) acceptor.join(); // Sockets it accepted since go over before DONE
+        handoff_finish(reactors.size());
+    }
+    for (auto& reactor : reactors) reactor->join();
+    journal_stop();
+    log_event("Shutdown complete");
+    Logger::instance().flush();
     cleanup_sockets();
-    return 0;
+    // The metrics, cluster and logger threads are still running; skip static
+    // destructors rather than tear down state they use
+    std::_Exit(EXIT_SUCCESS);
 }
+#endif // CHAT_NO_MAIN
@@ -0,0 +1,191 @@
+#ifndef CHAT_TIMER_WHEEL_H
+#define CHAT_TIMER_WHEEL_H
+
+// Hierarchical timer wheel with millisecond ticks: O(1) schedule and cancel,
+// and expiry work proportional to the timers that actually fire, however
+// many are pending. Not thread-safe; each reactor owns one.
+//
+// Four levels of 64 slots. Level 0 holds timers due within 64 ms, one slot
+// per tick; each level above covers 64 times the span of the one below, and
+// its slot for a stretch of time is spread over the lower levels when the
+// wheel reaches it (a cascade). Delays past the top level's span (about 4.6
+// hours) are cut to it, so an owner with longer timeouts must check on
+// expiry whether it is really due. A bitmap of occupied slots per level lets
+// the wheel skip empty stretches instead of visiting every tick.
+//
+// Timers are intrusive: embed a Timer (or a struct derived from it) in the
+// object it times, and keep the object alive until the timer has fired or
+// been cancelled.
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "scan.h"
+
+struct Timer {
+    Timer* prev = nullptr; // Both null while not scheduled
+    Timer* next = nullptr;
+    uint64_t expires = 0;  // Wheel tick
+    uint32_t slot = 0;     // Index into the wheel's slots while scheduled
+
+    bool scheduled() const { return prev != nullptr; }
+};
+
+class TimerWheel {
+public:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const uint64_t SLOTS = 1ull << SLOT_BITS;
+    static const uint64_t MAX_DELAY = (1ull << (SLOT_BITS * LEVELS)) - 1;
+
+    TimerWheel() : start_(std::chrono::steady_clock::now()), current_(0), pending_(0) {
+        for (int level = 0; level < LEVELS; ++level) {
+            occupied_[level] = 0;
+            for (uint64_t slot = 0; slot < SLOTS; ++slot) {
+                Timer& head = slots_[level][slot];
+                head.prev = head.next = &head;
+            }
+        }
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // Milliseconds since the wheel was made, from the steady clock
+    uint64_t now() const {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start_).count();
+    }
+
+    // The tick expiry has been run up to
+    uint64_t current() const { return current_; }
+
+    size_t pending() const { return pending_; }
+
+    // (Re)schedules timer to fire delay_ms from now
+    void schedule(Timer& timer, uint64_t delay_ms) {
+        schedule_at(timer, now() + (delay_ms < MAX_DELAY ? delay_ms : MAX_DELAY));
+    }
+
+    // (Re)schedules timer for a tick, at most MAX_DELAY past current()
+    void schedule_at(Timer& timer, uint64_t tick) {
+        if (timer.scheduled()) unlink(timer);
+        if (tick <= current_) tick = current_ + 1; // That slot has fired already
+        if (tick - current_ > MAX_DELAY) tick = current_ + MAX_DELAY;
+        timer.expires = tick;
+        insert(timer);
+    }
+
+    void cancel(Timer& timer) {
+        if (timer.scheduled()) unlink(timer);
+    }
+
+    // Runs the wheel up to the current time, calling on_expired(Timer&) for
+    // each timer that came due, unscheduled first so the callback may
+    // schedule it again
+    template <typename OnExpired>
+    void advance(OnExpired&& on_expired) {
+        advance_to(now(), on_expired);
+    }
+
+    // advance() with the time given, for callers that already read the clock
+    template <typename OnExpired>
+    void advance_to(uint64_t target, OnExpired&& on_expired) {
+        if (target < current_) return;
+        while (pending_ > 0 && current_ < target) {
+            uint64_t next = next_event();
+            if (next > target) break;
+            current_ = next;
+            cascade();
+            Timer& head = slots_[0][current_ & (SLOTS - 1)];
+            while (head.next != &head) {
+                Timer& timer = *head.next;
+                unlink(timer);
+                on_expired(timer);
+            }
+        }
+        current_ = target;
+    }
+
+    // Milliseconds until advance() next has work, -1 with nothing scheduled.
+    // That may be a cascade rather than an expiry, which only costs an early
+    // wakeup.
+    int next_timeout_ms() const {
+        if (pending_ == 0) return -1;
+        uint64_t next = next_event();
+        uint64_t elapsed = now();
+        if (next <= elapsed) return 0;
+        uint64_t wait = next - elapsed;
+        return wait > (uint64_t)INT32_MAX ? INT32_MAX : (int)wait;
+    }
+
+private:
+    static int level_shift(int level) { return level * SLOT_BITS; }
+
+    // expires must not be before current_
+    void insert(Timer& timer) {
+        uint64_t delta = timer.expires - current_;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (1ull << level_shift(level + 1))) ++level;
+        uint64_t slot = (timer.expires >> level_shift(level)) & (SLOTS - 1);
+        Timer& head = slots_[level][slot];
+        timer.prev = head.prev;
+        timer.next = &head;
+        head.prev->next = &timer;
+        head.prev = &timer;
+        timer.slot = (uint32_t)(level * SLOTS + slot);
+        occupied_[level] |= 1ull << slot;
+        ++pending_;
+    }
+
+    void unlink(Timer& timer) {
+        timer.prev->next = timer.next;
+        timer.next->prev = timer.prev;
+        timer.prev = timer.next = nullptr;
+        --pending_;
+        const Timer& head = slots_[timer.slot / SLOTS][timer.slot % SLOTS];
+        if (head.next == &head) occupied_[timer.slot / SLOTS] &= ~(1ull << (timer.slot % SLOTS));
+    }
+
+    // At a level boundary, spreads the higher levels' slots for the stretch
+    // starting now over the levels below, top first
+    void cascade() {
+        for (int level = LEVELS - 1; level > 0; --level) {
+            uint64_t span = 1ull << level_shift(level);
+            if ((current_ & (span - 1)) != 0) continue;
+            uint64_t slot = (current_ >> level_shift(level)) & (SLOTS - 1);
+            Timer& head = slots_[level][slot];
+            while (head.next != &head) {
+                Timer& timer = *head.next;
+                unlink(timer);
+                insert(timer);
+            }
+        }
+    }
+
+    // The first tick after current_ with a level 0 slot to fire or a cascade
+    // to run. Below the lowest level in use nothing can come due, so the
+    // wheel jumps straight to that level's next boundary.
+    uint64_t next_event() const {
+        uint64_t offset = current_ & (SLOTS - 1);
+        if (offset != SLOTS - 1) {
+            uint64_t ahead = occupied_[0] & (~0ull << (offset + 1));
+            if (ahead != 0) return current_ - offset + (uint64_t)scan_ctz(ahead);
+        }
+        int level = 1; // Level 0 slots behind us come due after the wrap
+        if (occupied_[0] == 0) {
+            while (level < LEVELS - 1 && occupied_[level] == 0) ++level;
+        }
+        uint64_t span = 1ull << level_shift(level);
+        return (current_ | (span - 1)) + 1;
+    }
+
+    std::chrono::steady_clock::time_point start_;
+    uint64_t current_;
+    size_t pending_;
+    uint64_t occupied_[LEVELS];
+    Timer slots_[LEVELS][SLOTS]; // List heads
+};
+
+#endif // CHAT_TIMER_WHEEL_H